@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Run memload with memoptimizer off, with the kernel's own defaults and
+# with memoptimizer running at each aggressiveness level, and report
+# compaction stalls, allocation stalls, THP fallbacks and page fault
+# latency of each run. Must be run as root from the source directory
+# after "make memoptimizer memload".
+#
+# usage: bench.sh [seconds per run] [seed]
+#
+# Runs should be longer than the time memoptimizer needs to fill its
+# trend windows, LOOKBACK samples at the periodicity of the
+# aggressiveness level, or the daemon never gets to act.
+
+TIME=${1:-600}
+SEED=${2:-1}
+WSF=/proc/sys/vm/watermark_scale_factor
+PROACTIVE=/proc/sys/vm/compaction_proactiveness
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "bench.sh must be run as root" >&2
+	exit 1
+fi
+if [ ! -x ./memoptimizer ] || [ ! -x ./memload ]; then
+	echo "Run make memoptimizer memload first" >&2
+	exit 1
+fi
+
+orig_wsf=$(cat $WSF)
+orig_proactive=$(cat $PROACTIVE 2>/dev/null)
+daemon=
+
+restore()
+{
+	if [ -n "$daemon" ]; then
+		kill -TERM $daemon 2>/dev/null
+		wait $daemon 2>/dev/null
+		daemon=
+	fi
+	echo $orig_wsf > $WSF
+	[ -n "$orig_proactive" ] && echo $orig_proactive > $PROACTIVE
+}
+
+trap 'restore; exit 1' INT TERM
+
+# Start every run from the same state of page cache and free lists
+reset_memory()
+{
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	[ -w /proc/sys/vm/compact_memory ] && echo 1 > /proc/sys/vm/compact_memory
+}
+
+run()
+{
+	name=$1
+	reset_memory
+	case $name in
+	defaults)
+		echo 10 > $WSF
+		[ -n "$orig_proactive" ] && echo 20 > $PROACTIVE
+		;;
+	aggr*)
+		./memoptimizer -d -a ${name#aggr} > bench-$name.log 2>&1 &
+		daemon=$!
+		;;
+	esac
+	printf "%-10s %s\n" $name "$(./memload -t $TIME -s $SEED)"
+	restore
+}
+
+echo "memload for $TIME sec per run, seed $SEED"
+for scenario in off defaults aggr1 aggr2 aggr3; do
+	run $scenario
+done
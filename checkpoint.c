@@ -0,0 +1,549 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+#include "node.h"
+#include "checkpoint.h"
+#include "tune.h"
+
+#define	CHECKPOINT_DIR		"/run/memoptimizer"
+#define	CHECKPOINT_FILE		CHECKPOINT_DIR"/state"
+#define	CHECKPOINT_TMP		CHECKPOINT_DIR"/state.tmp"
+#define	BOOT_ID			"/proc/sys/kernel/random/boot_id"
+
+#define	CHECKPOINT_MAGIC	0x544f504d	/* "MPOT" */
+#define	CHECKPOINT_VERSION	5
+#define	BOOT_ID_LEN		40
+
+/*
+ * Layout of the checkpoint file. A header is followed by a record for
+ * each node, which is followed by the set of trend lines of the node
+ * and, in pagetype mode, of each zone and migratetype. A set of trend
+ * lines is a record followed by the lookback window of x samples, the
+ * lookback rows of y samples and a record for each order.
+ *
+ * Sample times are CLOCK_MONOTONIC_RAW, which keeps counting across
+ * restarts of the daemon but not across reboots, and counters in
+ * vmstat are reset by a reboot, so a checkpoint is only good for the
+ * boot it was taken in. The state of a trend line depends on the model
+ * and its parameters, which must match as well.
+ */
+struct checkpoint_header {
+	uint32_t magic;
+	uint32_t version;
+	char boot_id[BOOT_ID_LEN];
+	int64_t msecs;			/* When checkpoint was taken */
+	int32_t max_order;
+	int32_t trend_model;
+	int32_t lookback;
+	int32_t trend_alpha;
+	int32_t trend_beta;
+	int32_t pagetype_mode;
+	int32_t wsf;			/* watermark_scale_factor we set last */
+	int32_t nr_nodes;
+	int32_t auto_tune;
+	double reclaim_lead;		/* Tunables as of the checkpoint */
+	double compact_window;
+	double wsf_step;
+};
+
+struct checkpoint_node {
+	int32_t nid;
+	int32_t compaction_measured;
+	int32_t cgroup_reclaim_measured;
+	int32_t has_zones;
+	uint64_t last_stolen;
+	int64_t last_reclaim_msecs;
+	int64_t reclaim_avg;
+	int64_t compaction_rate;
+	int64_t cgroup_reclaim_avg;
+	uint64_t last_bigpages;
+	int64_t last_bigpages_msecs;
+	double compact_tokens;
+	int64_t budget_msecs;
+};
+
+struct checkpoint_zone {
+	char name[ZONE_NAME_LEN];
+	int32_t seen;
+};
+
+/*
+ * A set whose buffers could not be allocated is saved as absent, with
+ * none of its samples or lines following
+ */
+struct checkpoint_set {
+	int32_t present;
+	int32_t next;
+	int32_t count;
+	double last_x;
+	double mean_x;
+	double sxx;
+	double mean_y[LSQ_LINES];
+	double sxy[LSQ_LINES];
+	double syy[LSQ_LINES];
+};
+
+struct checkpoint_lsq {
+	int32_t count;
+	double last_x;
+	double mean_x;
+	double mean_y;
+	double sxx;
+	double sxy;
+	double syy;
+	double weight;
+	double weight2;
+	double level;
+	double trend;
+	double trend_var;
+	double dof;
+	double resid_var;
+	double slope_err;
+};
+
+static long long
+now_msecs(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &spec);
+	return (spec.tv_sec * 1000LL) + (spec.tv_nsec / 1000000);
+}
+
+static int
+read_boot_id(char *boot_id)
+{
+	ssize_t n;
+	int fd;
+
+	memset(boot_id, 0, BOOT_ID_LEN);
+	if ((fd = open(BOOT_ID, O_RDONLY)) == -1)
+		return 0;
+	n = read(fd, boot_id, BOOT_ID_LEN - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	boot_id[strcspn(boot_id, "\n")] = 0;
+
+	return 1;
+}
+
+static int
+save_lsq(FILE *f, struct lsq_struct *lsq)
+{
+	struct checkpoint_lsq rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.count = lsq->count;
+	rec.last_x = lsq->last_x;
+	rec.mean_x = lsq->mean_x;
+	rec.mean_y = lsq->mean_y;
+	rec.sxx = lsq->sxx;
+	rec.sxy = lsq->sxy;
+	rec.syy = lsq->syy;
+	rec.weight = lsq->weight;
+	rec.weight2 = lsq->weight2;
+	rec.level = lsq->level;
+	rec.trend = lsq->trend;
+	rec.trend_var = lsq->trend_var;
+	rec.dof = lsq->dof;
+	rec.resid_var = lsq->resid_var;
+	rec.slope_err = lsq->slope_err;
+
+	return (fwrite(&rec, sizeof(rec), 1, f) == 1);
+}
+
+static void
+restore_lsq(struct lsq_struct *lsq, struct checkpoint_lsq *rec)
+{
+	lsq->count = rec->count;
+	lsq->last_x = rec->last_x;
+	lsq->mean_x = rec->mean_x;
+	lsq->mean_y = rec->mean_y;
+	lsq->sxx = rec->sxx;
+	lsq->sxy = rec->sxy;
+	lsq->syy = rec->syy;
+	lsq->weight = rec->weight;
+	lsq->weight2 = rec->weight2;
+	lsq->level = rec->level;
+	lsq->trend = rec->trend;
+	lsq->trend_var = rec->trend_var;
+	lsq->dof = rec->dof;
+	lsq->resid_var = rec->resid_var;
+	lsq->slope_err = rec->slope_err;
+}
+
+static int
+save_trends(FILE *f, struct trend_set *ts, int count)
+{
+	struct checkpoint_set rec;
+	size_t rows = (size_t)lookback * LSQ_LINES;
+	int i, order;
+
+	for (i = 0; i < count; i++, ts++) {
+		memset(&rec, 0, sizeof(rec));
+		if (ts->x == NULL) {
+			if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+				return 0;
+			continue;
+		}
+		rec.present = 1;
+		rec.next = ts->next;
+		rec.count = ts->count;
+		rec.last_x = ts->last_x;
+		rec.mean_x = ts->mean_x;
+		rec.sxx = ts->sxx;
+		memcpy(rec.mean_y, ts->mean_y, sizeof(rec.mean_y));
+		memcpy(rec.sxy, ts->sxy, sizeof(rec.sxy));
+		memcpy(rec.syy, ts->syy, sizeof(rec.syy));
+		if ((fwrite(&rec, sizeof(rec), 1, f) != 1) ||
+		    (fwrite(ts->x, sizeof(double), lookback, f) != lookback) ||
+		    (fwrite(ts->y, sizeof(double), rows, f) != rows))
+			return 0;
+		for (order = 0; order < MAX_ORDER; order++)
+			if (!save_lsq(f, &ts->lines[order]))
+				return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Read state of count sets of trend lines into ts, or skip over it if
+ * ts is NULL. Sets saved as absent, and sets in ts whose buffers could
+ * not be allocated, are left as they are.
+ */
+static int
+load_trends(FILE *f, struct trend_set *ts, int count)
+{
+	struct checkpoint_set rec;
+	struct checkpoint_lsq lines[MAX_ORDER];
+	size_t rows = (size_t)lookback * LSQ_LINES;
+	int i, order;
+
+	for (i = 0; i < count; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1)
+			return 0;
+		if (!rec.present) {
+			if (ts)
+				ts++;
+			continue;
+		}
+		if ((ts == NULL) || (ts->x == NULL)) {
+			if (fseek(f, (lookback + rows) * sizeof(double) +
+					sizeof(lines), SEEK_CUR))
+				return 0;
+			if (ts)
+				ts++;
+			continue;
+		}
+		if ((rec.next < 0) || (rec.next >= lookback) ||
+		    (rec.count < 0) || (rec.count > lookback))
+			return 0;
+		if ((fread(ts->x, sizeof(double), lookback, f) != lookback) ||
+		    (fread(ts->y, sizeof(double), rows, f) != rows) ||
+		    (fread(lines, sizeof(lines), 1, f) != 1))
+			return 0;
+		for (order = 0; order < MAX_ORDER; order++)
+			if ((lines[order].count < 0) ||
+			    (lines[order].count > lookback))
+				return 0;
+		ts->next = rec.next;
+		ts->count = rec.count;
+		ts->last_x = rec.last_x;
+		ts->mean_x = rec.mean_x;
+		ts->sxx = rec.sxx;
+		memcpy(ts->mean_y, rec.mean_y, sizeof(rec.mean_y));
+		memcpy(ts->sxy, rec.sxy, sizeof(rec.sxy));
+		memcpy(ts->syy, rec.syy, sizeof(rec.syy));
+		for (order = 0; order < MAX_ORDER; order++)
+			restore_lsq(&ts->lines[order], &lines[order]);
+		ts++;
+	}
+
+	return 1;
+}
+
+static int
+save_node(FILE *f, struct node_state *node)
+{
+	struct checkpoint_node rec;
+	struct checkpoint_zone zrec;
+	int i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.nid = node->nid;
+	rec.compaction_measured = node->compaction_measured;
+	rec.cgroup_reclaim_measured = node->cgroup_reclaim_measured;
+	rec.has_zones = (node->zones != NULL);
+	rec.last_stolen = node->last_stolen;
+	rec.last_reclaim_msecs = node->last_reclaim_msecs;
+	rec.reclaim_avg = node->reclaim_avg;
+	rec.compaction_rate = node->compaction_rate;
+	rec.cgroup_reclaim_avg = node->cgroup_reclaim_avg;
+	rec.last_bigpages = node->last_bigpages;
+	rec.last_bigpages_msecs = node->last_bigpages_msecs;
+	rec.compact_tokens = node->compact_tokens;
+	rec.budget_msecs = node->budget_msecs;
+	if ((fwrite(&rec, sizeof(rec), 1, f) != 1) ||
+	    !save_trends(f, &node->trends, 1))
+		return 0;
+
+	if (node->zones == NULL)
+		return 1;
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		struct zone_frag *zf = &node->zones[i];
+
+		memset(&zrec, 0, sizeof(zrec));
+		memcpy(zrec.name, zf->name, ZONE_NAME_LEN);
+		zrec.seen = zf->seen;
+		if ((fwrite(&zrec, sizeof(zrec), 1, f) != 1) ||
+		    !save_trends(f, zf->trends, NR_MIGRATETYPES))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Restore state of a node from the checkpoint. State for a node that
+ * is no longer online is skipped.
+ */
+static int
+load_node(FILE *f)
+{
+	struct checkpoint_node rec;
+	struct checkpoint_zone zrec;
+	struct node_state *node;
+	int i;
+
+	if (fread(&rec, sizeof(rec), 1, f) != 1)
+		return 0;
+	node = find_node(rec.nid);
+	if (!load_trends(f, node ? &node->trends : NULL, 1))
+		return 0;
+
+	if (node) {
+		node->compaction_measured = rec.compaction_measured;
+		node->cgroup_reclaim_measured = rec.cgroup_reclaim_measured;
+		node->last_stolen = rec.last_stolen;
+		node->last_reclaim_msecs = rec.last_reclaim_msecs;
+		node->reclaim_avg = rec.reclaim_avg;
+		node->compaction_rate = rec.compaction_rate;
+		node->cgroup_reclaim_avg = rec.cgroup_reclaim_avg;
+		node->last_bigpages = rec.last_bigpages;
+		node->last_bigpages_msecs = rec.last_bigpages_msecs;
+		node->compact_tokens = rec.compact_tokens;
+		node->budget_msecs = rec.budget_msecs;
+	}
+
+	if (!rec.has_zones)
+		return 1;
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		struct zone_frag *zf = NULL;
+
+		if (node && node->zones)
+			zf = &node->zones[i];
+		if ((fread(&zrec, sizeof(zrec), 1, f) != 1) ||
+		    !load_trends(f, zf ? zf->trends : NULL, NR_MIGRATETYPES))
+			return 0;
+		if (zf) {
+			memcpy(zf->name, zrec.name, ZONE_NAME_LEN);
+			zf->name[ZONE_NAME_LEN - 1] = 0;
+			zf->seen = zrec.seen;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Save trend lines and rates of all nodes along with the
+ * watermark_scale_factor set last, -1 if none. The checkpoint is
+ * written to a temporary file and renamed into place so a crash while
+ * saving never leaves a partial checkpoint behind.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+save_checkpoint(int wsf)
+{
+	struct checkpoint_header hdr;
+	struct node_state *node;
+	FILE *f;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (!read_boot_id(hdr.boot_id))
+		return 0;
+	hdr.magic = CHECKPOINT_MAGIC;
+	hdr.version = CHECKPOINT_VERSION;
+	hdr.msecs = now_msecs();
+	hdr.max_order = MAX_ORDER;
+	hdr.trend_model = trend_model;
+	hdr.lookback = lookback;
+	hdr.trend_alpha = trend_alpha;
+	hdr.trend_beta = trend_beta;
+	hdr.pagetype_mode = pagetype_mode;
+	hdr.wsf = wsf;
+	hdr.nr_nodes = nr_nodes;
+	hdr.auto_tune = auto_tune;
+	hdr.reclaim_lead = tunables.reclaim_lead;
+	hdr.compact_window = tunables.compact_window;
+	hdr.wsf_step = tunables.wsf_step;
+
+	if ((mkdir(CHECKPOINT_DIR, 0755) == -1) && (errno != EEXIST)) {
+		log_warn("Failed to create "CHECKPOINT_DIR" (%s)", strerror(errno));
+		return 0;
+	}
+	if ((fd = open(CHECKPOINT_TMP, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+			0600)) == -1) {
+		log_warn("Failed to open "CHECKPOINT_TMP" (%s)", strerror(errno));
+		return 0;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+	for_each_node(node)
+		if (!save_node(f, node))
+			goto err;
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto err;
+	}
+
+	if (rename(CHECKPOINT_TMP, CHECKPOINT_FILE) == -1) {
+		log_warn("Failed to save "CHECKPOINT_FILE" (%s)", strerror(errno));
+		unlink(CHECKPOINT_TMP);
+		return 0;
+	}
+	log_info(4, "Saved state of %d node(s) to "CHECKPOINT_FILE, nr_nodes);
+	return 1;
+
+err:
+	log_warn("Failed to write "CHECKPOINT_TMP" (%s)", strerror(errno));
+	if (f)
+		fclose(f);
+	unlink(CHECKPOINT_TMP);
+	return 0;
+}
+
+/*
+ * Restore trend lines and rates saved by a previous run in the same
+ * boot, so predictions can be made right away instead of after a full
+ * lookback window. A checkpoint older than the lookback window is not
+ * used since the trend it holds has nothing to do with memory usage
+ * now. wsf is set to the watermark_scale_factor the previous run set
+ * last, if any.
+ *
+ * Returns:
+ *	1	State restored
+ *	0	No usable checkpoint
+ */
+int
+load_checkpoint(int *wsf)
+{
+	struct checkpoint_header hdr;
+	char boot_id[BOOT_ID_LEN];
+	long long age;
+	FILE *f;
+	int i;
+
+	if ((f = fopen(CHECKPOINT_FILE, "re")) == NULL) {
+		if (errno != ENOENT)
+			log_warn("Failed to open "CHECKPOINT_FILE" (%s)", strerror(errno));
+		return 0;
+	}
+
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    (hdr.magic != CHECKPOINT_MAGIC) ||
+	    (hdr.version != CHECKPOINT_VERSION)) {
+		log_info(2, "Ignoring "CHECKPOINT_FILE", not a checkpoint of this version");
+		goto out;
+	}
+	hdr.boot_id[BOOT_ID_LEN - 1] = 0;
+	if (!read_boot_id(boot_id) || strcmp(boot_id, hdr.boot_id)) {
+		log_info(2, "Ignoring "CHECKPOINT_FILE" from an earlier boot");
+		goto out;
+	}
+	if ((hdr.max_order != MAX_ORDER) || (hdr.trend_model != trend_model) ||
+	    (hdr.lookback != lookback) || (hdr.trend_alpha != trend_alpha) ||
+	    (hdr.trend_beta != trend_beta) ||
+	    (hdr.pagetype_mode != pagetype_mode)) {
+		log_info(2, "Ignoring "CHECKPOINT_FILE", trend model settings have changed");
+		goto out;
+	}
+	age = now_msecs() - hdr.msecs;
+	if ((age < 0) || (age > (long long)lookback * periodicity * 1000)) {
+		log_info(2, "Ignoring "CHECKPOINT_FILE", %lld msec old", age);
+		goto out;
+	}
+
+	/*
+	 * Trend line state is only filled in once all of it has been
+	 * read, so if the file turns out to be short, trend lines that
+	 * were not restored start out empty as they would without a
+	 * checkpoint
+	 */
+	for (i = 0; i < hdr.nr_nodes; i++) {
+		if (!load_node(f)) {
+			log_warn("Failed to read all of "CHECKPOINT_FILE);
+			goto out;
+		}
+	}
+	fclose(f);
+
+	if (hdr.auto_tune) {
+		struct tunables t = {
+			.reclaim_lead = hdr.reclaim_lead,
+			.compact_window = hdr.compact_window,
+			.wsf_step = hdr.wsf_step,
+		};
+
+		restore_tunables(&t);
+	}
+	*wsf = hdr.wsf;
+	pr_info("Restored state of %d node(s) saved %lld msec ago", hdr.nr_nodes, age);
+	return 1;
+
+out:
+	fclose(f);
+	return 0;
+}
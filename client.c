@@ -0,0 +1,146 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "client.h"
+
+/*
+ * Nothing here logs or allocates, so the library can be used from any
+ * program. Errors are returned in errno.
+ */
+#define CONTROL_CLIENT_TIMEOUT	5	/* sec, for the daemon to reply */
+
+/*
+ * Send command cmd to the daemon listening on path, or on
+ * CONTROL_SOCKET_DEFAULT if path is NULL, and read its reply into
+ * reply. A reply of "error ..." sets errno to EINVAL.
+ *
+ * Returns:
+ *	1	Daemon replied "ok"
+ *	0	Daemon returned an error or could not be reached
+ */
+int
+control_request(const char *path, const char *cmd, char *reply, size_t size)
+{
+	struct timeval tv = { .tv_sec = CONTROL_CLIENT_TIMEOUT };
+	struct sockaddr_un sun;
+	char line[CONTROL_CMD_SIZE];
+	size_t len = 0;
+	ssize_t n;
+	int fd, err;
+
+	reply[0] = 0;
+	if (path == NULL)
+		path = CONTROL_SOCKET_DEFAULT;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		snprintf(reply, size, "error socket path is too long\n");
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	strcpy(sun.sun_path, path);
+	if ((n = snprintf(line, sizeof(line), "%s\n", cmd)) >= sizeof(line)) {
+		snprintf(reply, size, "error command is too long\n");
+		errno = E2BIG;
+		return 0;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1)
+		goto err;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if ((connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) ||
+	    (send(fd, line, n, MSG_NOSIGNAL) != n)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		goto err;
+	}
+
+	while (len < size - 1) {
+		if ((n = read(fd, reply + len, size - 1 - len)) <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			break;
+		}
+		len += n;
+	}
+	reply[len] = 0;
+	close(fd);
+
+	if (strncmp(reply, "ok", 2) == 0)
+		return 1;
+	errno = EINVAL;
+	return 0;
+
+err:
+	err = errno;
+	snprintf(reply, size, "error %s: %s\n", path, strerror(err));
+	errno = err;
+	return 0;
+}
+
+/*
+ * Announce that count blocks of order order are about to be allocated
+ * on node nid, or evenly across nodes if nid is HINT_ALL_NODES, within
+ * secs seconds. The daemon reclaims and compacts ahead of them and
+ * drops the hint once secs have passed. Returns the id of the hint to
+ * cancel it with, or -1 on error.
+ */
+int
+memoptimizer_hint(const char *path, int nid, int order, unsigned long count,
+		long secs)
+{
+	char cmd[CONTROL_CMD_SIZE], reply[CONTROL_REPLY_SIZE], node[16];
+
+	if (nid == HINT_ALL_NODES)
+		strcpy(node, "all");
+	else
+		snprintf(node, sizeof(node), "%d", nid);
+	snprintf(cmd, sizeof(cmd), "hint %lu %d %s %ld", count, order, node,
+		secs);
+	if (!control_request(path, cmd, reply, sizeof(reply)))
+		return -1;
+
+	return atoi(reply + 2);
+}
+
+/*
+ * Drop hint id, for when the allocations it announced are done or
+ * called off before its time is up. Returns 0 on success, -1 on error.
+ */
+int
+memoptimizer_cancel_hint(const char *path, int id)
+{
+	char cmd[CONTROL_CMD_SIZE], reply[CONTROL_REPLY_SIZE];
+
+	snprintf(cmd, sizeof(cmd), "cancel %d", id);
+	return control_request(path, cmd, reply, sizeof(reply)) ? 0 : -1;
+}
@@ -0,0 +1,56 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef CLIENT_H
+#define	CLIENT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Client side of the control socket of memoptimizer. This is built into
+ * libmemoptimizer.a so applications can announce allocation bursts to
+ * the daemon ahead of time without depending on anything else in it.
+ *
+ * A client connects, sends one command on a line and reads back a
+ * reply that starts with "ok" or "error", after which the connection
+ * is closed. Any user who can connect to the socket can send hints,
+ * other commands that change what the daemon does are for root only.
+ */
+#define CONTROL_SOCKET_DEFAULT	"/run/memoptimizer/control"
+#define CONTROL_CMD_SIZE	256
+#define CONTROL_REPLY_SIZE	1024
+
+#define HINT_ALL_NODES		-1
+
+extern int control_request(const char *, const char *, char *, size_t);
+extern int memoptimizer_hint(const char *, int, int, unsigned long, long);
+extern int memoptimizer_cancel_hint(const char *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLIENT_H */
@@ -0,0 +1,307 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#define	_GNU_SOURCE
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "predict.h"
+#include "control.h"
+
+/*
+ * Commands are read and answered by the main loop itself, between
+ * samples, so a command never races with a cycle. Clients are read
+ * without blocking, whatever they have sent so far is kept in their
+ * slot until a whole line is in. A client that does not send its
+ * command within CONTROL_TIMEOUT msec is dropped, as is the one that
+ * has waited longest when a new client finds all slots taken.
+ */
+#define CONTROL_TIMEOUT		100	/* msec */
+
+struct control_client {
+	uid_t uid;
+	long long deadline;		/* msec, CLOCK_MONOTONIC */
+	size_t len;
+	char cmd[CONTROL_CMD_SIZE];
+};
+
+static struct pollfd *client_fds;
+static struct control_client clients[MAX_CONTROL_CLIENTS];
+
+static long long
+control_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+close_client(int i)
+{
+	close(client_fds[i].fd);
+	client_fds[i].fd = -1;
+	client_fds[i].revents = 0;
+}
+
+/*
+ * Set up the MAX_CONTROL_CLIENTS entries of the main loop's poll array
+ * at pfds for clients to be read from
+ */
+void
+init_control(struct pollfd *pfds)
+{
+	int i;
+
+	client_fds = pfds;
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		client_fds[i].fd = -1;
+		client_fds[i].events = POLLIN;
+	}
+}
+
+static int
+control_addr(const char *path, struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if ((path[0] != '/') || (strlen(path) >= sizeof(sun->sun_path))) {
+		log_err("Control socket \"%s\" is not an absolute path that fits in a socket address", path);
+		return 0;
+	}
+	strcpy(sun->sun_path, path);
+	return 1;
+}
+
+/*
+ * Listen for commands on unix socket path, with the given mode and,
+ * unless group is empty, owned by group. Who can connect is up to the
+ * mode, what a client may do is decided from its credentials. The
+ * directory the socket is in is created if it does not exist yet.
+ * Returns the socket or -1 on error.
+ */
+int
+open_control(const char *path, mode_t mode, const char *group)
+{
+	struct sockaddr_un sun;
+	char dir[PATH_MAX], *p;
+	struct group *gr = NULL;
+	int fd;
+
+	if (!control_addr(path, &sun))
+		return -1;
+	if (group[0] && ((gr = getgrnam(group)) == NULL)) {
+		log_err("No group \"%s\" for control socket", group);
+		return -1;
+	}
+	strcpy(dir, path);
+	if (((p = strrchr(dir, '/')) != NULL) && (p != dir)) {
+		*p = 0;
+		if ((mkdir(dir, 0755) == -1) && (errno != EEXIST))
+			log_warn("Failed to create %s (%s)", dir, strerror(errno));
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+			0)) == -1) {
+		log_err("Failed to create control socket (%s)", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if ((bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) ||
+	    (gr && (chown(path, -1, gr->gr_gid) == -1)) ||
+	    (chmod(path, mode) == -1) || (listen(fd, 8) == -1)) {
+		log_err("Failed to listen on %s for commands (%s)", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Make room for a new client, by closing the client whose time is up
+ * first if all slots are taken. Returns the slot.
+ */
+static int
+free_client(void)
+{
+	int i, oldest = 0;
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		if (client_fds[i].fd < 0)
+			return i;
+		if (clients[i].deadline < clients[oldest].deadline)
+			oldest = i;
+	}
+	close_client(oldest);
+	return oldest;
+}
+
+/*
+ * Accept the connections waiting on the control socket lfd, each into
+ * a free client slot
+ */
+void
+accept_control(int lfd)
+{
+	struct ucred cred;
+	socklen_t credlen;
+	int fd, i;
+
+	while ((fd = accept4(lfd, NULL, NULL,
+			SOCK_CLOEXEC|SOCK_NONBLOCK)) != -1) {
+		credlen = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred,
+				&credlen) == -1) {
+			log_err("Failed to get credentials of control client (%s)", strerror(errno));
+			close(fd);
+			continue;
+		}
+		i = free_client();
+		client_fds[i].fd = fd;
+		client_fds[i].events = POLLIN;
+		clients[i].uid = cred.uid;
+		clients[i].len = 0;
+		clients[i].cmd[0] = 0;
+		clients[i].deadline = control_msecs() + CONTROL_TIMEOUT;
+	}
+	if ((errno != EAGAIN) && (errno != EINTR) && (errno != ECONNABORTED))
+		log_err("Failed to accept control connection (%s)", strerror(errno));
+}
+
+/*
+ * Read what client i has sent so far. Once a whole command is in, it is
+ * put in cmd without the trailing newline and the user id of the
+ * client in uid, and the reply is to be sent with reply_control().
+ * A client that closes the connection or sends too long a line is
+ * dropped.
+ *
+ * Returns:
+ *	1	Command read
+ *	0	Command not complete yet, or client dropped
+ */
+int
+read_control(int i, char *cmd, size_t size, uid_t *uid)
+{
+	struct control_client *c = &clients[i];
+	size_t len;
+	ssize_t n;
+	char *nl;
+
+	if (client_fds[i].fd < 0)
+		return 0;
+	while (1) {
+		n = read(client_fds[i].fd, c->cmd + c->len,
+				sizeof(c->cmd) - 1 - c->len);
+		if (n > 0) {
+			c->len += n;
+			c->cmd[c->len] = 0;
+			if (memchr(c->cmd, '\n', c->len) ||
+			    (c->len == sizeof(c->cmd) - 1))
+				break;
+			continue;
+		}
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if ((n < 0) && (errno == EAGAIN))
+			return 0;
+		/*
+		 * Connection closed, a command without a newline is
+		 * still taken, a client that sent nothing is dropped
+		 */
+		if (c->len == 0) {
+			close_client(i);
+			return 0;
+		}
+		break;
+	}
+	if ((nl = strchr(c->cmd, '\n')) != NULL)
+		*nl = 0;
+	else if (c->len == sizeof(c->cmd) - 1)
+		c->cmd[0] = 0;
+	if (((len = strlen(c->cmd)) > 0) && (c->cmd[len - 1] == '\r'))
+		c->cmd[len - 1] = 0;
+	if (c->cmd[0] == 0) {
+		close_client(i);
+		return 0;
+	}
+	snprintf(cmd, size, "%s", c->cmd);
+	*uid = c->uid;
+	return 1;
+}
+
+/*
+ * Send the reply to the command of client i and close the connection.
+ * A reply fits in the socket buffer, a client that has not made room
+ * for it gets none.
+ */
+void
+reply_control(int i, const char *reply)
+{
+	size_t len = strlen(reply);
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(client_fds[i].fd, reply, len,
+				MSG_NOSIGNAL|MSG_DONTWAIT)) <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			break;
+		}
+		reply += n;
+		len -= n;
+	}
+	close_client(i);
+}
+
+/*
+ * Drop clients that ran out of time. Returns the msec until the next
+ * client runs out of time, to wait for at most, or -1 if there are no
+ * clients.
+ */
+int
+expire_control(void)
+{
+	long long now = control_msecs(), next = -1;
+	int i;
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+		if (client_fds[i].fd < 0)
+			continue;
+		if (clients[i].deadline <= now) {
+			log_info(3, "Dropping control client that did not send a command in time");
+			close_client(i);
+			continue;
+		}
+		if ((next < 0) || (clients[i].deadline - now < next))
+			next = clients[i].deadline - now;
+	}
+	return next;
+}
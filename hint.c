@@ -0,0 +1,200 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <stdio.h>
+#include <string.h>
+#include "predict.h"
+#include "hint.h"
+
+static struct hint hints[MAX_HINTS];
+static int last_id;
+
+/*
+ * Add a hint from user uid for count blocks of order order on node
+ * nid, due within secs seconds of now (msec). Returns the id of the
+ * hint, or -1 if there is no room for another one.
+ */
+int
+add_hint(int nid, int order, unsigned long count, long secs, long long now,
+	uid_t uid)
+{
+	struct hint *h, *slot = NULL;
+	int nr_user = 0;
+
+	for (h = hints; h < hints + MAX_HINTS; h++) {
+		if ((h->id == 0) || (h->deadline <= now)) {
+			if (slot == NULL)
+				slot = h;
+		}
+		else if (h->uid == uid) {
+			nr_user++;
+		}
+	}
+	if ((slot == NULL) || ((uid != 0) && (nr_user >= MAX_USER_HINTS)))
+		return -1;
+
+	h = slot;
+	if (++last_id <= 0)
+		last_id = 1;
+	h->id = last_id;
+	h->uid = uid;
+	h->nid = nid;
+	h->order = order;
+	h->pages = count << order;
+	h->deadline = now + secs * 1000LL;
+	if (nid < 0) {
+		log_info(2, "Hint %d: %lu order %d blocks on all nodes within %ld sec", h->id, count, order, secs);
+	}
+	else {
+		log_info(2, "Hint %d: %lu order %d blocks on node %d within %ld sec", h->id, count, order, nid, secs);
+	}
+
+	return h->id;
+}
+
+/*
+ * Drop hint id before its deadline on behalf of user uid. Returns 1 if
+ * there was such a hint the user may cancel.
+ */
+int
+cancel_hint(int id, uid_t uid)
+{
+	struct hint *h;
+
+	for (h = hints; h < hints + MAX_HINTS; h++) {
+		if ((id > 0) && (h->id == id) &&
+		    ((uid == 0) || (h->uid == uid))) {
+			h->id = 0;
+			log_info(2, "Hint %d cancelled", id);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Drop hints whose deadline has passed. By then the burst they
+ * announced has either happened and shows in the trend lines, or is
+ * not coming.
+ */
+void
+expire_hints(long long now)
+{
+	struct hint *h;
+
+	for (h = hints; h < hints + MAX_HINTS; h++) {
+		if (h->id && (h->deadline <= now)) {
+			log_info(2, "Hint %d expired", h->id);
+			h->id = 0;
+		}
+	}
+}
+
+int
+nr_active_hints(void)
+{
+	struct hint *h;
+	int nr = 0;
+
+	for (h = hints; h < hints + MAX_HINTS; h++)
+		if (h->id)
+			nr++;
+	return nr;
+}
+
+/*
+ * Base pages user uid has asked for in hints in effect on node nid, or
+ * on all nodes if nid is -1. A hint for all nodes counts for each node
+ * with its share.
+ */
+unsigned long
+user_hint_pages(uid_t uid, int nid, int nr_nodes, long long now)
+{
+	unsigned long pages = 0;
+	struct hint *h;
+
+	for (h = hints; h < hints + MAX_HINTS; h++) {
+		if ((h->id == 0) || (h->deadline <= now) || (h->uid != uid))
+			continue;
+		if ((nid < 0) || (h->nid == nid))
+			pages += h->pages;
+		else if (h->nid < 0)
+			pages += h->pages / nr_nodes;
+	}
+	return pages;
+}
+
+/*
+ * List hints in effect into buf, one per line as id, node (-1 for all
+ * nodes), order, base pages and sec left
+ */
+void
+format_hints(char *buf, size_t size, long long now)
+{
+	struct hint *h;
+	size_t len = 0;
+
+	buf[0] = 0;
+	for (h = hints; (h < hints + MAX_HINTS) && (len < size); h++) {
+		if ((h->id == 0) || (h->deadline <= now))
+			continue;
+		len += snprintf(buf + len, size - len, "%d %d %d %lu %lld\n",
+				h->id, h->nid, h->order, h->pages,
+				(h->deadline - now) / 1000);
+	}
+}
+
+/*
+ * Demand on node nid, one of nr_nodes, from hints in effect at now
+ * (msec). Pages a hint asks for are taken to come at an even rate
+ * over the time left to its deadline, but no faster than over
+ * min_msecs, so the rate does not shoot up as the deadline gets close.
+ * A hint for all nodes is split evenly between them. The highest
+ * order asked for is returned along with the rate (pages/msec).
+ */
+void
+hint_demand(int nid, int nr_nodes, long long now, long long min_msecs,
+		struct demand *d)
+{
+	struct hint *h;
+
+	d->rate = 0;
+	d->order = -1;
+	for (h = hints; h < hints + MAX_HINTS; h++) {
+		long long left;
+		double pages;
+
+		if ((h->id == 0) || (h->deadline <= now) ||
+		    ((h->nid >= 0) && (h->nid != nid)))
+			continue;
+
+		pages = h->pages;
+		if ((h->nid < 0) && (nr_nodes > 1))
+			pages /= nr_nodes;
+		left = h->deadline - now;
+		if (left < min_msecs)
+			left = min_msecs;
+		d->rate += pages / left;
+		if (h->order > d->order)
+			d->order = h->order;
+	}
+}
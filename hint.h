@@ -0,0 +1,68 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef HINT_H
+#define	HINT_H
+
+#include <sys/types.h>
+#include "predict.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A hint announces an allocation burst ahead of time: count blocks of
+ * the given order on a node, or spread over all nodes if nid is -1,
+ * within some seconds. Hints are held against the trend of free pages
+ * until their deadline passes or they are cancelled. Users other than
+ * root can have up to MAX_USER_HINTS in effect at a time, for no more
+ * than MAX_USER_HINT_PCT percent of the memory of the nodes they are
+ * for altogether, and cancel only their own.
+ */
+#define MAX_HINTS		64
+#define MAX_USER_HINTS		8
+#define MAX_USER_HINT_PCT	10
+#define MAX_HINT_SECS		86400
+
+struct hint {
+	int id;			/* 0 if the slot is free */
+	uid_t uid;		/* User who sent the hint */
+	int nid;		/* -1 for all nodes */
+	int order;
+	unsigned long pages;	/* Base pages asked for */
+	long long deadline;	/* msec, CLOCK_MONOTONIC_RAW */
+};
+
+extern int add_hint(int, int, unsigned long, long, long long, uid_t);
+extern int cancel_hint(int, uid_t);
+extern void expire_hints(long long);
+extern int nr_active_hints(void);
+extern unsigned long user_hint_pages(uid_t, int, int, long long);
+extern void format_hints(char *, size_t, long long);
+extern void hint_demand(int, int, long long, long long, struct demand *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HINT_H */
@@ -0,0 +1,410 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+
+/*
+ * memload - generate reproducible fragmentation and free memory
+ * drawdown and measure what it costs allocations
+ *
+ * The same seed always issues the same sequence of operations:
+ * page cache fill through a file, churn of anonymous mappings of
+ * random sizes, THP faults in mappings that are later partly unmapped
+ * and mlock()ed allocations that are held for a while. The time each
+ * first touch of a page takes is recorded as page fault latency, and
+ * compaction stalls, allocation stalls and THP fallbacks are counted
+ * from /proc/vmstat over the run. Results are printed as one line of
+ * name=value pairs so runs can be compared by a script.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+
+#define VMSTAT		"/proc/vmstat"
+#define CACHE_FILE	"/var/tmp/memload.XXXXXX"
+
+#define MB		(1024UL * 1024)
+#define THP_SIZE	(2 * MB)
+#define CACHE_CHUNK	MB
+#define PIN_SIZE	(64 * 1024)
+#define MAX_ANON_SIZE	MB
+#define NR_SLOTS	4096
+
+/*
+ * Page fault latency histogram. Latencies below 2 * LAT_SUB nsec have
+ * a bucket each, above that each power of 2 is split into LAT_SUB
+ * buckets, so a bucket is never more than 1/LAT_SUB wide.
+ */
+#define LAT_SUB		16
+#define NR_LAT_BUCKETS	(2 * LAT_SUB + 58 * LAT_SUB)
+
+int verbose, debug_mode;
+
+static unsigned long long lat_hist[NR_LAT_BUCKETS];
+static unsigned long long nr_faults, max_lat;
+static unsigned long long rng_state;
+static long page_size;
+
+/*
+ * Mappings held by the load. Each one is anonymous memory, a THP
+ * mapping partly unmapped once it is released or a pinned range.
+ */
+enum slot_type {
+	SLOT_FREE,
+	SLOT_ANON,
+	SLOT_THP,
+	SLOT_PINNED
+};
+
+struct slot {
+	int type;
+	char *addr;
+	size_t size;
+};
+
+static struct slot slots[NR_SLOTS];
+static size_t anon_bytes, pinned_bytes;
+
+void
+log_msg(int level, char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+/* xorshift64*, so a seed gives the same sequence on every system */
+static unsigned long long
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned long long
+now_nsecs(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+static int
+lat_bucket(unsigned long long ns)
+{
+	int shift = 0;
+
+	if (ns < 2 * LAT_SUB)
+		return ns;
+	while ((ns >> shift) >= 2 * LAT_SUB)
+		shift++;
+	if (shift > 58)
+		return NR_LAT_BUCKETS - 1;
+	return LAT_SUB + shift * LAT_SUB + (ns >> shift) - LAT_SUB;
+}
+
+/* Smallest latency that falls into bucket */
+static unsigned long long
+lat_value(int bucket)
+{
+	int shift;
+
+	if (bucket < 2 * LAT_SUB)
+		return bucket;
+	shift = (bucket - LAT_SUB) / LAT_SUB;
+	return (unsigned long long)(bucket - shift * LAT_SUB) << shift;
+}
+
+static unsigned long long
+lat_percentile(double pct)
+{
+	unsigned long long seen = 0, target;
+	int i;
+
+	target = nr_faults * pct / 100;
+	for (i = 0; i < NR_LAT_BUCKETS; i++) {
+		seen += lat_hist[i];
+		if (seen > target)
+			return lat_value(i);
+	}
+	return max_lat;
+}
+
+/*
+ * Touch every page of a new mapping, timing the fault each first touch
+ * takes. step is the distance between faults, a page or a THP.
+ */
+static void
+touch(char *addr, size_t size, size_t step)
+{
+	unsigned long long start, lat;
+	size_t off;
+
+	for (off = 0; off < size; off += step) {
+		start = now_nsecs();
+		addr[off] = 1;
+		lat = now_nsecs() - start;
+		lat_hist[lat_bucket(lat)]++;
+		nr_faults++;
+		if (lat > max_lat)
+			max_lat = lat;
+	}
+}
+
+static void
+release(struct slot *s)
+{
+	switch (s->type) {
+	case SLOT_ANON:
+		munmap(s->addr, s->size);
+		anon_bytes -= s->size;
+		break;
+	case SLOT_THP:
+		/*
+		 * Keep every other base page so the THP is split and
+		 * leaves fragmented memory behind until it is freed
+		 * for good on the next release
+		 */
+		if (s->size == THP_SIZE) {
+			size_t off;
+
+			for (off = page_size; off < THP_SIZE;
+			     off += 2 * page_size)
+				munmap(s->addr + off, page_size);
+			s->size = THP_SIZE / 2;
+			return;
+		}
+		munmap(s->addr, THP_SIZE);
+		anon_bytes -= THP_SIZE;
+		break;
+	case SLOT_PINNED:
+		munlock(s->addr, s->size);
+		munmap(s->addr, s->size);
+		pinned_bytes -= s->size;
+		break;
+	}
+	s->type = SLOT_FREE;
+}
+
+static void
+map_anon(struct slot *s)
+{
+	size_t size;
+
+	size = (1 + rng() % (MAX_ANON_SIZE / page_size)) * page_size;
+	s->addr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (s->addr == MAP_FAILED)
+		return;
+	touch(s->addr, size, page_size);
+	s->type = SLOT_ANON;
+	s->size = size;
+	anon_bytes += size;
+}
+
+static void
+map_thp(struct slot *s)
+{
+	char *addr;
+	size_t skip;
+
+	/* Map twice the size to find a THP aligned range in it */
+	addr = mmap(NULL, 2 * THP_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return;
+	skip = THP_SIZE - ((unsigned long)addr & (THP_SIZE - 1));
+	if (skip == THP_SIZE)
+		skip = 0;
+	if (skip)
+		munmap(addr, skip);
+	munmap(addr + skip + THP_SIZE, THP_SIZE - skip);
+	s->addr = addr + skip;
+
+	madvise(s->addr, THP_SIZE, MADV_HUGEPAGE);
+	/*
+	 * Only the first touch is timed, the rest of the range is mapped
+	 * by it unless the kernel fell back to base pages
+	 */
+	touch(s->addr, THP_SIZE, THP_SIZE);
+	memset(s->addr, 1, THP_SIZE);
+	s->type = SLOT_THP;
+	s->size = THP_SIZE;
+	anon_bytes += THP_SIZE;
+}
+
+static void
+map_pinned(struct slot *s)
+{
+	s->addr = mmap(NULL, PIN_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (s->addr == MAP_FAILED)
+		return;
+	touch(s->addr, PIN_SIZE, page_size);
+	if (mlock(s->addr, PIN_SIZE) == -1) {
+		munmap(s->addr, PIN_SIZE);
+		return;
+	}
+	s->type = SLOT_PINNED;
+	s->size = PIN_SIZE;
+	pinned_bytes += PIN_SIZE;
+}
+
+/*
+ * Write the next chunk of the cache file, wrapping around at its size,
+ * so page cache keeps growing until it takes up size bytes
+ */
+static void
+fill_cache(int fd, size_t size, off_t *off)
+{
+	static char chunk[CACHE_CHUNK];
+
+	memset(chunk, (int)rng(), sizeof(chunk));
+	if (pwrite(fd, chunk, sizeof(chunk), *off) != sizeof(chunk))
+		perror("memload: write");
+	*off += sizeof(chunk);
+	if (*off >= size)
+		*off = 0;
+}
+
+static void
+usage(char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-m anon_mb] [-c cache_mb] [-s seed]\n"
+		"\t-t\tLength of the run (default 60)\n"
+		"\t-m\tAnonymous and THP memory to churn (default 40%% of available memory)\n"
+		"\t-c\tPage cache to fill (default 40%% of available memory)\n"
+		"\t-s\tSeed for the sequence of operations (default 1)\n",
+		progname);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct procfs_file vmstat;
+	struct vmstat_counters before, after;
+	char cache_path[] = CACHE_FILE;
+	unsigned long long end;
+	size_t anon_limit, cache_size, avail;
+	off_t cache_off = 0;
+	int seconds = 60, c, fd, i;
+
+	page_size = getpagesize();
+	avail = (size_t)sysconf(_SC_AVPHYS_PAGES) * page_size;
+	anon_limit = cache_size = avail / 10 * 4;
+	rng_state = 1;
+
+	while ((c = getopt(argc, argv, "t:m:c:s:h")) != -1) {
+		switch (c) {
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			anon_limit = strtoul(optarg, NULL, 10) * MB;
+			break;
+		case 'c':
+			cache_size = strtoul(optarg, NULL, 10) * MB;
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (rng_state == 0)
+		rng_state = 1;
+	if (cache_size < CACHE_CHUNK)
+		cache_size = CACHE_CHUNK;
+
+	if (!procfs_open(&vmstat, VMSTAT) || !read_vmstat(&vmstat, &before)) {
+		fprintf(stderr, "memload: failed to read "VMSTAT" (%s)\n", strerror(errno));
+		return 1;
+	}
+	if ((fd = mkstemp(cache_path)) == -1) {
+		fprintf(stderr, "memload: failed to create %s (%s)\n", cache_path, strerror(errno));
+		return 1;
+	}
+	unlink(cache_path);
+
+	/*
+	 * Anonymous churn makes up most of the operations, interleaved
+	 * with page cache fill, THP faults and pinned allocations. Once
+	 * the limit on anonymous memory is reached, a random slot is
+	 * released instead. Pinned memory is held to 1/16 of it.
+	 */
+	end = now_nsecs() + seconds * 1000000000ULL;
+	while (now_nsecs() < end) {
+		struct slot *s = &slots[rng() % NR_SLOTS];
+		unsigned int op = rng() % 100;
+
+		if (op < 20) {
+			fill_cache(fd, cache_size, &cache_off);
+			continue;
+		}
+		if ((s->type != SLOT_FREE) || (anon_bytes >= anon_limit)) {
+			if (s->type != SLOT_FREE)
+				release(s);
+			continue;
+		}
+		if (op < 70)
+			map_anon(s);
+		else if (op < 90)
+			map_thp(s);
+		else if (pinned_bytes < anon_limit / 16)
+			map_pinned(s);
+	}
+
+	if (!read_vmstat(&vmstat, &after)) {
+		fprintf(stderr, "memload: failed to read "VMSTAT"\n");
+		return 1;
+	}
+	for (i = 0; i < NR_SLOTS; i++) {
+		while (slots[i].type != SLOT_FREE)
+			release(&slots[i]);
+	}
+	close(fd);
+
+	printf("faults=%llu p50_us=%.2f p99_us=%.2f p999_us=%.2f max_us=%.2f compact_stall=%lu allocstall=%lu thp_fallback=%lu\n",
+		nr_faults, lat_percentile(50) / 1000.0,
+		lat_percentile(99) / 1000.0, lat_percentile(99.9) / 1000.0,
+		max_lat / 1000.0, after.compact_stall - before.compact_stall,
+		after.allocstall - before.allocstall,
+		after.thp_fallback - before.thp_fallback);
+
+	return 0;
+}
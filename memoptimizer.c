@@ -24,8 +24,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <time.h>
 #include <limits.h>
+#include <malloc.h>
 #include <pthread.h>
 #include <search.h>
 #include <stdio.h>
@@ -33,40 +35,286 @@
 #include <stdarg.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/timerfd.h>
 #include "predict.h"
+#include "procfs.h"
+#include "node.h"
+#include "worker.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "stats.h"
+#include "metrics.h"
+#include "tune.h"
+#include "control.h"
+#include "hint.h"
+#include "stall.h"
 
 #define VERSION		"1.4.2"
 
-#define	COMPACT_PATH_FORMAT	"/sys/devices/system/node/node%d/compact"
 #define	BUDDYINFO		"/proc/buddyinfo"
 #define ZONEINFO		"/proc/zoneinfo"
 #define RESCALE_WMARK		"/proc/sys/vm/watermark_scale_factor"
 #define VMSTAT			"/proc/vmstat"
-#define HUGEPAGESINFO		"/sys/kernel/mm/hugepages"
+#define PSI_MEMORY		"/proc/pressure/memory"
+#define PAGETYPEINFO		"/proc/pagetypeinfo"
+#define PROACTIVENESS		"/proc/sys/vm/compaction_proactiveness"
+#define THP_PMD_SIZE		"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
 
 #define CONFIG_FILE1		"/etc/sysconfig/memoptimizer"
 #define CONFIG_FILE2		"/etc/default/memoptimizer"
 
-#define MAX_NUMANODES	1024
+#define MAX_PSI_TRIGGERS	4
+#define PSI_TRIGGER_LEN		64
+
+/*
+ * In PSI mode, stretch the sampling interval by this factor once a
+ * full lookback window has gone by with no pressure event and no
+ * action recommended.
+ */
+#define PSI_IDLE_FACTOR		4
+
+/*
+ * Number of samples reclaim and compaction rates of a node are smoothed
+ * over
+ */
+#define RATE_SMOOTHING		4
+
+/*
+ * Weighted urgency, in percent, of nodes short of free pages at which
+ * watermark_scale_factor is raised for all nodes. See
+ * decide_watermarks().
+ */
+#define GLOBAL_RECLAIM_SHARE	25
+
+/*
+ * Defaults for the PI watermark controller, see control_watermarks().
+ * The setpoint is in percent of the high watermark at the kernel's
+ * default watermark_scale_factor, KERNEL_WSF, the deadband in percent
+ * of the setpoint and the dwell time in seconds. KP is the change in
+ * WSF for free pages short of the setpoint by all of it, KI the change
+ * per minute they stay that far short.
+ */
+#define KERNEL_WSF		10
+#define DEF_WSF_SETPOINT	150
+#define DEF_WSF_KP		200
+#define DEF_WSF_KI		100
+#define DEF_WSF_DEADBAND	10
+#define DEF_WSF_DWELL		120
+
+/*
+ * Cost of reclaiming an anon page relative to dropping a clean file
+ * page. An anon page has to be written out to swap, or compressed when
+ * zswap takes most swap outs, and is likely to be faulted back in
+ * later. Dirty file pages have to be written back first and count as
+ * DIRTY_RECLAIM_COST clean pages.
+ */
+#define ANON_SWAP_COST		8
+#define ANON_ZSWAP_COST		2
+#define DIRTY_RECLAIM_COST	2
+
+/*
+ * Percentage of reclaimed pages refaulting back in at which reclaim is
+ * considered to be thrashing, and fewest pages reclaimed per sample for
+ * the ratio to be meaningful
+ */
+#define THRASH_REFAULT_PCT	50
+#define MIN_THRASH_SAMPLE	256
+
+/*
+ * Fewest pages a compaction must migrate for its duration to be used
+ * as a measure of compaction rate
+ */
+#define MIN_COMPACT_SAMPLE	512
+
+/*
+ * Highest compaction_proactiveness to set when compaction is needed
+ * and how much it is lowered by per sample once it is not
+ */
+#define MAX_PROACTIVENESS	90
+#define PROACTIVENESS_STEP	10
+
+#define CPULIST_LEN		256
+
+/*
+ * Slots in the array of file descriptors the main loop waits on
+ */
+#define POLL_TIMER		0
+#define POLL_CONTROL		1
+#define POLL_CLIENT		2
+#define POLL_PSI		(POLL_CLIENT + MAX_CONTROL_CLIENTS)
+#define MAX_POLL_FDS		(POLL_PSI + MAX_PSI_TRIGGERS)
 
 #define MAX_VERBOSE 5
 #define MAX_AGGRESSIVE 3
 
-unsigned long min_wmark[MAX_NUMANODES], low_wmark[MAX_NUMANODES];
-unsigned long high_wmark[MAX_NUMANODES], managed_pages[MAX_NUMANODES];
-unsigned long total_free_pages, total_cache_pages, total_hugepages, base_psize;
-long compaction_rate, reclaim_rate;
-struct lsq_struct page_lsq[MAX_NUMANODES][MAX_ORDER];
+unsigned long total_free_pages, total_cheap_pages, total_hugepages;
 int dry_run;
 int debug_mode, verbose;
 unsigned long maxgap;
 int aggressiveness = 2;
 int periodicity;
+int lookback = LSQ_LOOKBACK;
+
+/*
+ * Files sampled every cycle. These are opened once at startup and
+ * re-read in place.
+ */
+struct procfs_file buddyinfo, zoneinfo, vmstat, pagetypeinfo;
+
+/*
+ * Model fragmentation per zone and migratetype from /proc/pagetypeinfo
+ * and base compaction decisions on movable free lists only
+ */
+int pagetype_mode;
+
+
+/*
+ * Memory pressure triggers registered with /proc/pressure/memory. If
+ * any triggers are configured, sampling is driven by pressure events
+ * in addition to the sampling interval.
+ */
+char psi_trigger[MAX_PSI_TRIGGERS][PSI_TRIGGER_LEN];
+int nr_psi_triggers;
+
+/*
+ * Samples are taken on ticks of an absolute CLOCK_MONOTONIC timer so
+ * the time spent sampling and acting on predictions does not push out
+ * the next sample. last_tick is the deadline of the last tick the
+ * timer fired for and the next deadline, next_tick, is always computed
+ * from it. A tick that has already passed by the time it is scheduled
+ * counts as an overrun.
+ */
+struct pollfd poll_fds[MAX_POLL_FDS];
+struct timespec last_tick, next_tick;
+unsigned long tick_overruns;
+
+/*
+ * Scheduling policy, priority and CPU affinity for the daemon
+ */
+int sched_policy = SCHED_OTHER;
+int sched_priority;
+char cpu_affinity[CPULIST_LEN];
+
+/*
+ * Where to serve metrics, a unix socket path or [address:]port. Metrics
+ * are not exported if empty.
+ */
+char metrics_listen[PATH_MAX];
+
+/*
+ * Unix socket to take commands on, none if empty. See run_command()
+ * for the commands.
+ */
+char control_socket[PATH_MAX];
+
+/*
+ * Mode and group of the control socket. Only root can connect by
+ * default, other users can send hints once the socket is opened up to
+ * them.
+ */
+int control_mode = 0600;
+char control_group[64];
+
+/*
+ * Taking actions is paused through the control socket. Samples are
+ * still taken and trend lines kept current while paused.
+ */
+int paused;
+
+/*
+ * Keep the daemon locked in memory. Heap is grown by LOCKED_ARENA_SIZE
+ * up front for whatever libc allocates later, the main thread stack is
+ * faulted in LOCKED_STACK_SIZE deep and worker threads get a stack
+ * of that size instead of the default.
+ */
+#define LOCKED_ARENA_SIZE	(4UL << 20)
+#define LOCKED_STACK_SIZE	(256UL << 10)
+int lock_mem;
+
+/*
+ * Adapt sampling interval to predicted time to exhaustion instead of
+ * sampling at fixed periodicity
+ */
+int adaptive_sampling;
+
+/*
+ * How compaction is carried out. Full mode compacts a whole node at a
+ * time through its compact file, limited by a per node budget of
+ * compact_budget msec of compaction per minute (0 for no limit).
+ * Proactive mode raises compaction_proactiveness as fragmentation gets
+ * closer so the kernel compacts in the background, a little at a time.
+ * proactiveness is the value set last, orig_proactiveness the value to
+ * restore on exit.
+ */
+enum compaction_mode {
+	COMPACT_FULL,
+	COMPACT_PROACTIVE
+};
+int compaction_mode = COMPACT_FULL;
+int compact_budget = 2000;
+int proactiveness = -1, orig_proactiveness = -1;
+
+/*
+ * How reclamation is started. Watermark mode raises
+ * watermark_scale_factor, which makes kswapd reclaim more on all nodes.
+ * Cgroup mode asks the kernel to reclaim the pages a node is short of
+ * from that node only, through memory.reclaim of reclaim_cgroup, a
+ * cgroup v2 path relative to where cgroup v2 is mounted (the root
+ * cgroup if empty). reclaim_swappiness is passed along with each
+ * request if set.
+ */
+enum reclaim_mode {
+	RECLAIM_WATERMARK,
+	RECLAIM_CGROUP
+};
+int reclaim_mode = RECLAIM_WATERMARK;
+char reclaim_cgroup[PATH_MAX];
+int reclaim_swappiness = -1;
+
+/*
+ * How watermark_scale_factor is controlled. Step mode raises and lowers
+ * it in steps from the verdicts of predictions. PI mode steers free
+ * pages towards a setpoint above high watermark with a proportional
+ * integral controller.
+ */
+enum wsf_control {
+	WSF_CONTROL_STEP,
+	WSF_CONTROL_PI
+};
+int wsf_control = WSF_CONTROL_STEP;
+int wsf_setpoint = DEF_WSF_SETPOINT;
+int wsf_kp = DEF_WSF_KP;
+int wsf_ki = DEF_WSF_KI;
+int wsf_deadband = DEF_WSF_DEADBAND;
+int wsf_dwell = DEF_WSF_DWELL;
+
+/*
+ * Set by SIGTERM or SIGINT to end the main loop
+ */
+static volatile sig_atomic_t terminate;
+
+/*
+ * Set by SIGUSR1 to log the daemon's own counters and timings
+ */
+static volatile sig_atomic_t dump_stats;
+
+/*
+ * Set by SIGHUP to read the configuration file again
+ */
+static volatile sig_atomic_t reload_config;
 
 /*
  * Highest value to set watermark_scale_factor to. This value is tied
@@ -77,6 +325,12 @@ int periodicity;
 unsigned int maxwsf = 700;
 unsigned int mywsf;
 
+/*
+ * watermark_scale_factor as last set by us, -1 if we have not set it.
+ * Saved in checkpoints so a restarted daemon knows it owns the value.
+ */
+int wsf_set = -1;
+
 /*
  * Highest order pages to lok at for fragmentation. Ignore order 10
  * pages, they require moving around lots of pages to create and thus
@@ -87,10 +341,205 @@ unsigned int mywsf;
  */
 int max_compaction_order = MAX_ORDER - 4;
 
+/*
+ * Sampling interval and highest compaction order set through the
+ * control socket in place of the ones the aggressiveness level comes
+ * with, 0 if not set
+ */
+int periodicity_override, compaction_order_override;
+
+/*
+ * Order of transparent hugepages, -1 if THP is not supported or its
+ * order is beyond what is tracked. See check_compaction() for how it is
+ * used.
+ */
+int thp_order = -1;
+
+/*
+ * Rates of allocation stalls and THP fallbacks, smoothed over
+ * RATE_SMOOTHING samples
+ */
+struct stall_rates stall_rates;
+
+/*
+ * Stall rates as they stand for a node, with the time threads on the
+ * node spent stalled if stalls are traced
+ */
+static void
+node_stall_rates(struct node_state *node, struct stall_rates *rates)
+{
+	*rates = stall_rates;
+	rates->reclaim_time = node->reclaim_stall_time;
+	rates->compact_time = node->compact_stall_time;
+}
+
+/*
+ * Peak resident set size of the daemon in kB
+ */
+static long
+peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return -1;
+	return ru.ru_maxrss;
+}
+
+static void
+handle_terminate(int sig)
+{
+	terminate = 1;
+}
+
+static void
+handle_dump_stats(int sig)
+{
+	dump_stats = 1;
+}
+
+static void
+handle_reload(int sig)
+{
+	reload_config = 1;
+}
+
+/*
+ * Find the order of transparent hugepages from the size of a PMD
+ * mapping
+ */
+static void
+get_thp_order(void)
+{
+	char buf[32];
+	long long size = 0;
+	unsigned long pages;
+	ssize_t n;
+	int fd, order;
+
+	if ((trace_mode != TRACE_REPLAY) &&
+	    ((fd = open(THP_PMD_SIZE, O_RDONLY)) != -1)) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n > 0) {
+			buf[n] = 0;
+			size = strtoul(buf, NULL, 10);
+		}
+	}
+	trace_value(TRACE_PMD_SIZE, &size);
+	if (size <= 0)
+		return;
+
+	pages = size / getpagesize();
+	for (order = 0; (1UL << order) < pages; order++)
+		;
+	if (((1UL << order) == pages) && (order > 0) &&
+	    (order < MAX_ORDER - 1))
+		thp_order = order;
+}
+
+/*
+ * Read current value of compaction_proactiveness. Returns -1 if the
+ * kernel does not support proactive compaction.
+ */
+static int
+get_proactiveness(void)
+{
+	char buf[16];
+	long long val = -1;
+	ssize_t n;
+	int fd;
+
+	if ((trace_mode != TRACE_REPLAY) &&
+	    ((fd = open(PROACTIVENESS, O_RDONLY)) != -1)) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n > 0) {
+			buf[n] = 0;
+			val = atoi(buf);
+		}
+	}
+	trace_value(TRACE_PROACTIVENESS, &val);
+
+	return val;
+}
+
+/*
+ * Read current value of watermark_scale_factor from the kernel.
+ * Returns -1 on failure.
+ */
+static int
+read_wsf(void)
+{
+	char buf[16];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(RESCALE_WMARK, O_RDONLY)) == -1)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return atoi(buf);
+}
+
+/*
+ * Current value of watermark_scale_factor as the daemon acts on it.
+ * When a trace is replayed, watermark_scale_factor starts out at the
+ * value recorded and then follows what the replay sets it to.
+ */
+static int
+get_wsf(void)
+{
+	long long val = -1;
+
+	if (trace_mode == TRACE_REPLAY) {
+		if (wsf_set >= 0)
+			return wsf_set;
+		trace_value(TRACE_WSF, &val);
+		return val;
+	}
+
+	val = read_wsf();
+	trace_value(TRACE_WSF, &val);
+
+	return val;
+}
+
+/*
+ * Set compaction_proactiveness. Returns 1 on success, 0 on failure.
+ */
+static int
+set_proactiveness(int val)
+{
+	char buf[16];
+	int fd, len, ret = 1;
+
+	len = snprintf(buf, sizeof(buf), "%d\n", val);
+	if ((fd = open(PROACTIVENESS, O_WRONLY)) == -1) {
+		log_err("Failed to open "PROACTIVENESS" (%s)", strerror(errno));
+		return 0;
+	}
+	if (write(fd, buf, len) != len) {
+		log_err("Failed to write to "PROACTIVENESS" (%s)", strerror(errno));
+		ret = 0;
+	}
+	else {
+		proactiveness = val;
+	}
+	close(fd);
+
+	return ret;
+}
 
 void
 bailout(int retval)
 {
+	if (!dry_run && (orig_proactiveness >= 0) &&
+	    (proactiveness != orig_proactiveness))
+		set_proactiveness(orig_proactiveness);
 	closelog();
 	exit(retval);
 }
@@ -104,11 +553,16 @@ log_msg(int level, char *fmt, ...)
 	if (debug_mode) {
 		char stamp[32], prepend[16];
 		time_t now;
-		struct tm *timenow;
+		struct tm timenow;
 
 		now = time(NULL);
-		timenow = localtime(&now);
-		strftime(stamp, 32, "%b %d %T", timenow);
+		localtime_r(&now, &timenow);
+		strftime(stamp, 32, "%b %d %T", &timenow);
+		/*
+		 * Keep lines from the main and worker threads from
+		 * getting mixed up
+		 */
+		flockfile(stdout);
 		printf("%s ", stamp);
 		switch (level) {
 			case LOG_ERR:
@@ -127,6 +581,7 @@ log_msg(int level, char *fmt, ...)
 		printf("%s ", prepend);
 		vprintf(fmt, args);
 		printf("\n");
+		funlockfile(stdout);
 	}
 	else {
 		vsyslog(level, fmt, args);
@@ -134,58 +589,13 @@ log_msg(int level, char *fmt, ...)
 	va_end(args);
 }
 
-/*
- * Initiate memory compactiomn in the kernel on a given node.
- */
-void
-compact(int node_id)
-{
-	char compactpath[PATH_MAX];
-	int fd;
-	char c = '1';
-
-	if (snprintf(compactpath, sizeof(compactpath), COMPACT_PATH_FORMAT,
-	    node_id) >= sizeof(compactpath)) {
-		(void) log_err("compactpath is too long");
-		bailout(1);
-	}
-
-	if ((fd = open(compactpath, O_WRONLY|O_NONBLOCK)) == -1) {
-		log_err("opening compaction path (%s)", strerror(errno));
-		bailout(1);
-	}
-
-	if (write(fd, &c, sizeof(c)) != sizeof(c)) {
-		log_err("writing to compaction path (%s)", strerror(errno));
-		bailout(1);
-	}
-
-	close(fd);
-}
-
-/* Parse a single input line;  return 1 if successful or 0 otherwise. */
-int
-scan_line(char *line, char *node, char *zone, unsigned long *nr_free)
+static inline unsigned long
+get_msecs(struct timespec *spec)
 {
-	char copy[LINE_MAX];
-	unsigned int order;
-	char *t;
-
-	(void) strncpy(copy, line, sizeof(copy));
-
-	if ((t = strtok(copy, " ")) == NULL || strcmp(t, "Node") ||
-	    (t = strtok(NULL, ",")) == NULL || sscanf(t, "%s", node) != 1 ||
-	    (t = strtok(NULL, " ")) == NULL || strcmp(t, "zone") ||
-	    (t = strtok(NULL, " ")) == NULL || sscanf(t, "%s", zone) != 1)
-		return 0;
-
-	for (order = 0; order < MAX_ORDER; order++) {
-		if ((t = strtok(NULL, " ")) == NULL ||
-		    sscanf(t, " %ld", &nr_free[order]) != 1)
-			return 0;
-	}
+	if (!spec)
+		return -1;
 
-	return 1;
+	return (unsigned long)((spec->tv_sec * 1000) + (spec->tv_nsec / 1000000));
 }
 
 /*
@@ -203,42 +613,34 @@ scan_line(char *line, char *node, char *zone, unsigned long *nr_free)
 #define ERR	0
 #define EOF_RET	-1
 int
-get_next_node(FILE *ifile, int *nid, unsigned long *nr_free)
+get_next_node(struct scan *s, int *nid, unsigned long *nr_free)
 {
-	char line[LINE_MAX];
-	char node[FLDLEN], zone[FLDLEN];
+	const char *zone;
+	size_t zonelen;
 	unsigned long free_pages[MAX_ORDER];
 	int order, current_node = -1;
 
 	for (order = 0; order < MAX_ORDER; order++)
 		nr_free[order] = 0;
 	/*
-	 * Read the file one line at a time until we find the next
-	 * "Normal" zone or reach EOF
+	 * Walk the buffer one line at a time until we find the next
+	 * node or reach the end of buffer
 	 */
 	while (1) {
-		long cur_pos;
+		const char *cur_pos = s->pos;
 
-		if ((cur_pos = ftell(ifile)) < 0) {
-			log_err("ftell on buddyinfo failed (%s)", strerror(errno));
-			return ERR;
-		}
-		if (fgets(line, sizeof(line), ifile) == NULL) {
-			if (feof(ifile)) {
-				rewind(ifile);
-				return EOF_RET;
-			} else {
-				log_err("fgets(): %s",
-						strerror(ferror(ifile)));
+		if (scan_eof(s)) {
+			if (current_node == -1)
 				return ERR;
-			}
+			*nid = current_node;
+			return EOF_RET;
 		}
 
-		if (!scan_line(line, node, zone, free_pages)) {
-			log_err("invalid input: %s", line);
+		if (!scan_buddyinfo(s, nid, &zone, &zonelen, free_pages)) {
+			log_err("invalid input in "BUDDYINFO" at offset %ld",
+					(long)(cur_pos - buddyinfo.buf));
 			return ERR;
 		}
-		sscanf(node, "%d", nid);
 
 		/*
 		 * Accumulate free pages infor for just the current node
@@ -247,15 +649,12 @@ get_next_node(FILE *ifile, int *nid, unsigned long *nr_free)
 			current_node = *nid;
 
 		if (*nid != current_node) {
-			if (fseek(ifile, cur_pos, SEEK_SET) < 0) {
-				log_err("fseek on buddyinfo failed (%s)", strerror(errno));
-				return ERR;
-			}
+			s->pos = cur_pos;
 			break;
 		}
 
 		/* Skip DMA zone */
-		if (strncmp(zone, "DMA", FLDLEN) == 0)
+		if (scan_is(zone, zonelen, "DMA"))
 			continue;
 
 		/* Add up free page info for each order */
@@ -268,460 +667,1659 @@ get_next_node(FILE *ifile, int *nid, unsigned long *nr_free)
 }
 
 /*
- * Compute the number of base pages tied up in hugepages
+ * Assemble the fragmented free memory vector from number of free
+ * blocks of each order: the fragmented free memory at a given order
+ * is the sum of the occupancies at all lower orders. Memory is never
+ * fragmented at the lowest order and so free[0] is overloaded with
+ * the total free memory.
  */
-int
-update_hugepages()
+void
+build_frag_vec(unsigned long *nr_free, struct frag_info *free,
+		long long msecs)
 {
-	DIR *dp;
-	struct dirent *ep;
-	unsigned long newhpages = 0;
-
-	dp = opendir(HUGEPAGESINFO);
-	if (dp != NULL) {
-		while ((ep = readdir(dp)) != NULL) {
-			if (ep->d_type == DT_DIR) {
-				FILE *fp;
-				long pages, psize;
-				char tmpstr[312];
+	unsigned long total_free;
+	int order;
 
-				/* Check if it is one of the hugepages dir */
-				if (strstr(ep->d_name, "hugepages-") == NULL)
-					continue;
-				snprintf(tmpstr, sizeof(tmpstr), "%s/%s/nr_hugepages", HUGEPAGESINFO, ep->d_name);
-				if ((fp = fopen(tmpstr, "r")) != NULL) {
-					if (fgets(tmpstr, sizeof(tmpstr), fp) != NULL) {
-						sscanf(tmpstr, "%ld", &pages);
-						sscanf(ep->d_name, "hugepages-%ldkB", &psize);
-						newhpages += pages * psize / base_psize;
-					}
-				}
-			}
+	total_free = free[0].free_pages = 0;
+	for (order = 0; order < MAX_ORDER; order++) {
+		unsigned long free_pages;
+
+		free_pages = nr_free[order] << order;
+		total_free += free_pages;
+		if (order < MAX_ORDER - 1) {
+			free[order + 1].free_pages =
+				free[order].free_pages +
+				free_pages;
+			free[order + 1].msecs = msecs;
 		}
-		if (newhpages)
-			total_hugepages = newhpages;
-		closedir(dp);
-	} else {
-		return 0;
 	}
-
-	return 1;
+	free[0].free_pages = total_free;
+	free[0].msecs = msecs;
 }
 
+static const char *migratetype_names[NR_MIGRATETYPES] = {
+	[MT_UNMOVABLE] = "Unmovable",
+	[MT_MOVABLE] = "Movable",
+	[MT_RECLAIMABLE] = "Reclaimable",
+};
+
 /*
- * Parse watermarks and zone_managed_pages values from /proc/zoneinfo
+ * Find the per zone fragmentation state for the named zone on a node,
+ * claiming a free slot for it if the zone has not been seen before.
  */
-#define ZONE_MIN	"min"
-#define ZONE_LOW	"low"
-#define ZONE_HIGH	"high"
-#define ZONE_MNGD	"managed"
-#define ZONE_PGST	"pagesets"
-int
-update_zone_watermarks()
+static struct zone_frag *
+find_zone(struct node_state *node, const char *name, size_t len)
 {
-	FILE *fp = NULL;
-	size_t len = 100;
-	char *line = malloc(len);
-	int current_node = -1;
-
-	fp = fopen(ZONEINFO, "r");
-	if (!fp)
-		return 0;
-
-	while ((fgets(line, len, fp) != NULL)) {
-		if (strncmp(line, "Node", 4) == 0) {
-			char node[FLDLEN], zone[FLDLEN], zone_name[FLDLEN];
-			int nid;
-			unsigned long min, low, high, managed;
+	int i;
 
-			sscanf(line, "%s %d, %s %8s\n", node, &nid, zone, zone_name);
-			if ((current_node == -1) || (current_node != nid)) {
-				current_node = nid;
-				min_wmark[nid] = low_wmark[nid] = 0;
-				high_wmark[nid] = managed_pages[nid] = 0;
-			}
+	if (len >= ZONE_NAME_LEN)
+		return NULL;
 
-			/*
-			 * Add up watermarks and managed pages for all
-			 * zones for the node except DMA zone.
-			 */
-			if (strncmp("DMA", zone_name, FLDLEN) != 0) {
-				/*
-				 * We found the normal zone. Now look for
-				 * line "pages free"
-				 */
-				if (fgets(line, len, fp) == NULL)
-					goto out;
-
-				while (1) {
-					unsigned long val;
-					char name[20];
-
-					if (fgets(line, len, fp) == NULL)
-						goto out;
-
-					sscanf(line, "%s %lu\n", name, &val);
-					if (strncmp(name, ZONE_MIN, sizeof(ZONE_MIN)) == 0)
-						min = val;
-					if (strncmp(name, ZONE_LOW, sizeof(ZONE_LOW)) == 0)
-						low = val;
-					if (strncmp(name, ZONE_HIGH, sizeof(ZONE_HIGH)) == 0)
-						high = val;
-					if (strncmp(name, ZONE_MNGD, sizeof(ZONE_MNGD)) == 0)
-						managed = val;
-					if (strncmp(name, ZONE_PGST, sizeof(ZONE_PGST)) == 0)
-						break;
-				}
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		struct zone_frag *zf = &node->zones[i];
 
-				min_wmark[nid] += min;
-				low_wmark[nid] += low;
-				high_wmark[nid] += high;
-				managed_pages[nid] += managed;
-			}
+		if (zf->name[0] == 0) {
+			memcpy(zf->name, name, len);
+			zf->name[len] = 0;
+			return zf;
 		}
+		if ((strncmp(zf->name, name, len) == 0) && (zf->name[len] == 0))
+			return zf;
 	}
 
-out:
-	fclose(fp);
-	return 0;
+	return NULL;
 }
 
 /*
- * When kernel computes the gap between low and high watermarks
- * using watermark scale factor, it computes a percentage of
- * total memory on the system. This works when most of the
- * moemory is reclaimable and subject to watermarks. On systems
- * that allocate very large percentage of memory to hugepages,
- * this results in kernel computing watermarks that are just
- * too high for the remaining memory that is truly subject to
- * reclamation. Rescale max wsf down so kernel will end up
- * computing watermarks that are more in line with real
- * available memory.
+ * The kernel stops counting a free list in /proc/pagetypeinfo at this
+ * many blocks and prints ">100000"
  */
-void
-rescale_maxwsf()
+#define PAGETYPE_SATURATED	100000
+
+/*
+ * Parse free block counts per zone and migratetype from
+ * /proc/pagetypeinfo. Lines of interest look like
+ *
+ *	Node    0, zone   Normal, type    Movable      1 ...
+ *
+ * Each node has its own block of these, followed by tables of
+ * pageblock counts which are not needed and skipped over on the way to
+ * the next node. A saturated count is taken as PAGETYPE_SATURATED.
+ */
+int
+update_pagetypes()
 {
-	unsigned long reclaimable_pages, total_managed = 0;
-	unsigned long gap, new_wsf;
+	struct node_state *node;
+	struct scan s;
 	int i;
 
-	if (total_hugepages == 0)
-		return;
+	if (!procfs_read(&pagetypeinfo))
+		return 0;
 
-	for (i=0; i<MAX_NUMANODES; i++)
-		total_managed += managed_pages[i];
-	if (total_managed == 0) {
-		log_info(1, "Number of managed pages is 0");
-		return;
-	}
+	for_each_node(node)
+		if (node->zones)
+			for (i = 0; i < MAX_NR_ZONES; i++)
+				node->zones[i].seen = 0;
+
+	scan_init(&s, &pagetypeinfo);
+	while (!scan_eof(&s)) {
+		const char *w, *zone;
+		size_t len, zonelen;
+		unsigned long nid, nr_free[MAX_ORDER];
+		struct zone_frag *zf;
+		int mt, order;
+
+		if (!scan_word(&s, &w, &len)) {
+			scan_next_line(&s);
+			continue;
+		}
+		if (!scan_is(w, len, "Node") || !scan_ulong(&s, &nid) ||
+		    !scan_char(&s, ',') || !scan_word(&s, &w, &len) ||
+		    !scan_is(w, len, "zone") ||
+		    !scan_word(&s, &zone, &zonelen) || !scan_char(&s, ',') ||
+		    !scan_word(&s, &w, &len) || !scan_is(w, len, "type") ||
+		    !scan_word(&s, &w, &len)) {
+			scan_next_line(&s);
+			continue;
+		}
 
-	/*
-	 * Compute what the gap would be if maxwsf is applied to
-	 * just reclaimable memory
-	 */
-	reclaimable_pages = total_managed - total_hugepages;
-	gap = (reclaimable_pages * maxwsf)/10000;
+		for (mt = 0; mt < NR_MIGRATETYPES; mt++)
+			if ((strlen(migratetype_names[mt]) == len) &&
+			    (memcmp(migratetype_names[mt], w, len) == 0))
+				break;
+		for (order = 0; order < MAX_ORDER; order++) {
+			int saturated = scan_char(&s, '>');
 
-	/*
-	 * Now compute WSF needed for same gap if all memory was taken
-	 * into account
-	 */
-	new_wsf = (gap * 10000)/total_managed;
+			if (!scan_ulong(&s, &nr_free[order]))
+				break;
+			if (saturated)
+				nr_free[order] = PAGETYPE_SATURATED;
+		}
+		scan_next_line(&s);
 
-	if ((new_wsf > 9) && (new_wsf < 1000))
-		mywsf = new_wsf;
-	else
-		log_warn("Failed to compute reasonable WSF, %ld, total pages %ld, reclaimable pages %ld", new_wsf, total_managed, reclaimable_pages);
+		/* Skip DMA zone and migratetypes not tracked */
+		if ((order < MAX_ORDER) || (mt == NR_MIGRATETYPES) ||
+		    scan_is(zone, zonelen, "DMA"))
+			continue;
+		if (((node = find_node(nid)) == NULL) || (node->zones == NULL))
+			continue;
+		if ((zf = find_zone(node, zone, zonelen)) == NULL)
+			continue;
+
+		memcpy(zf->nr_free[mt], nr_free, sizeof(nr_free));
+		zf->seen = 1;
+	}
+
+	return 1;
 }
 
 /*
- * Get the number of pages stolen by kswapd from /proc/vmstat.
+ * Predict fragmentation of each zone on a node from the trend lines
+ * of free lists of each migratetype. Only movable free lists can be
+ * helped by compaction, so only those can recommend compaction.
+ * Fragmentation of other free lists is only logged. Demand hinted at
+ * for the node is held against the movable free lists of each zone.
  */
 unsigned long
-no_pages_reclaimed()
+predict_pagetypes(struct node_state *node, long long msecs,
+		struct horizon *horizon)
 {
-	FILE *fp = NULL;
-	size_t len = 100;
-	char *line = malloc(len);
-	unsigned long val, reclaimed;
-	char desc[100];
-
-	fp = fopen(VMSTAT, "r");
-	if (!fp)
+	unsigned long retval = 0;
+	struct demand demand;
+	struct stall_rates rates;
+	int i, mt;
+
+	horizon->ready = 1;
+	horizon->reclaim = horizon->compact = HORIZON_NONE;
+	if (node->zones == NULL)
 		return 0;
+	hint_demand(node->nid, nr_nodes, msecs, periodicity * 1000LL, &demand);
+	node_stall_rates(node, &rates);
 
-	total_cache_pages = reclaimed = 0;
-	while ((fgets(line, len, fp) != NULL)) {
-		sscanf(line, "%s %lu\n", desc, &val );
-		if (strcmp(desc, "pgsteal_kswapd") == 0)
-			reclaimed += val;
-		if (strcmp(desc, "pgsteal_kswapd_normal") == 0)
-			reclaimed += val;
-		if (strcmp(desc, "pgsteal_kswapd_movable") == 0)
-			reclaimed += val;
-		if (strcmp(desc, "nr_inactive_file") == 0)
-			total_cache_pages += val;
-		if (strcmp(desc, "nr_inactive_anon") == 0)
-			total_cache_pages += val;
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		struct zone_frag *zf = &node->zones[i];
+
+		if (!zf->seen)
+			continue;
+
+		for (mt = 0; mt < NR_MIGRATETYPES; mt++) {
+			struct frag_info free[MAX_ORDER];
+			struct horizon zh;
+			char desc[64];
+			unsigned long ret;
+
+			snprintf(desc, sizeof(desc), "node %d zone %s (%s)",
+				node->nid, zf->name, migratetype_names[mt]);
+			build_frag_vec(zf->nr_free[mt], free, msecs);
+			ret = predict_fragmentation(free, &zf->trends[mt],
+					node->compaction_rate, &rates,
+					(mt == MT_MOVABLE) ? &demand : NULL,
+					desc, &zh);
+			if (!zh.ready)
+				horizon->ready = 0;
+
+			if (mt != MT_MOVABLE) {
+				if (ret & MEMPREDICT_COMPACT)
+					log_info(3, "Not compacting for %s, compaction can not recover these pages", desc);
+				continue;
+			}
+
+			retval |= ret;
+			if (zh.compact < horizon->compact)
+				horizon->compact = zh.compact;
+		}
 	}
 
-	free(line);
-	fclose(fp);
-	return reclaimed;
+	return retval;
 }
 
 /*
- * Dynamically rescale the watermark_scale_factor to make kswapd
- * more aggressive
+ * Update compaction rate of a node from a compaction the worker has
+ * completed, using the compaction counters in /proc/vmstat sampled
+ * before and after compacting the node. Writing to the compact file
+ * of a node compacts the node synchronously, so the pages isolated in
+ * that time were isolated by our request. Each page migrated is
+ * isolated twice, once as the page to move and once as the free page
+ * to move it to. A compaction that found little to migrate finishes
+ * quickly no matter how fast the node can compact, so it is not used
+ * to update the rate. Neither is one that ran while workers for other
+ * nodes were busy, the counters include what they did.
  */
 void
-rescale_watermarks(int scale_up)
+update_compaction_rate(struct node_state *node, struct work *w)
 {
-	int fd, i, count;
-	unsigned long scaled_watermark, frac_free;
-	char scaled_wmark[20], *c;
-	unsigned long total_managed = 0;
-	unsigned long mmark, lmark, hmark;
-
-	for (i=0; i<MAX_NUMANODES; i++)
-		total_managed += managed_pages[i];
-	/*
-	 * Hugepages should not be taken into account for watermark
-	 * calculations since they are not reclaimable
-	 */
-	total_managed -= total_hugepages;
-	if (total_managed == 0) {
-		log_info(1, "Number of managed non-huge pages is 0");
+	unsigned long migrated, scanned;
+	long long elapsed = w->msecs;
+	long rate;
+
+	if (elapsed <= 0)
+		elapsed = 1;
+	migrated = (w->after.compact_isolated - w->before.compact_isolated) / 2;
+	scanned = (w->after.compact_migrate_scanned -
+			w->before.compact_migrate_scanned) +
+		(w->after.compact_free_scanned - w->before.compact_free_scanned);
+	log_info(4, "Compaction on node %d took %lld msec, %ld pages recovered in order %d and higher blocks", node->nid, elapsed, (long)(w->free_after - w->free_before), max_compaction_order);
+	log_info(5, "** compaction on node %d scanned %lu pages, migrated %lu pages, %lu successful direct compactions", node->nid, scanned, migrated, w->after.compact_success - w->before.compact_success);
+	if ((migrated < MIN_COMPACT_SAMPLE) || w->overlapped)
 		return;
-	}
 
-	/*
-	 * Fraction of managed pages currently free
-	 */
-	frac_free = (total_free_pages*1000)/total_managed;
+	rate = (migrated * 1000) / elapsed;
+	if (node->compaction_measured)
+		node->compaction_rate = (node->compaction_rate *
+				(RATE_SMOOTHING - 1) + rate) / RATE_SMOOTHING;
+	else
+		node->compaction_rate = rate;
+	node->compaction_measured = 1;
+	log_info(5, "** compaction rate on node %d is %ld pages/sec", node->nid, node->compaction_rate);
+}
 
-	/*
-	 * Get the current watermark scale factor.
-	 */
-	if ((fd = open(RESCALE_WMARK, O_RDONLY)) == -1) {
-		log_err("Failed to open "RESCALE_WMARK" (%s)", strerror(errno));
-		return;
+/*
+ * Estimate compaction rate of a node that has not been compacted by us
+ * yet from growth in number of free pages of the highest order since
+ * last sample. This includes compaction done by kcompactd as well as
+ * pages freed by applications, so it is only used until a compaction
+ * can be measured.
+ */
+void
+estimate_compaction_rate(struct node_state *node, struct frag_info *free)
+{
+	long long elapsed;
+	unsigned long bigpages = free[MAX_ORDER-1].free_pages;
+
+	if (!node->compaction_measured && (node->last_bigpages_msecs != 0) &&
+	    (bigpages > node->last_bigpages)) {
+		elapsed = free[MAX_ORDER-1].msecs - node->last_bigpages_msecs;
+		if (elapsed <= 0)
+			elapsed = 1;
+		node->compaction_rate = ((bigpages - node->last_bigpages) *
+					1000) / elapsed;
+		if (node->compaction_rate)
+			log_info(5, "** estimated compaction rate on node %d is %ld pages/sec", node->nid, node->compaction_rate);
 	}
+	node->last_bigpages = bigpages;
+	node->last_bigpages_msecs = free[MAX_ORDER-1].msecs;
+}
 
-	if (read(fd, scaled_wmark, sizeof(scaled_wmark)) < 0) {
-		log_err("Failed to read from "RESCALE_WMARK" (%s)", strerror(errno));
-		goto out;
-	}
-	close(fd);
-	/* strip off trailing CR from current watermark scale factor */
-	c = index(scaled_wmark, '\n');
-	*c = 0;
+/*
+ * Update the rate at which a node can be reclaimed from through
+ * memory.reclaim after a reclaim request completes. Pages reclaimed
+ * are taken from the system wide counters the kernel bumps for
+ * memory.reclaim, so direct reclaim by applications while the request
+ * was in progress is counted as well. A request that ran while workers
+ * for other nodes were busy is not used, their reclaim is in the
+ * counters too.
+ */
+void
+update_cgroup_reclaim_rate(struct node_state *node, struct work *w)
+{
+	unsigned long reclaimed;
+	long long elapsed = w->msecs;
+	long rate;
+
+	if (elapsed <= 0)
+		elapsed = 1;
+	reclaimed = w->after.pgsteal_direct - w->before.pgsteal_direct;
+	log_info(4, "Reclaim of %lu pages on node %d took %lld msec, %lu pages reclaimed, free pages grew by %ld", w->pages, node->nid, elapsed, reclaimed, (long)(w->free_after - w->free_before));
+	if ((reclaimed == 0) || w->overlapped)
+		return;
 
-	/*
-	 * Compute average high and low watermarks across nodes
-	 */
-	lmark = hmark = count = 0;
-	for (i=0; i<MAX_NUMANODES; i++) {
-		lmark += low_wmark[i];
-		hmark += high_wmark[i];
-		if (low_wmark[i] != 0 )
-			count++;
-	}
-	lmark = lmark/count;
-	hmark = hmark/count;
+	rate = (reclaimed * 1000) / elapsed;
+	if (node->cgroup_reclaim_measured)
+		node->cgroup_reclaim_avg = (node->cgroup_reclaim_avg *
+				(RATE_SMOOTHING - 1) + rate) / RATE_SMOOTHING;
+	else
+		node->cgroup_reclaim_avg = rate;
+	node->cgroup_reclaim_measured = 1;
+	log_info(5, "** memory.reclaim rate on node %d is %ld pages/sec", node->nid, node->cgroup_reclaim_avg);
+}
 
-	/*
-	 * If memory pressure is easing, scale watermarks back and let
-	 * kernel reclaim pages at its natural rate. If number of free
-	 * pages is below halfway between low and high watermarks, back
-	 * off watermark scale factor 10% at a time
-	 */
-	if (!scale_up) {
-		if (total_free_pages < ((lmark+hmark)/2))
-			scaled_watermark = (atoi(scaled_wmark) * 9)/10;
-		else
-			scaled_watermark = ((unsigned long)(1000 - frac_free)/10)*10;
-		/*
-		 * Make sure new watermark scale factor does not end up
-		 * higher than current value accidentally
-		 */
-		if (scaled_watermark >= atoi(scaled_wmark))
-			scaled_watermark = (atoi(scaled_wmark) * 9)/10;
-	}
-	else {
-		/*
-		 * Determine how urgent the situation is regarding 
-		 * remaining free pages. If free pages are already
-		 * below high watermark, check if there are enough
-		 * pages potentially available in buffer cache.
-		 */
-		if (total_free_pages < hmark) {
-			if (total_cache_pages > (hmark - total_free_pages)) {
-				/*
-				 * There are pages available to harvest.
-				 * Aggressive reclaim is appropriate for
-				 * this situation. Urgency is determined by
-				 * the percentage of managed pages still
-				 * available. As this number gets lower,
-				 * watermark scale factor needs to go up
-				 * to make kswapd reclaim pages more
-				 * aggressively. Compute scale factor as
-				 * multiples of 10.
-				 */
-				scaled_watermark = ((unsigned long)(1000 - frac_free)/10)*10;
-				if (scaled_watermark == 0)
-					return;
-			}
-			else {
-				/*
-				 * We are running low on free pages but
-				 * there are not enough pages available to
-				 * reclaim either, so no need to get
-				 * overly aggressive. Be only half as
-				 * aggressive as the case where pages are
-				 * available to reclaim
-				 */
-				scaled_watermark = ((unsigned long)(1000 - frac_free)/20)*10;
-				if (scaled_watermark == 0)
-					return;
-			}
+/*
+ * Pick up requests the worker threads have completed since last sample
+ * and learn from what they took
+ */
+void
+collect_work(void)
+{
+	struct node_state *node;
+	struct work w;
+
+	while (work_done(&w)) {
+		if ((w.type == WORK_COMPACT) && w.error) {
+			log_err("writing to compaction path (%s)", strerror(w.error));
+			bailout(1);
 		}
-		else {
+		if ((node = find_node(w.nid)) == NULL)
+			continue;
+
+		switch (w.type) {
+		case WORK_COMPACT:
+			stat_record(STAT_COMPACT_TIME, w.msecs * 1000);
+			node->compaction_requested = 0;
+			node->compact_tokens -= w.msecs;
+			update_compaction_rate(node, &w);
+			break;
+		case WORK_RECLAIM:
 			/*
-			 * System is not in dire situation at this time yet.
-			 * Free pages are expected to approach high
-			 * watermark soon though. If there are lots of
-			 * reclaimable pages available, start semi-aggressive
-			 * reclamation. If not, raise watermark scale factor
-			 * but only by 10% if above 100 otherwise by 20%
+			 * Kernel gives up with EAGAIN when it can not find
+			 * enough to reclaim in the cgroup. Any other error
+			 * means reclaim through the cgroup does not work
+			 * and kswapd is left to do it.
 			 */
-			if (total_cache_pages > (total_free_pages - hmark)) {
-				scaled_watermark = ((unsigned long)(1000 - frac_free)/20)*10;
-				if (scaled_watermark == 0)
-					return;
+			if (w.error == EAGAIN) {
+				log_info(3, "Could not reclaim all of %lu pages on node %d", w.pages, node->nid);
 			}
-			else {
-				if (atoi(scaled_wmark) > 100)
-					scaled_watermark = (atoi(scaled_wmark) * 11)/10;
-				else
-					scaled_watermark = (atoi(scaled_wmark) * 12)/10;
+			else if (w.error) {
+				log_err("writing to memory.reclaim (%s), raising watermarks instead", strerror(w.error));
+				reclaim_mode = RECLAIM_WATERMARK;
+				break;
 			}
+			stat_record(STAT_RECLAIM_TIME, w.msecs * 1000);
+			update_cgroup_reclaim_rate(node, &w);
+			break;
+		default:
+			break;
 		}
+	}
+}
 
-		/*
-		 * Compare to current watermark scale factor. If it is
-		 * the same as new scale factor, it means current setting
-		 * is not working well enough already. Raise it by 10%
-		 * instead.
-		 */
-		if (atoi(scaled_wmark) == scaled_watermark)
-			scaled_watermark = (scaled_watermark * 11)/10;
+/*
+ * Reclaim rate (pages/sec) to base reclamation decisions for a node
+ * on. Once reclaim through memory.reclaim has been measured on the
+ * node, that is what catches up with consumption in cgroup mode, else
+ * it is kswapd.
+ */
+static long
+node_reclaim_rate(struct node_state *node)
+{
+	if ((reclaim_mode == RECLAIM_CGROUP) && node->cgroup_reclaim_measured)
+		return node->cgroup_reclaim_avg;
+	return node->reclaim_avg;
+}
+
+/*
+ * Ask the worker to reclaim the pages a node is short of from the node
+ * through memory.reclaim. If a request for the node is still waiting,
+ * it is updated to the larger of the two amounts instead. Returns 1 if
+ * reclaim was started or is already under way, 0 if the node has to be
+ * left to kswapd or actions are paused.
+ */
+int
+request_reclaim(struct node_state *node, unsigned long pages)
+{
+	if (pages == 0)
+		return 1;
+	if (paused)
+		return 0;
+
+	log_info(2, "Reclaiming %lu pages on node %d", pages, node->nid);
+	stat_inc(STAT_RECLAIM_REQUESTS);
+	tune_acted(TUNE_RECLAIM);
+	if (dry_run)
+		return 1;
+
+	switch (queue_work(node->nid, WORK_RECLAIM, pages)) {
+	case 1:
+		return 1;
+	case 0:
+		log_info(3, "Reclaim on node %d is still in progress", node->nid);
+		return 1;
+	default:
+		log_warn("Too many requests queued for worker, not reclaiming on node %d", node->nid);
+		return 0;
 	}
+}
 
-	/*
-	 * Highest possible value for watermark scaling factor is
-	 * 1000. If current scale is already set to 1000, no point
-	 * in updating it. Also make sure new value is at least the
-	 * minimum allowed value.
-	 */
-	if (scaled_watermark > 1000)
-		scaled_watermark = 1000;
-	if (scaled_watermark < 10)
-		scaled_watermark = 10;
-	if (scaled_watermark > mywsf)
-		scaled_watermark = mywsf;
+/*
+ * Check the compaction budget of a node. A node earns compact_budget
+ * msec of compaction per minute, up to a minute's worth, and the wall
+ * time of each compaction is charged against it once the compaction
+ * completes. A node that has used up its budget is not compacted again
+ * until it has earned some back. Returns 1 if node can be compacted.
+ */
+static int
+compaction_allowed(struct node_state *node)
+{
+	struct timespec spec;
+	long long now;
 
-	/*
-	 * Before committing to the new higher value of wsf, make sure
-	 * it will not cause low watermark to be raised above current
-	 * number of free pages. If that were to happen OOM killer will
-	 * step in immediately. Allow for at least 2% headroom over low
-	 * watermark.
-	 */
-	if (scale_up) {
-		unsigned long threshold, loose_pages = total_free_pages +
-							total_cache_pages;
-		unsigned long new_lmark;
+	if (compact_budget == 0)
+		return 1;
 
-		mmark = lmark = 0;
-		for (i=0; i<MAX_NUMANODES; i++) {
-			mmark += min_wmark[i];
-			lmark += low_wmark[i];
-		}
+	sample_clock(&spec);
+	now = get_msecs(&spec);
+	if (node->budget_msecs == 0)
+		node->compact_tokens = compact_budget;
+	else
+		node->compact_tokens += (double)(now - node->budget_msecs) *
+					compact_budget / 60000;
+	if (node->compact_tokens > compact_budget)
+		node->compact_tokens = compact_budget;
+	node->budget_msecs = now;
 
-		/*
-		 * Estimate the new low watermark if we were to increase
-		 * WSF to this new value
-		 */
-		new_lmark = mmark +
-			((lmark-mmark)*scaled_watermark/atoi(scaled_wmark));
+	return (node->compact_tokens > 0);
+}
 
-		/*
-		 * When low watermark gets raised, make sure there will
-		 * still be enough free pages left for system to continue
-		 * making progress. Use a headroom of 2% of currently
-		 * available free pages. If the number of free pages is
-		 * already below this threshhold, setting this new wsf
-		 * is very likely to kick OOM killer.
-		 */
-		threshold = new_lmark + total_free_pages * 1.02;
+/*
+ * Start compaction on a node if requested. There is a cost to
+ * compaction in the kernel. Avoid issuing compaction request again
+ * until the last one has completed and keep compaction within budget
+ * of the node. Compaction is carried out by the node's worker thread
+ * so the main loop can go on sampling while the kernel compacts. In proactive
+ * mode, compaction is left to the kernel and is driven by
+ * update_proactiveness() for all nodes together. Returns 1 if
+ * compaction was started.
+ */
+int
+request_compaction(struct node_state *node)
+{
+	if (paused)
+		return 0;
+	if (compaction_mode == COMPACT_PROACTIVE)
+		return 1;
 
-		if (loose_pages <= threshold) {
-			/*
-			 * See if we can raise wsf by 10%
-			 */
-			scaled_watermark = (atoi(scaled_wmark) * 11)/10;
-			new_lmark = mmark + ((lmark-mmark)*scaled_watermark/atoi(scaled_wmark));
-			threshold = new_lmark + total_free_pages * 1.02;
-			if (loose_pages <= threshold) {
-				log_info(2, "Not enough free pages to raise watermarks, free pages=%ld, reclaimable pages=%ld, new wsf=%ld, min=%ld, current low wmark=%ld, new projected low watermark=%ld", total_free_pages, total_cache_pages, scaled_watermark, mmark, lmark, new_lmark);
-				return;
-			}
-		}
+	if (node->compaction_requested) {
+		log_info(3, "Compaction on node %d is still in progress", node->nid);
+		stat_inc(STAT_COMPACT_BUSY);
+		return 0;
 	}
-
-	if (atoi(scaled_wmark) == scaled_watermark) {
-		if (scaled_watermark == mywsf)
-			log_info(2, "At max WSF already (max WSFF = %u", mywsf);
-		return;
+	if (!compaction_allowed(node)) {
+		log_info(3, "Compaction budget of node %d is used up", node->nid);
+		stat_inc(STAT_COMPACT_OVER_BUDGET);
+		return 0;
 	}
 
-	log_info(1, "Adjusting watermarks. Current watermark scale factor = %s", scaled_wmark);
+	log_info(2, "Triggering compaction on node %d", node->nid);
+	stat_inc(STAT_COMPACT_REQUESTS);
+	tune_acted(TUNE_COMPACT);
 	if (dry_run)
-		goto out;
-
-	log_info(1, "New watermark scale factor = %ld", scaled_watermark);
-	sprintf(scaled_wmark, "%ld\n", scaled_watermark);
-	if ((fd = open(RESCALE_WMARK, O_WRONLY)) == -1) {
-		log_err("Failed to open "RESCALE_WMARK" (%s)", strerror(errno));
-		return;
+		return 1;
+
+	switch (queue_work(node->nid, WORK_COMPACT, 0)) {
+	case 1:
+		node->compaction_requested = 1;
+		return 1;
+	case 0:
+		log_info(3, "Compaction on node %d is still in progress", node->nid);
+		return 0;
+	default:
+		log_warn("Too many requests queued for worker, not compacting node %d", node->nid);
+		return 0;
 	}
-	if (write(fd, scaled_wmark, strlen(scaled_wmark)) < 0)
-		log_err("Failed to write to "RESCALE_WMARK" (%s)", strerror(errno));
-
-out:
-	close(fd);
-	return;
 }
 
-static inline unsigned long
-get_msecs(struct timespec *spec)
+/*
+ * Set compaction_proactiveness from how close the nearest node is to
+ * running out of higher order pages. With no exhaustion in sight, the
+ * value the system had when memoptimizer started is kept. As exhaustion
+ * comes within the window predict() looks forward in, proactiveness is
+ * raised in proportion up to MAX_PROACTIVENESS, which is also used when
+ * compaction is recommended outright. It is lowered gradually so the
+ * kernel does not stop compacting as soon as one sample looks better.
+ */
+void
+update_proactiveness(struct horizon *nearest, int compact)
 {
-	if (!spec)
-		return -1;
+	long long window = tunables.compact_window * lookback *
+				periodicity * 1000;
+	int target = orig_proactiveness;
+
+	if (compact || (nearest->compact <= 0))
+		target = MAX_PROACTIVENESS;
+	else if (nearest->compact < window)
+		target += (MAX_PROACTIVENESS - orig_proactiveness) *
+				(window - nearest->compact) / window;
+	if (target < orig_proactiveness)
+		target = orig_proactiveness;
+
+	if (target < proactiveness - PROACTIVENESS_STEP)
+		target = proactiveness - PROACTIVENESS_STEP;
+	if (target > orig_proactiveness)
+		tune_acted(TUNE_COMPACT);
+	if (target == proactiveness)
+		return;
 
-	return (unsigned long)((spec->tv_sec * 1000) + (spec->tv_nsec / 1000));
+	log_info(2, "Setting compaction proactiveness to %d", target);
+	if (dry_run)
+		proactiveness = target;
+	else
+		set_proactiveness(target);
 }
 
 /*
- * check_permissions() - Check all required permissions for this program to
- *			run succesfully
+ * Update the number of base pages tied up in hugepages on each node
+ * and in total. Returns 1 if it changed on any node, or nodes holding
+ * hugepages went offline.
  */
-static int
-check_permissions(void)
+int
+update_hugepages()
 {
-	int fd;
-	char tmpstr[40];
+	unsigned long newhpages = 0;
+	struct node_state *node;
+	int changed = 0;
+
+	for_each_node(node) {
+		changed |= update_node_hugepages(node);
+		newhpages += node->hugepages;
+	}
+	if (newhpages != total_hugepages)
+		changed = 1;
+	total_hugepages = newhpages;
+
+	return changed;
+}
+
+/*
+ * Parse watermarks and zone_managed_pages values from /proc/zoneinfo
+ */
+int
+update_zone_watermarks()
+{
+	struct scan s;
+	struct node_state *node = NULL;
+	int count_zone = 0;
+
+	if (!procfs_read(&zoneinfo))
+		return 0;
+
+	scan_init(&s, &zoneinfo);
+	while (!scan_eof(&s)) {
+		const char *w;
+		size_t len;
+		unsigned long val;
+
+		if (!scan_word(&s, &w, &len)) {
+			scan_next_line(&s);
+			continue;
+		}
+
+		if (scan_is(w, len, "Node")) {
+			const char *zone;
+			size_t zonelen;
+			int nid;
+
+			if (!scan_ulong(&s, &val) || !scan_char(&s, ',') ||
+			    !scan_word(&s, &w, &len) ||
+			    !scan_is(w, len, "zone") ||
+			    !scan_word(&s, &zone, &zonelen)) {
+				scan_next_line(&s);
+				continue;
+			}
+			nid = val;
+			if ((node == NULL) || (node->nid != nid)) {
+				/*
+				 * Node is not in node table yet if it
+				 * just came online. It will be picked up
+				 * once node table has been rebuilt.
+				 */
+				if ((node = find_node(nid)) == NULL) {
+					count_zone = 0;
+					scan_next_line(&s);
+					continue;
+				}
+				node->min_wmark = node->low_wmark = 0;
+				node->high_wmark = node->managed_pages = 0;
+			}
+
+			/*
+			 * Add up watermarks and managed pages for all
+			 * zones for the node except DMA zone.
+			 */
+			count_zone = !scan_is(zone, zonelen, "DMA");
+		}
+		else if (count_zone) {
+			/*
+			 * Per-cpu pagesets follow the watermarks and
+			 * managed pages. Nothing more to look at in
+			 * this zone.
+			 */
+			if (scan_is(w, len, "pagesets"))
+				count_zone = 0;
+			else if (scan_ulong(&s, &val)) {
+				if (scan_is(w, len, "min"))
+					node->min_wmark += val;
+				else if (scan_is(w, len, "low"))
+					node->low_wmark += val;
+				else if (scan_is(w, len, "high"))
+					node->high_wmark += val;
+				else if (scan_is(w, len, "managed"))
+					node->managed_pages += val;
+			}
+		}
+		scan_next_line(&s);
+	}
+
+	return 1;
+}
+
+/*
+ * When kernel computes the gap between low and high watermarks
+ * using watermark scale factor, it computes a percentage of
+ * total memory on the system. This works when most of the
+ * moemory is reclaimable and subject to watermarks. On systems
+ * that allocate very large percentage of memory to hugepages,
+ * this results in kernel computing watermarks that are just
+ * too high for the remaining memory that is truly subject to
+ * reclamation. Rescale max wsf down so kernel will end up
+ * computing watermarks that are more in line with real
+ * available memory.
+ */
+void
+rescale_maxwsf()
+{
+	unsigned long reclaimable_pages, new_wsf = maxwsf;
+	struct node_state *node;
+
+	/*
+	 * With no memory in hugepages left, the cap goes back to maxwsf
+	 */
+	if (total_hugepages == 0) {
+		if (mywsf != maxwsf)
+			log_info(2, "Highest watermark scale factor is now %u", maxwsf);
+		mywsf = maxwsf;
+		return;
+	}
+
+	/*
+	 * watermark_scale_factor is applied to managed pages of each
+	 * node, so the node with the largest share of its memory in
+	 * hugepages decides how far it can go before the gap exceeds
+	 * maxwsf of what the node can actually reclaim
+	 */
+	for_each_node(node) {
+		if ((node->managed_pages == 0) ||
+		    (node->hugepages >= node->managed_pages))
+			continue;
+		reclaimable_pages = node->managed_pages - node->hugepages;
+		if ((reclaimable_pages * maxwsf) / node->managed_pages <
+		    new_wsf)
+			new_wsf = (reclaimable_pages * maxwsf) /
+					node->managed_pages;
+	}
+
+	if ((new_wsf > 9) && (new_wsf <= 1000)) {
+		if (new_wsf != mywsf)
+			log_info(2, "Highest watermark scale factor is now %lu", new_wsf);
+		mywsf = new_wsf;
+	}
+	else {
+		log_warn("Failed to compute reasonable WSF, %ld, max WSF %u", new_wsf, maxwsf);
+	}
+}
+
+/*
+ * Set up values for parameters based upon aggressiveness level
+ * desired, then apply maxgap and whatever was set through the control
+ * socket on top. This is done at startup and again whenever any of
+ * these change at runtime. Only the parameters are changed, trend
+ * lines and rates carry on as they were.
+ */
+static void
+apply_aggressiveness(void)
+{
+	struct node_state *node;
+
+	switch (aggressiveness) {
+		case 1:
+			maxwsf = 400;
+			max_compaction_order = MAX_ORDER - 6;
+			periodicity = LOW_PERIODICITY;
+			break;
+		case 2:
+			maxwsf = 700;
+			max_compaction_order = MAX_ORDER - 4;
+			periodicity = NORM_PERIODICITY;
+			break;
+		case 3:
+			maxwsf = 1000;
+			max_compaction_order = MAX_ORDER - 2;
+			periodicity = HIGH_PERIODICITY;
+			break;
+	}
+	if (periodicity_override)
+		periodicity = periodicity_override;
+	/*
+	 * Pages of an order are counted from free pages of the orders
+	 * above it, so MAX_ORDER - 2 is the highest that can be checked
+	 */
+	if ((compaction_order_override > 0) &&
+	    (compaction_order_override <= MAX_ORDER - 2))
+		max_compaction_order = compaction_order_override;
+
+	/*
+	 * If user specifies a maximum gap value for gap between low
+	 * and high watermarks, recompute maxwsf to account for that.
+	 * Zone page information must be up to date. Otherwise maxwsf
+	 * is scaled down for memory tied up in hugepages, once any have
+	 * been seen.
+	 */
+	if (maxgap != 0) {
+		unsigned long total_managed = 0;
+		for_each_node(node)
+			total_managed += node->managed_pages;
+		if (total_managed)
+			maxwsf = (maxgap * 10000UL * 1024UL * 1024UL * 1024UL)/(total_managed * getpagesize());
+	}
+	mywsf = maxwsf;
+	if ((maxgap == 0) && total_hugepages)
+		rescale_maxwsf();
+}
+
+/*
+ * What reclaim costs right now. anon_cost is the cost of reclaiming an
+ * anon page in clean file pages, 0 if there is no swap to reclaim anon
+ * pages to. Pages reclaimed and refaulted per sample are smoothed over
+ * RATE_SMOOTHING samples to tell when reclaim is thrashing, i.e.
+ * taking pages the workload needs back soon after.
+ */
+struct reclaim_cost {
+	int anon_cost;
+	int thrashing;
+	unsigned long last_stolen, last_refaults;
+	unsigned long last_pswpout, last_zswpout;
+	long stolen_avg, refault_avg;
+} reclaim_cost;
+
+/*
+ * Inactive pages weighted by what it costs to reclaim them, in clean
+ * file page equivalents. Dirty and writeback counts cover active
+ * pages too, so they are capped at the inactive file list. Pages under
+ * writeback can not be reclaimed until the write completes.
+ */
+static unsigned long
+cheap_reclaimable(unsigned long inactive_file, unsigned long inactive_anon,
+		unsigned long dirty, unsigned long writeback)
+{
+	unsigned long cheap;
+
+	if (dirty > inactive_file)
+		dirty = inactive_file;
+	if (writeback > inactive_file - dirty)
+		writeback = inactive_file - dirty;
+	cheap = inactive_file - dirty - writeback + dirty / DIRTY_RECLAIM_COST;
+	if (reclaim_cost.anon_cost)
+		cheap += inactive_anon / reclaim_cost.anon_cost;
+
+	return cheap;
+}
+
+/*
+ * Update the reclaim cost model from system wide counters
+ */
+static void
+update_reclaim_cost(struct vmstat_counters *vc)
+{
+	struct reclaim_cost *rc = &reclaim_cost;
+	unsigned long stolen = vc->pgsteal_kswapd + vc->pgsteal_direct;
+	unsigned long refaults = vc->refault_anon + vc->refault_file;
+	struct sysinfo si;
+	long long freeswap = -1;
+	int thrashing;
+
+	if ((trace_mode != TRACE_REPLAY) && (sysinfo(&si) == 0))
+		freeswap = si.freeswap;
+	trace_value(TRACE_FREESWAP, &freeswap);
+	if (freeswap == 0)
+		rc->anon_cost = 0;
+	else if ((vc->zswpout - rc->last_zswpout) >
+		 (vc->pswpout - rc->last_pswpout))
+		rc->anon_cost = ANON_ZSWAP_COST;
+	else
+		rc->anon_cost = ANON_SWAP_COST;
+	rc->last_pswpout = vc->pswpout;
+	rc->last_zswpout = vc->zswpout;
+
+	if (rc->last_stolen) {
+		rc->stolen_avg = (rc->stolen_avg * (RATE_SMOOTHING - 1) +
+				(stolen - rc->last_stolen)) / RATE_SMOOTHING;
+		rc->refault_avg = (rc->refault_avg * (RATE_SMOOTHING - 1) +
+				(refaults - rc->last_refaults)) / RATE_SMOOTHING;
+	}
+	rc->last_stolen = stolen;
+	rc->last_refaults = refaults;
+
+	thrashing = (rc->stolen_avg >= MIN_THRASH_SAMPLE) &&
+		(rc->refault_avg * 100 >= rc->stolen_avg * THRASH_REFAULT_PCT);
+	if (thrashing != rc->thrashing)
+		log_info(2, "Reclaim %s thrashing, %ld of %ld pages reclaimed per sample refault", thrashing ? "is" : "is no longer", rc->refault_avg, rc->stolen_avg);
+	rc->thrashing = thrashing;
+
+	total_cheap_pages = cheap_reclaimable(vc->inactive_file,
+			vc->inactive_anon, vc->file_dirty, vc->file_writeback);
+	log_info(5, "** cheaply reclaimable pages=%lu, anon reclaim cost=%d", total_cheap_pages, rc->anon_cost);
+}
+
+/*
+ * Update rates of allocation stalls and THP fallbacks from system wide
+ * counters
+ */
+static void
+update_stall_rates(struct vmstat_counters *vc, long long now)
+{
+	static struct vmstat_counters last;
+	static long long last_msecs;
+	double elapsed;
+
+	if (last_msecs && (now > last_msecs)) {
+		elapsed = (now - last_msecs) / 1000.0;
+		stall_rates.thp_fallback = (stall_rates.thp_fallback *
+			(RATE_SMOOTHING - 1) + (vc->thp_fallback -
+			last.thp_fallback) / elapsed) / RATE_SMOOTHING;
+		stall_rates.compact_stall = (stall_rates.compact_stall *
+			(RATE_SMOOTHING - 1) + (vc->compact_stall -
+			last.compact_stall) / elapsed) / RATE_SMOOTHING;
+		stall_rates.alloc_stall = (stall_rates.alloc_stall *
+			(RATE_SMOOTHING - 1) + (vc->allocstall -
+			last.allocstall) / elapsed) / RATE_SMOOTHING;
+		log_info(5, "** THP fallbacks %.1f/sec, compaction stalls %.1f/sec, allocation stalls %.1f/sec", stall_rates.thp_fallback, stall_rates.compact_stall, stall_rates.alloc_stall);
+	}
+	last = *vc;
+	last_msecs = now;
+}
+
+/*
+ * Get the number of pages stolen by kswapd from /proc/vmstat.
+ */
+unsigned long
+no_pages_reclaimed(struct timespec *spec)
+{
+	struct vmstat_counters vc;
+
+	if (!read_vmstat(&vmstat, &vc))
+		return 0;
+
+	update_reclaim_cost(&vc);
+	update_stall_rates(&vc, get_msecs(spec));
+	read_stalls(get_msecs(spec));
+	tune_update(&vc, stalls_traced ? &stall_totals : NULL,
+			get_msecs(spec));
+	return vc.pgsteal_kswapd;
+}
+
+/*
+ * Update the reclaim rate of each node from pages stolen by kswapd
+ * since the last sample. On kernels that report pgsteal_kswapd per
+ * node, the node's own counter is used. Otherwise pages reclaimed
+ * system wide are attributed to nodes in proportion to the size of
+ * their inactive LRU lists, which is where kswapd finds pages to
+ * reclaim. The rate is smoothed over RATE_SMOOTHING samples so a
+ * single noisy interval does not swing reclaim decisions.
+ */
+void
+update_reclaim_rates(unsigned long reclaimed, struct timespec *spec)
+{
+	static unsigned long last_reclaimed;
+	unsigned long total_inactive = 0;
+	long long now = get_msecs(spec);
+	struct node_state *node;
+
+	for_each_node(node) {
+		update_node_vmstat(node);
+		total_inactive += node->inactive_pages;
+	}
+
+	for_each_node(node) {
+		unsigned long stolen;
+		long long elapsed;
+		long rate;
+
+		if (node->has_pgsteal) {
+			stolen = node->pgsteal_kswapd - node->last_stolen;
+			node->last_stolen = node->pgsteal_kswapd;
+		}
+		else if (total_inactive) {
+			stolen = (double)(reclaimed - last_reclaimed) *
+				node->inactive_pages / total_inactive;
+		}
+		else {
+			stolen = 0;
+		}
+
+		elapsed = now - node->last_reclaim_msecs;
+		if ((node->last_reclaim_msecs == 0) || (last_reclaimed == 0)) {
+			node->last_reclaim_msecs = now;
+			continue;
+		}
+		if (elapsed <= 0)
+			continue;
+		node->last_reclaim_msecs = now;
+
+		rate = (stolen * 1000) / elapsed;
+		node->reclaim_avg = (node->reclaim_avg * (RATE_SMOOTHING - 1) +
+					rate) / RATE_SMOOTHING;
+		if (node->reclaim_avg)
+			log_info(5, "** reclamation rate on node %d is %ld pages/sec", node->nid, node->reclaim_avg);
+	}
+	last_reclaimed = reclaimed;
+}
+
+/*
+ * Free pages, reclaimable pages and watermarks summed up over the nodes
+ * a watermark change is decided for. When raising watermarks these are
+ * the nodes short of free pages, when lowering them all nodes. Nodes
+ * that do not report their own LRU sizes are given a share of the
+ * system wide count in proportion to their size.
+ */
+struct wmark_basis {
+	unsigned long managed;
+	unsigned long free;
+	unsigned long cheap;		/* See cheap_reclaimable() */
+	unsigned long min;
+	unsigned long low;
+	unsigned long high;
+};
+
+static void
+get_wmark_basis(int scale_up, struct wmark_basis *b)
+{
+	unsigned long total_managed = 0;
+	struct node_state *node;
+
+	memset(b, 0, sizeof(*b));
+	for_each_node(node)
+		total_managed += node->managed_pages;
+	if (total_managed == 0)
+		return;
+
+	for_each_node(node) {
+		double share = (double)node->managed_pages / total_managed;
+
+		if (scale_up && !(node->verdict & MEMPREDICT_RECLAIM))
+			continue;
+		if (node->hugepages < node->managed_pages)
+			b->managed += node->managed_pages - node->hugepages;
+		b->free += node->free_pages;
+		if (node->vmstat.fd >= 0)
+			b->cheap += cheap_reclaimable(node->inactive_file,
+					node->inactive_anon, node->file_dirty,
+					node->file_writeback);
+		else
+			b->cheap += total_cheap_pages * share;
+		b->min += node->min_wmark;
+		b->low += node->low_wmark;
+		b->high += node->high_wmark;
+	}
+}
+
+/*
+ * Change watermark_scale_factor from cur_wsf to wsf. In a replay or dry
+ * run, only the decision is taken note of.
+ */
+static void
+set_wsf(unsigned long cur_wsf, unsigned long wsf)
+{
+	char buf[20];
+	int fd;
+
+	stat_inc((wsf > cur_wsf) ? STAT_WSF_UP : STAT_WSF_DOWN);
+	if (wsf > cur_wsf)
+		tune_acted(TUNE_RECLAIM);
+	if (trace_mode == TRACE_REPLAY) {
+		log_info(1, "New watermark scale factor = %ld", wsf);
+		wsf_set = wsf;
+		return;
+	}
+	if (dry_run)
+		return;
+
+	log_info(1, "New watermark scale factor = %ld", wsf);
+	sprintf(buf, "%ld\n", wsf);
+	if ((fd = open(RESCALE_WMARK, O_WRONLY)) == -1) {
+		log_err("Failed to open "RESCALE_WMARK" (%s)", strerror(errno));
+		return;
+	}
+	if (write(fd, buf, strlen(buf)) < 0)
+		log_err("Failed to write to "RESCALE_WMARK" (%s)", strerror(errno));
+	else
+		wsf_set = wsf;
+	close(fd);
+}
+
+/*
+ * Raise watermark scale factor wsf by steps times wsf_step percent, and
+ * by at least 1 so small values still go up
+ */
+static unsigned long
+raise_wsf(unsigned long wsf, int steps)
+{
+	unsigned long val = wsf * (100 + steps * tunables.wsf_step) / 100;
+
+	return (val > wsf) ? val : wsf + 1;
+}
+
+/*
+ * Dynamically rescale the watermark_scale_factor to make kswapd
+ * more aggressive
+ */
+void
+rescale_watermarks(int scale_up)
+{
+	int cur_wsf;
+	unsigned long scaled_watermark, frac_free;
+	char scaled_wmark[20];
+	unsigned long mmark, lmark, hmark;
+	struct wmark_basis b;
+
+	/*
+	 * Hugepages should not be taken into account for watermark
+	 * calculations since they are not reclaimable
+	 */
+	get_wmark_basis(scale_up, &b);
+	if (b.managed == 0) {
+		log_info(1, "Number of managed non-huge pages is 0");
+		return;
+	}
+
+	/*
+	 * Fraction of managed pages currently free
+	 */
+	frac_free = (b.free*1000)/b.managed;
+
+	/*
+	 * Get the current watermark scale factor.
+	 */
+	if ((cur_wsf = get_wsf()) < 0) {
+		log_err("Failed to read "RESCALE_WMARK" (%s)", strerror(errno));
+		return;
+	}
+	snprintf(scaled_wmark, sizeof(scaled_wmark), "%d", cur_wsf);
+
+	/*
+	 * High and low watermarks of the same nodes free pages are
+	 * counted over
+	 */
+	lmark = b.low;
+	hmark = b.high;
+
+	/*
+	 * If memory pressure is easing, scale watermarks back and let
+	 * kernel reclaim pages at its natural rate. If number of free
+	 * pages is below halfway between low and high watermarks, back
+	 * off watermark scale factor 10% at a time
+	 */
+	if (!scale_up) {
+		if (b.free < ((lmark+hmark)/2))
+			scaled_watermark = (atoi(scaled_wmark) * 9)/10;
+		else
+			scaled_watermark = ((unsigned long)(1000 - frac_free)/10)*10;
+		/*
+		 * Make sure new watermark scale factor does not end up
+		 * higher than current value accidentally
+		 */
+		if (scaled_watermark >= atoi(scaled_wmark))
+			scaled_watermark = (atoi(scaled_wmark) * 9)/10;
+	}
+	else {
+		/*
+		 * Determine how urgent the situation is regarding 
+		 * remaining free pages. If free pages are already
+		 * below high watermark, check if there are enough
+		 * pages that can be reclaimed cheaply.
+		 */
+		if (b.free < hmark) {
+			if (b.cheap > (hmark - b.free)) {
+				/*
+				 * There are pages available to harvest.
+				 * Aggressive reclaim is appropriate for
+				 * this situation. Urgency is determined by
+				 * the percentage of managed pages still
+				 * available. As this number gets lower,
+				 * watermark scale factor needs to go up
+				 * to make kswapd reclaim pages more
+				 * aggressively. Compute scale factor as
+				 * multiples of 10.
+				 */
+				scaled_watermark = ((unsigned long)(1000 - frac_free)/10)*10;
+				if (scaled_watermark == 0)
+					return;
+			}
+			else {
+				/*
+				 * We are running low on free pages but
+				 * there are not enough pages available to
+				 * reclaim either, so no need to get
+				 * overly aggressive. Be only half as
+				 * aggressive as the case where pages are
+				 * available to reclaim
+				 */
+				scaled_watermark = ((unsigned long)(1000 - frac_free)/20)*10;
+				if (scaled_watermark == 0)
+					return;
+			}
+		}
+		else {
+			/*
+			 * System is not in dire situation at this time yet.
+			 * Free pages are expected to approach high
+			 * watermark soon though. If there are lots of
+			 * reclaimable pages available, start semi-aggressive
+			 * reclamation. If not, raise watermark scale factor
+			 * but only by wsf_step (10% unless auto-tuned) if
+			 * above 100 otherwise by twice that
+			 */
+			if (b.cheap > (b.free - hmark)) {
+				scaled_watermark = ((unsigned long)(1000 - frac_free)/20)*10;
+				if (scaled_watermark == 0)
+					return;
+			}
+			else {
+				if (atoi(scaled_wmark) > 100)
+					scaled_watermark = raise_wsf(atoi(scaled_wmark), 1);
+				else
+					scaled_watermark = raise_wsf(atoi(scaled_wmark), 2);
+			}
+		}
+
+		/*
+		 * Compare to current watermark scale factor. If it is
+		 * the same as new scale factor, it means current setting
+		 * is not working well enough already. Raise it by
+		 * wsf_step instead.
+		 */
+		if (atoi(scaled_wmark) == scaled_watermark)
+			scaled_watermark = raise_wsf(scaled_watermark, 1);
+	}
+
+	/*
+	 * Highest possible value for watermark scaling factor is
+	 * 1000. If current scale is already set to 1000, no point
+	 * in updating it. Also make sure new value is at least the
+	 * minimum allowed value.
+	 */
+	if (scaled_watermark > 1000)
+		scaled_watermark = 1000;
+	if (scaled_watermark < 10)
+		scaled_watermark = 10;
+	if (scaled_watermark > mywsf) {
+		scaled_watermark = mywsf;
+		stat_inc(STAT_WSF_CLAMPED);
+	}
+
+	/*
+	 * Before committing to the new higher value of wsf, make sure
+	 * it will not cause low watermark to be raised above current
+	 * number of free pages. If that were to happen OOM killer will
+	 * step in immediately. Allow for at least 2% headroom over low
+	 * watermark.
+	 */
+	if (scale_up) {
+		unsigned long threshold, loose_pages = b.free +
+							b.cheap;
+		unsigned long new_lmark;
+
+		mmark = b.min;
+
+		/*
+		 * Estimate the new low watermark if we were to increase
+		 * WSF to this new value
+		 */
+		new_lmark = mmark +
+			((lmark-mmark)*scaled_watermark/atoi(scaled_wmark));
+
+		/*
+		 * When low watermark gets raised, make sure there will
+		 * still be enough free pages left for system to continue
+		 * making progress. Use a headroom of 2% of currently
+		 * available free pages. If the number of free pages is
+		 * already below this threshhold, setting this new wsf
+		 * is very likely to kick OOM killer.
+		 */
+		threshold = new_lmark + b.free * 1.02;
+
+		if (loose_pages <= threshold) {
+			/*
+			 * See if we can raise wsf by wsf_step
+			 */
+			scaled_watermark = raise_wsf(atoi(scaled_wmark), 1);
+			new_lmark = mmark + ((lmark-mmark)*scaled_watermark/atoi(scaled_wmark));
+			threshold = new_lmark + b.free * 1.02;
+			if (loose_pages <= threshold) {
+				log_info(2, "Not enough free pages to raise watermarks, free pages=%ld, reclaimable pages=%ld, new wsf=%ld, min=%ld, current low wmark=%ld, new projected low watermark=%ld", b.free, b.cheap, scaled_watermark, mmark, lmark, new_lmark);
+				stat_inc(STAT_WSF_NO_HEADROOM);
+				return;
+			}
+		}
+	}
+
+	if (atoi(scaled_wmark) == scaled_watermark) {
+		if (scaled_watermark == mywsf) {
+			log_info(2, "At max WSF already (max WSFF = %u", mywsf);
+			stat_inc(STAT_WSF_AT_MAX);
+		}
+		return;
+	}
+
+	log_info(1, "Adjusting watermarks. Current watermark scale factor = %s", scaled_wmark);
+	set_wsf(atoi(scaled_wmark), scaled_watermark);
+}
+
+/*
+ * Decide what to do about watermarks from the verdicts of all nodes.
+ * watermark_scale_factor applies to every node, so raising it to help
+ * one node makes kswapd reclaim harder on all of them. Nodes that are
+ * short of free pages and could not be reclaimed from locally are
+ * weighted by their share of memory and by how close they are to high
+ * watermark, 1 for a node already below it down towards 0 for a node
+ * many sampling intervals away. Watermarks are raised only once the
+ * weighted urgency reaches GLOBAL_RECLAIM_SHARE percent, or every node
+ * with memory is short. Until then, kswapd is left to reclaim on those
+ * nodes at its normal watermarks, which still keeps other nodes from
+ * being over-reclaimed. Watermarks are lowered when some nodes have free
+ * pages going up and no node is left waiting for reclaim, and instead
+ * of being raised while reclaim is thrashing since reclaiming harder
+ * would only bring more refaults.
+ */
+void
+decide_watermarks(void)
+{
+	double period = periodicity * 1000.0;
+	unsigned long total_managed = 0;
+	double urgency = 0;
+	int starved = 0, local = 0, healthy = 0, with_memory = 0;
+	struct node_state *node;
+
+	/*
+	 * Memoryless nodes, CPU only or not populated yet, have nothing
+	 * to reclaim and are left out
+	 */
+	for_each_node(node) {
+		total_managed += node->managed_pages;
+		if (node->managed_pages)
+			with_memory++;
+	}
+	if (total_managed == 0)
+		return;
+
+	for_each_node(node) {
+		if (node->managed_pages == 0)
+			continue;
+		if (node->verdict & MEMPREDICT_RECLAIM) {
+			if (node->reclaimed_locally) {
+				local++;
+				continue;
+			}
+			starved++;
+			urgency += (double)node->managed_pages / total_managed *
+				period / (period + node->reclaim_horizon);
+		}
+		else if (node->verdict & MEMPREDICT_LOWER_WMARKS) {
+			healthy++;
+		}
+	}
+
+	if (starved) {
+		if (reclaim_cost.thrashing) {
+			log_info(2, "Backing off watermarks for %d of %d nodes short of free pages, reclaimed pages are refaulting", starved, with_memory);
+			rescale_watermarks(0);
+		}
+		else if ((urgency * 100 >= GLOBAL_RECLAIM_SHARE) ||
+		    (starved == with_memory)) {
+			log_info(2, "Raising watermarks for %d of %d nodes short of free pages, weighted urgency %.0f%%", starved, with_memory, urgency * 100);
+			rescale_watermarks(1);
+		}
+		else {
+			log_info(3, "Leaving %d of %d nodes short of free pages to kswapd, weighted urgency %.0f%% is below %d%%", starved, with_memory, urgency * 100, GLOBAL_RECLAIM_SHARE);
+		}
+		return;
+	}
+
+	if (healthy) {
+		if (local) {
+			log_info(3, "Lowering watermarks for %d nodes, %d nodes short of free pages are reclaimed locally", healthy, local);
+		}
+		rescale_watermarks(0);
+	}
+}
+
+/*
+ * Control watermark_scale_factor with a proportional integral
+ * controller that steers free pages of all nodes towards a setpoint of
+ * wsf_setpoint percent of the high watermark the kernel would set at
+ * KERNEL_WSF. The setpoint is kept away from the current high watermark
+ * so it does not move as the controller raises WSF. The error is the
+ * shortfall from the setpoint as a fraction of it, and counts as 0
+ * within wsf_deadband percent of the setpoint.
+ *
+ * The error is at most 1, all of the setpoint short, and at least -1 so
+ * a lot of free memory does not drive WSF down harder than a shortage
+ * drives it up. The integral only builds up while the output is not
+ * pinned at either limit, so it does not wind up while WSF is at max
+ * WSF or at 10, and it starts out at the current WSF so WSF only moves
+ * from where it is by the proportional term when control is taken
+ * over, or again after a pause or a change of parameters clears
+ * pi_started. WSF is written at most once every
+ * wsf_dwell seconds, and is not raised past the point where the low
+ * watermark would leave too few cheaply reclaimable pages, the same
+ * limit rescale_watermarks() keeps to. It is not raised at all while
+ * reclaimed pages are refaulting.
+ */
+static int pi_started;
+
+void
+control_watermarks(void)
+{
+	static long long last_msecs, last_write;
+	static double integral;
+	double setpoint = 0, error, dt, out, integ;
+	struct node_state *node;
+	struct wmark_basis b;
+	struct timespec spec;
+	unsigned long wsf;
+	long long now;
+	int cur_wsf;
+
+	for_each_node(node) {
+		unsigned long gap = node->managed_pages * KERNEL_WSF / 10000;
+
+		if (gap < node->min_wmark / 4)
+			gap = node->min_wmark / 4;
+		setpoint += (node->min_wmark + 2.0 * gap) * wsf_setpoint / 100;
+	}
+	get_wmark_basis(0, &b);
+	if ((setpoint <= 0) || (b.managed == 0))
+		return;
+	if ((cur_wsf = get_wsf()) < 0) {
+		log_err("Failed to read "RESCALE_WMARK" (%s)", strerror(errno));
+		return;
+	}
+
+	sample_clock(&spec);
+	now = get_msecs(&spec);
+	error = (setpoint - b.free) / setpoint;
+	if (error < -1)
+		error = -1;
+	if (fabs(error) * 100 < wsf_deadband)
+		error = 0;
+	if ((error > 0) && reclaim_cost.thrashing) {
+		log_info(3, "Holding watermarks, reclaimed pages are refaulting");
+		error = 0;
+	}
+
+	if (!pi_started) {
+		if (wsf_ki)
+			integral = (double)(cur_wsf - KERNEL_WSF) / wsf_ki;
+		pi_started = 1;
+		dt = 0;
+	}
+	else {
+		dt = (now - last_msecs) / 60000.0;
+	}
+	last_msecs = now;
+
+	integ = integral + error * dt;
+	out = KERNEL_WSF + wsf_kp * error + wsf_ki * integ;
+	if (!((out > mywsf) && (error > 0)) && !((out < 10) && (error < 0)))
+		integral = integ;
+	out = KERNEL_WSF + wsf_kp * error + wsf_ki * integral;
+	if (out > mywsf)
+		out = mywsf;
+	if (out < 10)
+		out = 10;
+	wsf = lround(out);
+	log_info(4, "Free pages %lu, setpoint %.0f, error %.3f, integral %.3f, WSF %d -> %lu", b.free, setpoint, error, integral, cur_wsf, wsf);
+
+	/*
+	 * Raise only as far as the new low watermark leaves enough
+	 * cheaply reclaimable pages, see rescale_watermarks()
+	 */
+	if ((wsf > cur_wsf) && (b.low > b.min) && (cur_wsf > 0)) {
+		double room = b.cheap - b.free * 0.02 - b.min;
+		double limit = (room > 0) ? cur_wsf * room / (b.low - b.min) : 0;
+
+		if (wsf > limit) {
+			log_info(2, "Not enough free pages to raise watermarks past %.0f, free pages=%lu, reclaimable pages=%lu", limit, b.free, b.cheap);
+			stat_inc(STAT_WSF_NO_HEADROOM);
+			wsf = (limit > cur_wsf) ? (unsigned long)limit : cur_wsf;
+		}
+	}
+
+	if (wsf == cur_wsf)
+		return;
+	if (last_write && (now - last_write < wsf_dwell * 1000LL)) {
+		log_info(3, "Holding watermark scale factor at %d for %lld more msec", cur_wsf, wsf_dwell * 1000LL - (now - last_write));
+		return;
+	}
+
+	log_info(1, "Adjusting watermarks. Free pages %lu, setpoint %.0f, current watermark scale factor = %d", b.free, setpoint, cur_wsf);
+	set_wsf(cur_wsf, wsf);
+	last_write = now;
+}
+
+/*
+ * Register memory pressure triggers with the kernel. Each trigger is
+ * of the form "<some|full> <stall us> <window us>" and gets its own
+ * file descriptor which becomes readable with POLLPRI when the stall
+ * threshold is exceeded within the time window.
+ *
+ * Returns:
+ *	1	All triggers registered
+ *	0	Failed to register triggers
+ */
+static int
+open_psi_triggers(void)
+{
+	int i;
+
+	for (i = 0; i < nr_psi_triggers; i++) {
+		int fd;
+
+		if ((fd = open(PSI_MEMORY, O_RDWR|O_NONBLOCK|O_CLOEXEC)) == -1) {
+			log_err("Can not open "PSI_MEMORY" (%s)", strerror(errno));
+			goto err;
+		}
+		if (write(fd, psi_trigger[i], strlen(psi_trigger[i]) + 1) < 0) {
+			log_err("Failed to register memory pressure trigger \"%s\" (%s)", psi_trigger[i], strerror(errno));
+			close(fd);
+			goto err;
+		}
+		poll_fds[POLL_PSI + i].fd = fd;
+		poll_fds[POLL_PSI + i].events = POLLPRI;
+		log_info(1, "Registered memory pressure trigger \"%s\"", psi_trigger[i]);
+	}
+
+	return 1;
+
+err:
+	while (--i >= 0)
+		close(poll_fds[POLL_PSI + i].fd);
+	nr_psi_triggers = 0;
+	return 0;
+}
+
+static inline long long
+get_nsecs(struct timespec *spec)
+{
+	return (spec->tv_sec * 1000000000LL) + spec->tv_nsec;
+}
+
+/*
+ * Create the timer that drives sampling. First tick is due right
+ * away.
+ */
+static int
+open_sample_timer(void)
+{
+	int fd;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+		log_err("Failed to create sampling timer (%s)", strerror(errno));
+		return 0;
+	}
+	poll_fds[POLL_TIMER].fd = fd;
+	poll_fds[POLL_TIMER].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &last_tick);
+
+	return 1;
+}
+
+/*
+ * Arm the sampling timer to fire interval msec after the last tick.
+ * If that deadline has already passed, skip over the missed ticks and
+ * count them as overruns so the cadence is preserved.
+ */
+static void
+schedule_sample(int interval)
+{
+	struct itimerspec its;
+	struct timespec now;
+	long long next, step;
+
+	step = interval * 1000000LL;
+	next = get_nsecs(&last_tick) + step;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (next <= get_nsecs(&now)) {
+		long long missed = (get_nsecs(&now) - next) / step + 1;
+
+		next += missed * step;
+		tick_overruns += missed;
+		log_info(3, "Sampling fell behind by %lld tick(s), %lu overruns so far", missed, tick_overruns);
+	}
+
+	next_tick.tv_sec = next / 1000000000LL;
+	next_tick.tv_nsec = next % 1000000000LL;
+	memset(&its, 0, sizeof(its));
+	its.it_value = next_tick;
+	if (timerfd_settime(poll_fds[POLL_TIMER].fd, TFD_TIMER_ABSTIME,
+			&its, NULL) == -1) {
+		log_err("Failed to arm sampling timer (%s)", strerror(errno));
+		bailout(1);
+	}
+}
+
+/*
+ * Compute the next sampling interval (msec) from the nearest horizon
+ * across all nodes. The goal is to collect a full lookback window of
+ * samples before exhaustion so the trend line is current by the time
+ * action is needed. Interval shrinks right away when exhaustion gets
+ * closer but is only stretched gradually, so a single quiet sample
+ * does not drop the sampling rate all the way down.
+ */
+static int
+adapt_interval(struct horizon *h, int interval)
+{
+	long long nearest, target, longest;
+
+	if (!h->ready)
+		return periodicity * 1000;
+
+	longest = periodicity * 1000 * MAX_SAMPLE_FACTOR;
+	nearest = (h->reclaim < h->compact) ? h->reclaim : h->compact;
+	if (nearest == HORIZON_NONE)
+		target = longest;
+	else
+		target = nearest / lookback;
+
+	if (target > 2 * interval)
+		target = 2 * interval;
+	if (target > longest)
+		target = longest;
+	if (target < MIN_SAMPLE_INTERVAL)
+		target = MIN_SAMPLE_INTERVAL;
+
+	if (target != interval)
+		log_info(4, "Sampling interval changed to %lld msec (reclaim in %lld msec, exhaustion in %lld msec)", target, (h->reclaim == HORIZON_NONE) ? -1 : h->reclaim, (h->compact == HORIZON_NONE) ? -1 : h->compact);
+
+	return target;
+}
+
+/*
+ * Apply scheduling policy and CPU affinity from configuration file.
+ * Running with a real-time policy keeps sampling on schedule when the
+ * system is under heavy load, which is when it matters the most.
+ * Failure to apply either is not fatal.
+ */
+static void
+set_scheduling(void)
+{
+	if (sched_policy != SCHED_OTHER) {
+		struct sched_param param;
+		int min, max;
+
+		min = sched_get_priority_min(sched_policy);
+		max = sched_get_priority_max(sched_policy);
+		if ((sched_priority < min) || (sched_priority > max)) {
+			log_warn("Scheduling priority %d out of range, using %d", sched_priority, min);
+			sched_priority = min;
+		}
+		param.sched_priority = sched_priority;
+		if (sched_setscheduler(0, sched_policy, &param) == -1)
+			log_err("Failed to set scheduling policy (%s)", strerror(errno));
+		else
+			log_info(1, "Running with %s scheduling policy at priority %d", (sched_policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR", sched_priority);
+	}
+
+	if (cpu_affinity[0]) {
+		cpu_set_t cpus;
+		struct scan s;
+		unsigned long first, last;
+
+		CPU_ZERO(&cpus);
+		scan_init_str(&s, cpu_affinity);
+		while (scan_range(&s, &first, &last)) {
+			for (; (first <= last) && (first < CPU_SETSIZE); first++)
+				CPU_SET(first, &cpus);
+		}
+		if (!scan_eof(&s) || (CPU_COUNT(&cpus) == 0))
+			log_err("Invalid CPU list \"%s\"", cpu_affinity);
+		else if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+			log_err("Failed to set CPU affinity to %s (%s)", cpu_affinity, strerror(errno));
+		else
+			log_info(1, "CPU affinity set to %s", cpu_affinity);
+	}
+}
+
+/*
+ * Touch LOCKED_STACK_SIZE of stack so it is resident when memory is
+ * locked
+ */
+static void
+prefault_stack(void)
+{
+	volatile char stack[LOCKED_STACK_SIZE];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += getpagesize())
+		stack[i] = 0;
+}
+
+/*
+ * Lock all of the daemon in memory, now and as it grows, so it is
+ * never reclaimed or swapped out and sampling, compaction and writes
+ * to watermark_scale_factor are not held up by the memory pressure
+ * they are meant to head off. The hot loop does not allocate, but libc
+ * does for stdio and syslog. All allocations are kept in a single heap
+ * that is never trimmed or extended with mmap and the heap is grown
+ * up front, so they are served from memory locked here. Failure to
+ * lock memory is not fatal.
+ */
+static void
+lock_in_memory(void)
+{
+	void *volatile arena;
+
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_TRIM_THRESHOLD, -1);
+	arena = malloc(LOCKED_ARENA_SIZE);
+	free(arena);
+	prefault_stack();
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		log_err("Failed to lock memory (%s)", strerror(errno));
+		lock_mem = 0;
+		return;
+	}
+	log_info(1, "Locked in memory, peak RSS %ld kB", peak_rss());
+}
+
+/*
+ * check_permissions() - Check all required permissions for this program to
+ *			run succesfully
+ */
+static int
+check_permissions(void)
+{
+	int fd;
+	char tmpstr[40];
 
 	/*
 	 * Make sure running kernel supports watermark_scale_factor file
@@ -742,119 +2340,846 @@ check_permissions(void)
 		return 0;
 	}
 
-	if (write(fd, tmpstr, strlen(tmpstr)) < 0) {
-		log_err("Can not write to "RESCALE_WMARK" (%s)", strerror(errno));
+	if (write(fd, tmpstr, strlen(tmpstr)) < 0) {
+		log_err("Can not write to "RESCALE_WMARK" (%s)", strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	return 1;
+}
+
+/*
+ * parse_config() - Parse the configuration file CONFIG_FILE1 or CONFIG_FILE2
+ *
+ * Read the configuration files skipping comment and blank lines. Each
+ * valid line will have a parameter followed by '=' and a value. When
+ * reload is set, the daemon is already running and only options in
+ * reload_options[] are applied, the rest need a restart to change.
+ *
+ * Returns:
+ *	1	Parsing successful
+ *	0	Parsing failed
+ */
+#define MAXTOKEN	32
+#define OPT_V		"VERBOSE"
+#define OPT_GAP		"MAXGAP"
+#define OPT_AGGR	"AGGRESSIVENESS"
+#define OPT_PSI		"PSI_TRIGGER"
+#define OPT_ADAPT	"ADAPTIVE_SAMPLING"
+#define OPT_PAGETYPE	"PAGETYPEINFO"
+#define OPT_POLICY	"SCHED_POLICY"
+#define OPT_PRIO	"SCHED_PRIORITY"
+#define OPT_CPUS	"CPU_AFFINITY"
+#define OPT_LOCK	"LOCK_MEMORY"
+#define OPT_METRICS	"METRICS_LISTEN"
+#define OPT_TUNE	"AUTO_TUNE"
+#define OPT_LEAD	"RECLAIM_LEAD"
+#define OPT_WINDOW	"COMPACTION_WINDOW"
+#define OPT_STEP	"WSF_STEP"
+#define OPT_CONTROL	"WSF_CONTROL"
+#define OPT_SETPOINT	"WSF_SETPOINT"
+#define OPT_KP		"WSF_KP"
+#define OPT_KI		"WSF_KI"
+#define OPT_DEADBAND	"WSF_DEADBAND"
+#define OPT_DWELL	"WSF_DWELL"
+#define OPT_LOOKBACK	"LOOKBACK"
+#define OPT_MODEL	"TREND_MODEL"
+#define OPT_ALPHA	"TREND_ALPHA"
+#define OPT_BETA	"TREND_BETA"
+#define OPT_CONF	"CONFIDENCE"
+#define OPT_CMODE	"COMPACTION_MODE"
+#define OPT_BUDGET	"COMPACTION_BUDGET"
+#define OPT_RMODE	"RECLAIM_MODE"
+#define OPT_CGROUP	"RECLAIM_CGROUP"
+#define OPT_SWAPPINESS	"RECLAIM_SWAPPINESS"
+#define OPT_SOCKET	"CONTROL_SOCKET"
+#define OPT_SOCKMODE	"CONTROL_SOCKET_MODE"
+#define OPT_SOCKGROUP	"CONTROL_SOCKET_GROUP"
+#define OPT_STALLS	"STALL_TRACING"
+
+/*
+ * Options that can be changed without a restart. None of these bear
+ * on the state carried from one sample to the next.
+ */
+static const char *reload_options[] = {
+	OPT_V, OPT_GAP, OPT_AGGR, OPT_ADAPT, OPT_CONF, OPT_BUDGET,
+	OPT_SETPOINT, OPT_KP, OPT_KI, OPT_DEADBAND, OPT_DWELL, NULL
+};
+
+static int
+reloadable(const char *token)
+{
+	const char **opt;
+
+	for (opt = reload_options; *opt; opt++)
+		if (strcmp(token, *opt) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Options given on the command line, which take precedence over the
+ * configuration file on reload as they do at startup
+ */
+static int cmdline_verbose, cmdline_aggr, cmdline_gap;
+
+static int
+from_cmdline(const char *token)
+{
+	return ((cmdline_verbose && (strcmp(token, OPT_V) == 0)) ||
+		(cmdline_aggr && (strcmp(token, OPT_AGGR) == 0)) ||
+		(cmdline_gap && (strcmp(token, OPT_GAP) == 0)));
+}
+
+/*
+ * Copy a string value from configuration file into dst stripping
+ * surrounding whitespace and quotes
+ */
+static void
+config_str(char *val, char *dst, size_t size)
+{
+	size_t len;
+
+	while (isspace(*val) || (*val == '"'))
+		val++;
+	len = strlen(val);
+	while ((len > 0) && (isspace(val[len-1]) || (val[len-1] == '"')))
+		len--;
+	if (len >= size)
+		len = size - 1;
+	memcpy(dst, val, len);
+	dst[len] = 0;
+}
+
+/*
+ * Parse the range a tunable is kept in, as min-max, or a single value
+ * to hold it at
+ */
+static void
+config_range(char *val, struct tune_range *r, const char *name)
+{
+	unsigned long min, max;
+	struct scan s;
+
+	scan_init_str(&s, val);
+	if (scan_range(&s, &min, &max) && (min > 0)) {
+		r->min = min;
+		r->max = max;
+	}
+	else {
+		log_err("Invalid range \"%s\" for %s. Proceeding with defaults", val, name);
+	}
+}
+
+int
+parse_config(int reload)
+{
+	FILE *fstream;
+	char *buf = NULL;
+	size_t n = 0;
+
+	if ((fstream = fopen(CONFIG_FILE1, "r")) == NULL) {
+		if (errno == ENOENT) {
+			/*
+			 * Either of CONFIG_FILE1 and CONFIG_FILE2 may exist
+			 */
+			if ((fstream = fopen(CONFIG_FILE2, "r")) == NULL) {
+				/* Config file may not exist and that is ok */
+				if (errno == ENOENT) {
+					return 1;
+				}
+				else {
+					log_err("Can not open "CONFIG_FILE2" (%s)", strerror(errno));
+					return 0;
+				}
+			}
+		}
+		else {
+			log_err("Can not open "CONFIG_FILE1" (%s)", strerror(errno));
+			return 0;
+		}
+	}
+
+	while (getline(&buf, &n, fstream) > 0) {
+		int i = 0;
+		int j = 0;
+		unsigned long val;
+		char token[MAXTOKEN];
+
+		/* Skip comments */
+		if (buf[0] == '#')
+			goto nextline;
+
+		n = strlen(buf);
+		/* Skip any whitespace at the beginning of a line */
+		while ((i < n) && (isspace(buf[i])))
+			i++;
+		if (i >= n)
+			goto nextline;
+
+		/*
+		 * Now look for '='. A valid line will  have a parameter
+		 * name followed by '=' and a value with whitespace possible
+		 * in between
+		 */
+		while ((buf[i] != '=') && (i < n) && (j < MAXTOKEN))
+			if (!isspace(buf[i]))
+				token[j++] = buf[i++];
+			else
+				i++;
+		if (i >= n)
+			goto nextline;
+		token[j] = 0;
+		val = strtoul(&buf[i+1], NULL, 0);
+
+		if (reload && !reloadable(token)) {
+			log_info(3, "%s can not be changed without a restart", token);
+			goto nextline;
+		}
+		if (reload && from_cmdline(token)) {
+			log_info(3, "%s is set on the command line", token);
+			goto nextline;
+		}
+
+		if (strncmp(token, OPT_V, sizeof(OPT_V)) == 0) {
+			if(val <= MAX_VERBOSE) 
+				verbose = val;
+			else
+				log_err("Verbosity value is greater than %d. Proceeding with defaults", MAX_VERBOSE);
+		}
+		else if (strncmp(token, OPT_GAP, sizeof(OPT_GAP)) == 0)
+			maxgap = val;
+		else if (strncmp(token, OPT_AGGR, sizeof(OPT_AGGR)) == 0) {
+			if(val <= MAX_AGGRESSIVE)
+				aggressiveness = val;
+			else
+				log_err("Aggressiveness value is greater than %d. Proceeding with defaults", MAX_AGGRESSIVE);
+		}
+		else if (strncmp(token, OPT_LOOKBACK, sizeof(OPT_LOOKBACK)) == 0) {
+			if ((val >= MIN_LOOKBACK) && (val <= MAX_LOOKBACK))
+				lookback = val;
+			else
+				log_err("Lookback window must be between %d and %d samples. Proceeding with defaults", MIN_LOOKBACK, MAX_LOOKBACK);
+		}
+		else if (strncmp(token, OPT_MODEL, sizeof(OPT_MODEL)) == 0) {
+			char model[MAXTOKEN];
+			int m;
+
+			config_str(&buf[i+1], model, sizeof(model));
+			if ((m = find_trend_model(model)) >= 0)
+				trend_model = m;
+			else
+				log_err("Unknown trend model \"%s\". Proceeding with defaults", model);
+		}
+		else if (strncmp(token, OPT_ALPHA, sizeof(OPT_ALPHA)) == 0) {
+			if ((val >= 1) && (val <= 100))
+				trend_alpha = val;
+			else
+				log_err("Trend smoothing factor must be between 1 and 100. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_BETA, sizeof(OPT_BETA)) == 0) {
+			if ((val >= 1) && (val <= 100))
+				trend_beta = val;
+			else
+				log_err("Trend smoothing factor must be between 1 and 100. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_CONF, sizeof(OPT_CONF)) == 0) {
+			if ((val == 0) || ((val >= 50) && (val <= 99)))
+				confidence = val;
+			else
+				log_err("Confidence level must be 0 or between 50 and 99. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_CMODE, sizeof(OPT_CMODE)) == 0) {
+			char mode[MAXTOKEN];
+
+			config_str(&buf[i+1], mode, sizeof(mode));
+			if (strcasecmp(mode, "full") == 0)
+				compaction_mode = COMPACT_FULL;
+			else if (strcasecmp(mode, "proactive") == 0)
+				compaction_mode = COMPACT_PROACTIVE;
+			else
+				log_err("Unknown compaction mode \"%s\". Proceeding with defaults", mode);
+		}
+		else if (strncmp(token, OPT_BUDGET, sizeof(OPT_BUDGET)) == 0) {
+			if (val <= 60000)
+				compact_budget = val;
+			else
+				log_err("Compaction budget is more than 60000 msec per minute. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_RMODE, sizeof(OPT_RMODE)) == 0) {
+			char mode[MAXTOKEN];
+
+			config_str(&buf[i+1], mode, sizeof(mode));
+			if (strcasecmp(mode, "watermark") == 0)
+				reclaim_mode = RECLAIM_WATERMARK;
+			else if (strcasecmp(mode, "cgroup") == 0)
+				reclaim_mode = RECLAIM_CGROUP;
+			else
+				log_err("Unknown reclaim mode \"%s\". Proceeding with defaults", mode);
+		}
+		else if (strncmp(token, OPT_CGROUP, sizeof(OPT_CGROUP)) == 0)
+			config_str(&buf[i+1], reclaim_cgroup, sizeof(reclaim_cgroup));
+		else if (strncmp(token, OPT_SWAPPINESS, sizeof(OPT_SWAPPINESS)) == 0) {
+			if (val <= 200)
+				reclaim_swappiness = val;
+			else
+				log_err("Reclaim swappiness must be between 0 and 200. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_ADAPT, sizeof(OPT_ADAPT)) == 0)
+			adaptive_sampling = (val != 0);
+		else if (strncmp(token, OPT_PAGETYPE, sizeof(OPT_PAGETYPE)) == 0)
+			pagetype_mode = (val != 0);
+		else if (strncmp(token, OPT_POLICY, sizeof(OPT_POLICY)) == 0) {
+			char policy[MAXTOKEN];
+
+			config_str(&buf[i+1], policy, sizeof(policy));
+			if (strcasecmp(policy, "fifo") == 0)
+				sched_policy = SCHED_FIFO;
+			else if (strcasecmp(policy, "rr") == 0)
+				sched_policy = SCHED_RR;
+			else if (strcasecmp(policy, "other") == 0)
+				sched_policy = SCHED_OTHER;
+			else
+				log_err("Unknown scheduling policy \"%s\". Proceeding with defaults", policy);
+		}
+		else if (strncmp(token, OPT_PRIO, sizeof(OPT_PRIO)) == 0)
+			sched_priority = val;
+		else if (strncmp(token, OPT_CPUS, sizeof(OPT_CPUS)) == 0)
+			config_str(&buf[i+1], cpu_affinity, sizeof(cpu_affinity));
+		else if (strncmp(token, OPT_LOCK, sizeof(OPT_LOCK)) == 0)
+			lock_mem = (val != 0);
+		else if (strncmp(token, OPT_METRICS, sizeof(OPT_METRICS)) == 0)
+			config_str(&buf[i+1], metrics_listen, sizeof(metrics_listen));
+		else if (strncmp(token, OPT_SOCKET, sizeof(OPT_SOCKET)) == 0)
+			config_str(&buf[i+1], control_socket, sizeof(control_socket));
+		else if (strncmp(token, OPT_SOCKMODE, sizeof(OPT_SOCKMODE)) == 0)
+			control_mode = val & 0777;
+		else if (strncmp(token, OPT_SOCKGROUP, sizeof(OPT_SOCKGROUP)) == 0)
+			config_str(&buf[i+1], control_group, sizeof(control_group));
+		else if (strncmp(token, OPT_STALLS, sizeof(OPT_STALLS)) == 0)
+			stall_tracing = (val != 0);
+		else if (strncmp(token, OPT_TUNE, sizeof(OPT_TUNE)) == 0)
+			auto_tune = (val != 0);
+		else if (strncmp(token, OPT_LEAD, sizeof(OPT_LEAD)) == 0)
+			config_range(&buf[i+1], &reclaim_lead_range, OPT_LEAD);
+		else if (strncmp(token, OPT_WINDOW, sizeof(OPT_WINDOW)) == 0)
+			config_range(&buf[i+1], &compact_window_range, OPT_WINDOW);
+		else if (strncmp(token, OPT_STEP, sizeof(OPT_STEP)) == 0)
+			config_range(&buf[i+1], &wsf_step_range, OPT_STEP);
+		else if (strncmp(token, OPT_CONTROL, sizeof(OPT_CONTROL)) == 0) {
+			char mode[MAXTOKEN];
+
+			config_str(&buf[i+1], mode, sizeof(mode));
+			if (strcasecmp(mode, "step") == 0)
+				wsf_control = WSF_CONTROL_STEP;
+			else if (strcasecmp(mode, "pi") == 0)
+				wsf_control = WSF_CONTROL_PI;
+			else
+				log_err("Unknown watermark control mode \"%s\". Proceeding with defaults", mode);
+		}
+		else if (strncmp(token, OPT_SETPOINT, sizeof(OPT_SETPOINT)) == 0) {
+			if (val >= 100)
+				wsf_setpoint = val;
+			else
+				log_err("Watermark setpoint must be at least 100%% of high watermark. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_KP, sizeof(OPT_KP)) == 0)
+			wsf_kp = val;
+		else if (strncmp(token, OPT_KI, sizeof(OPT_KI)) == 0)
+			wsf_ki = val;
+		else if (strncmp(token, OPT_DEADBAND, sizeof(OPT_DEADBAND)) == 0) {
+			if (val < 100)
+				wsf_deadband = val;
+			else
+				log_err("Watermark deadband must be less than 100%%. Proceeding with defaults");
+		}
+		else if (strncmp(token, OPT_DWELL, sizeof(OPT_DWELL)) == 0)
+			wsf_dwell = val;
+		else if (strncmp(token, OPT_PSI, sizeof(OPT_PSI)) == 0) {
+			if (nr_psi_triggers < MAX_PSI_TRIGGERS)
+				config_str(&buf[i+1], psi_trigger[nr_psi_triggers++], PSI_TRIGGER_LEN);
+			else
+				log_err("More than %d memory pressure triggers. Ignoring \"%s\"", MAX_PSI_TRIGGERS, &buf[i+1]);
+		}
+		else {
+			log_err("Error in configuration file at token \"%s\". Proceeding with defaults", token);
+			break;
+		}
+
+
+nextline:
+		free(buf);
+		buf = NULL;
+		n = 0;
+	}
+
+	free(buf);
+	fclose(fstream);
+	return 1;
+}
+
+/*
+ * Read the configuration file again on SIGHUP. Trend lines, rates and
+ * everything else learned from past samples are kept, only the
+ * parameters change. Returns 1 if the sampling interval changed.
+ */
+static int
+reload_configuration(void)
+{
+	int old_periodicity = periodicity;
+
+	log_info(1, "Reloading configuration");
+	if (!parse_config(1))
+		return 0;
+	apply_aggressiveness();
+	pi_started = 0;
+	pr_info("Configuration reloaded (verbose=%d, aggressiveness=%d, maxgap=%lu)", verbose, aggressiveness, maxgap);
+
+	return (periodicity != old_periodicity);
+}
+
+/*
+ * Hint commands, which any user can send:
+ *
+ *	hint <count> <order> <node|all> <sec>
+ *					count blocks of order are about
+ *					to be allocated on node, or across
+ *					all nodes, within sec seconds.
+ *					Replies with the id of the hint.
+ *	cancel <id>			Drop a hint
+ *	hints				List hints in effect
+ *
+ * A new hint takes a sample right away so reclaim and compaction for
+ * it can start without waiting for the next tick. Returns -1 if cmd is
+ * not a hint command, else 1 if a sample is to be taken right away.
+ */
+static int
+run_hint_command(const char *cmd, char *reply, size_t size, uid_t uid)
+{
+	unsigned long count, managed = 0;
+	struct node_state *node = NULL;
+	char where[16], extra;
+	struct timespec spec;
+	int order, nid, id;
+	long long now;
+	long secs;
+
+	sample_clock(&spec);
+	now = get_msecs(&spec);
+
+	if (strncmp(cmd, "hint ", 5) == 0) {
+		if (sscanf(cmd, "hint %lu %d %15s %ld %c", &count, &order,
+				where, &secs, &extra) != 4) {
+			snprintf(reply, size, "error usage: hint <count> <order> <node|all> <sec>\n");
+			return 0;
+		}
+		if (strcmp(where, "all") == 0) {
+			nid = HINT_ALL_NODES;
+			for_each_node(node)
+				managed += node->managed_pages;
+		}
+		else {
+			char *end;
+
+			nid = strtol(where, &end, 10);
+			if ((*end != 0) || ((node = find_node(nid)) == NULL)) {
+				snprintf(reply, size, "error no node %s\n", where);
+				return 0;
+			}
+			managed = node->managed_pages;
+		}
+		if ((order < 0) || (order > MAX_ORDER - 2)) {
+			snprintf(reply, size, "error order must be between 0 and %d\n", MAX_ORDER - 2);
+			return 0;
+		}
+		if ((secs < 1) || (secs > MAX_HINT_SECS)) {
+			snprintf(reply, size, "error time must be between 1 and %d sec\n", MAX_HINT_SECS);
+			return 0;
+		}
+		if ((count == 0) || (count > (managed >> order))) {
+			snprintf(reply, size, "error %s has room for %lu order %d blocks\n", where, managed >> order, order);
+			return 0;
+		}
+		/*
+		 * Hints make the daemon reclaim and compact for everyone
+		 * on the node, so users other than root can only ask for
+		 * a share of it
+		 */
+		if ((uid != 0) && (user_hint_pages(uid, nid, nr_nodes, now) +
+				(count << order) >
+				managed * MAX_USER_HINT_PCT / 100)) {
+			snprintf(reply, size, "error hints of a user can be for up to %d%% of memory\n", MAX_USER_HINT_PCT);
+			return 0;
+		}
+		if ((id = add_hint(nid, order, count, secs, now, uid)) < 0) {
+			snprintf(reply, size, "error too many hints\n");
+			return 0;
+		}
+		snprintf(reply, size, "ok %d\n", id);
+		return 1;
+	}
+	if (sscanf(cmd, "cancel %d %c", &id, &extra) == 1) {
+		if (cancel_hint(id, uid)) {
+			snprintf(reply, size, "ok\n");
+		}
+		else {
+			snprintf(reply, size, "error no hint %d\n", id);
+		}
+		return 0;
+	}
+	if (strcmp(cmd, "hints") == 0) {
+		int len = snprintf(reply, size, "ok %d\n", nr_active_hints());
+
+		format_hints(reply + len, size - len, now);
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Carry out a command from the control socket sent by user uid and put
+ * the reply in reply. Commands other than hints and status change what
+ * the daemon does and can only be sent by root. Commands are:
+ *
+ *	status				Report parameters in effect
+ *	aggressiveness <1-3>		Switch level, drops periodicity and
+ *					max_compaction_order set here
+ *	maxgap <GB>			Maximum gap between watermarks, 0
+ *					for none
+ *	periodicity <sec>		Sampling interval, 0 for the one of
+ *					the aggressiveness level
+ *	max_compaction_order <order>	Highest order to compact for, 0
+ *					for the one of the aggressiveness level
+ *	verbose <0-5>			Verbosity level
+ *	pause, resume			Stop and start taking actions
+ *	sample				Take a sample right away
+ *	reload				Read the configuration file again
+ *
+ * A change of sampling interval takes a sample right away so the new
+ * interval does not wait for the old one to run out. Returns 1 if a
+ * sample is to be taken right away.
+ */
+static int
+run_command(const char *cmd, char *reply, size_t size, uid_t uid)
+{
+	int old_periodicity = periodicity;
+	char word[32], extra;
+	long val = 0;
+	int n;
+
+	if ((n = run_hint_command(cmd, reply, size, uid)) >= 0)
+		return n;
+
+	n = sscanf(cmd, "%31s %ld %c", word, &val, &extra);
+	snprintf(reply, size, "ok\n");
+
+	if ((n == 1) && (strcmp(word, "status") == 0)) {
+		snprintf(reply, size, "ok aggressiveness %d periodicity %d max_compaction_order %d maxgap %lu max_wsf %u wsf %d verbose %d hints %d %s\n",
+			aggressiveness, periodicity, max_compaction_order,
+			maxgap, mywsf, read_wsf(), verbose, nr_active_hints(),
+			paused ? "paused" : "running");
+		return 0;
+	}
+	else if (uid != 0) {
+		snprintf(reply, size, "error only root can change settings\n");
+		return 0;
+	}
+	else if ((n == 1) && (strcmp(word, "pause") == 0)) {
+		paused = 1;
+		pr_info("Actions paused");
+		return 0;
+	}
+	else if ((n == 1) && (strcmp(word, "resume") == 0)) {
+		if (paused)
+			pi_started = 0;
+		paused = 0;
+		pr_info("Actions resumed");
+		return 0;
+	}
+	else if ((n == 1) && (strcmp(word, "sample") == 0)) {
+		return 1;
+	}
+	else if ((n == 1) && (strcmp(word, "reload") == 0)) {
+		return reload_configuration();
+	}
+	else if (n != 2) {
+		snprintf(reply, size, "error unknown command \"%s\"\n", cmd);
+		return 0;
+	}
+
+	if (strcmp(word, "aggressiveness") == 0) {
+		if ((val < 1) || (val > MAX_AGGRESSIVE))
+			goto range;
+		aggressiveness = val;
+		periodicity_override = compaction_order_override = 0;
+	}
+	else if (strcmp(word, "maxgap") == 0) {
+		if (val < 0)
+			goto range;
+		maxgap = val;
+	}
+	else if (strcmp(word, "periodicity") == 0) {
+		if ((val < 0) || (val > MAX_PERIODICITY))
+			goto range;
+		periodicity_override = val;
+	}
+	else if (strcmp(word, "max_compaction_order") == 0) {
+		if ((val < 0) || (val > MAX_ORDER - 2))
+			goto range;
+		compaction_order_override = val;
+	}
+	else if (strcmp(word, "verbose") == 0) {
+		if ((val < 0) || (val > MAX_VERBOSE))
+			goto range;
+		verbose = val;
+		return 0;
+	}
+	else {
+		snprintf(reply, size, "error unknown command \"%s\"\n", cmd);
+		return 0;
+	}
+
+	apply_aggressiveness();
+	pr_info("Parameters changed (aggressiveness=%d, periodicity=%d, max_compaction_order=%d, maxgap=%lu)", aggressiveness, periodicity, max_compaction_order, maxgap);
+	return (periodicity != old_periodicity);
+
+range:
+	snprintf(reply, size, "error %ld is out of range for %s\n", val, word);
+	return 0;
+}
+
+/*
+ * Answer the command of control client i once all of it has come in.
+ * Returns 1 if a sample is to be taken right away.
+ */
+static int
+serve_control(int i)
+{
+	char cmd[CONTROL_CMD_SIZE], reply[CONTROL_REPLY_SIZE];
+	int sample;
+	uid_t uid;
+
+	if (!read_control(i, cmd, sizeof(cmd), &uid))
 		return 0;
-	}
-	close(fd);
+	log_info(2, "Control command \"%s\" from uid %u", cmd, (unsigned int)uid);
+	sample = run_command(cmd, reply, sizeof(reply), uid);
+	reply_control(i, reply);
 
-	return 1;
+	return sample;
 }
 
 /*
- * parse_config() - Parse the configuration file CONFIG_FILE1 or CONFIG_FILE2
- *
- * Read the configuration files skipping comment and blank lines. Each
- * valid line will have a parameter followed by '=' and a value.
+ * Wait until it is time to take the next sample. Wake up on the next
+ * tick of the sampling timer or as soon as the kernel reports a memory
+ * pressure event, if memory pressure triggers are in use. Commands on
+ * the control socket and SIGHUP are taken care of while waiting, and
+ * wake up for a sample if they ask for one, in which case the next
+ * tick is counted from now.
  *
  * Returns:
- *	1	Parsing successful
- *	0	Parsing failed
+ *	1	Woken up by a memory pressure event or a command
+ *	0	Woken up by sampling timer
  */
-#define MAXTOKEN	32
-#define OPT_V		"VERBOSE"
-#define OPT_GAP		"MAXGAP"
-#define OPT_AGGR	"AGGRESSIVENESS"
-int
-parse_config()
+static int
+wait_for_sample(void)
 {
-	FILE *fstream;
-	char *buf = NULL;
-	size_t n = 0;
+	int i, ret, sample, pressure = 0;
 
-	if ((fstream = fopen(CONFIG_FILE1, "r")) == NULL) {
-		if (errno == ENOENT) {
-			/*
-			 * Either of CONFIG_FILE1 and CONFIG_FILE2 may exist
-			 */
-			if ((fstream = fopen(CONFIG_FILE2, "r")) == NULL) {
-				/* Config file may not exist and that is ok */
-				if (errno == ENOENT) {
-					return 1;
-				}
-				else {
-					log_err("Can not open "CONFIG_FILE2" (%s)", strerror(errno));
-					return 0;
+	while (1) {
+		if (terminate) {
+			pr_info("Memoptimizer exiting");
+			if (!dry_run)
+				save_checkpoint(wsf_set);
+			if (lock_mem) {
+				log_info(1, "Peak RSS %ld kB", peak_rss());
+			}
+			if (poll_fds[POLL_CONTROL].fd >= 0)
+				unlink(control_socket);
+			close_stalls();
+			bailout(0);
+		}
+		if (dump_stats) {
+			dump_stats = 0;
+			stats_dump();
+		}
+		if (reload_config) {
+			reload_config = 0;
+			if (reload_configuration())
+				goto sample_now;
+		}
+		/*
+		 * Clients of the control socket are given until their
+		 * deadline to send a command, a sample is never held up
+		 * waiting for one
+		 */
+		if ((ret = poll(poll_fds, POLL_PSI + nr_psi_triggers,
+				expire_control())) > 0) {
+			sample = 0;
+			if (poll_fds[POLL_CONTROL].revents & POLLIN) {
+				accept_control(poll_fds[POLL_CONTROL].fd);
+				ret--;
+			}
+			for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+				if (poll_fds[POLL_CLIENT + i].revents) {
+					sample |= serve_control(i);
+					ret--;
 				}
 			}
+			if (sample)
+				goto sample_now;
+			if (ret > 0)
+				break;
+			continue;
 		}
-		else {
-			log_err("Can not open "CONFIG_FILE1" (%s)", strerror(errno));
-			return 0;
+		if ((ret < 0) && (errno != EINTR)) {
+			log_err("poll for next sample failed (%s)", strerror(errno));
+			bailout(1);
 		}
 	}
 
-	while (getline(&buf, &n, fstream) > 0) {
-		int i = 0;
-		int j = 0;
-		unsigned long val;
-		char token[MAXTOKEN];
-
-		/* Skip comments */
-		if (buf[0] == '#')
-			goto nextline;
-
-		n = strlen(buf);
-		/* Skip any whitespace at the beginning of a line */
-		while ((i < n) && (isspace(buf[i])))
-			i++;
-		if (i >= n)
-			goto nextline;
+	if (poll_fds[POLL_TIMER].revents & POLLIN) {
+		uint64_t expirations;
 
 		/*
-		 * Now look for '='. A valid line will  have a parameter
-		 * name followed by '=' and a value with whitespace possible
-		 * in between
+		 * Timer is one shot, so the tick that just fired is
+		 * the one last armed
 		 */
-		while ((buf[i] != '=') && (i < n) && (j < MAXTOKEN))
-			if (!isspace(buf[i]))
-				token[j++] = buf[i++];
-			else
-				i++;
-		if (i >= n)
-			goto nextline;
-		token[j] = 0;
-		val = strtoul(&buf[i+1], NULL, 0);
+		if (read(poll_fds[POLL_TIMER].fd, &expirations,
+				sizeof(expirations)) == sizeof(expirations))
+			last_tick = next_tick;
+	}
 
-		if (strncmp(token, OPT_V, sizeof(OPT_V)) == 0) {
-			if(val <= MAX_VERBOSE) 
-				verbose = val;
-			else
-				log_err("Verbosity value is greater than %d. Proceeding with defaults", MAX_VERBOSE);
-		}
-		else if (strncmp(token, OPT_GAP, sizeof(OPT_GAP)) == 0)
-			maxgap = val;
-		else if (strncmp(token, OPT_AGGR, sizeof(OPT_AGGR)) == 0) {
-			if(val <= MAX_AGGRESSIVE)
-				aggressiveness = val;
-			else
-				log_err("Aggressiveness value is greater than %d. Proceeding with defaults", MAX_AGGRESSIVE);
+	for (i = 0; i < nr_psi_triggers; i++) {
+		struct pollfd *pfd = &poll_fds[POLL_PSI + i];
+
+		if (pfd->revents & POLLERR) {
+			/*
+			 * Trigger is no longer valid. Go back to
+			 * sampling at fixed intervals.
+			 */
+			log_err("Memory pressure trigger \"%s\" failed, reverting to periodic sampling", psi_trigger[i]);
+			for (i = 0; i < nr_psi_triggers; i++)
+				close(poll_fds[POLL_PSI + i].fd);
+			nr_psi_triggers = 0;
+			return 0;
 		}
-		else {
-			log_err("Error in configuration file at token \"%s\". Proceeding with defaults", token);
-			break;
+		if (pfd->revents & POLLPRI) {
+			log_info(3, "Memory pressure event (%s)", psi_trigger[i]);
+			pressure = 1;
 		}
+	}
 
+	return pressure;
 
-nextline:
-		free(buf);
-		buf = NULL;
-		n = 0;
+sample_now:
+	clock_gettime(CLOCK_MONOTONIC, &last_tick);
+	return 1;
+}
+
+/*
+ * Decisions made from a trace being replayed
+ */
+static const char *verdict_names[] = {
+	"-", "reclaim", "compact", "reclaim,compact", "lower",
+	"reclaim,lower", "compact,lower", "reclaim,compact,lower"
+};
+
+struct replay_stats {
+	unsigned long cycles;
+	unsigned long reclaim;		/* Node cycles reclaim was recommended */
+	unsigned long compact;
+	unsigned long wsf_changes;
+	int first_wsf, last_wsf;
+};
+
+static struct replay_stats replay_stats = { .first_wsf = -1 };
+
+/*
+ * Publish state as of the end of a cycle for the metrics exporter. The
+ * snapshot is filled in place, so this does not allocate or wait for
+ * the exporter.
+ */
+static void
+publish_metrics(void)
+{
+	struct metrics_snapshot *s;
+	struct node_state *node;
+	int order;
+
+	if ((s = metrics_begin()) == NULL)
+		return;
+
+	s->wsf = read_wsf();
+	s->max_wsf = mywsf;
+	s->tunables = tunables;
+	s->proactiveness = (compaction_mode == COMPACT_PROACTIVE) ?
+				proactiveness : -1;
+	s->nr_nodes = 0;
+	for_each_node(node) {
+		struct metrics_node *n;
+
+		if (s->nr_nodes == METRICS_MAX_NODES)
+			break;
+		n = &s->nodes[s->nr_nodes++];
+		n->nid = node->nid;
+		n->ready = node->ready;
+		n->verdict = node->verdict;
+		n->free_pages = node->free_pages;
+		n->managed_pages = node->managed_pages;
+		n->min_wmark = node->min_wmark;
+		n->low_wmark = node->low_wmark;
+		n->high_wmark = node->high_wmark;
+		n->reclaim_horizon = node->reclaim_horizon;
+		n->compact_horizon = node->compact_horizon;
+		n->reclaim_rate = node_reclaim_rate(node);
+		n->compaction_rate = node->compaction_rate;
+		for (order = 0; order < MAX_ORDER; order++)
+			n->slope[order] = node->trends.lines[order].slope * 1000;
 	}
+	memcpy(s->counters, stat_counters, sizeof(s->counters));
+	memcpy(s->timers, stat_timers, sizeof(s->timers));
+	metrics_publish();
+}
 
-	free(buf);
-	fclose(fstream);
-	return 1;
+/*
+ * Print decisions of a cycle of a replay, one line per node with time
+ * of the cycle in the trace, free pages, the verdict and the
+ * watermark_scale_factor that results
+ */
+static void
+report_cycle(unsigned long msecs)
+{
+	struct replay_stats *rs = &replay_stats;
+	struct node_state *node;
+	int wsf = get_wsf();
+
+	for_each_node(node) {
+		printf("%lu node %d free %lu verdict %s wsf %d\n", msecs,
+			node->nid, node->free_pages,
+			verdict_names[node->verdict & 7], wsf);
+		if (node->verdict & MEMPREDICT_RECLAIM)
+			rs->reclaim++;
+		if (node->verdict & MEMPREDICT_COMPACT)
+			rs->compact++;
+	}
+	if (rs->cycles++ == 0)
+		rs->first_wsf = rs->last_wsf = wsf;
+	if (wsf != rs->last_wsf)
+		rs->wsf_changes++;
+	rs->last_wsf = wsf;
+}
+
+static void
+report_replay(void)
+{
+	struct replay_stats *rs = &replay_stats;
+
+	printf("Replayed %lu cycles: reclaim in %lu and compaction in %lu node cycles, watermark scale factor changed %lu times from %d to %d\n",
+		rs->cycles, rs->reclaim, rs->compact, rs->wsf_changes,
+		rs->first_wsf, rs->last_wsf);
+	stats_dump();
 }
 
 void
@@ -867,7 +3192,9 @@ help_msg(char *progname)
 		    "[-h] "
 		    "[-s] "
 		    "[-m <max_gb>] "
-		    "[-a <level>]\n"
+		    "[-a <level>] "
+		    "[--record <file> | --replay <file>] "
+		    "[--control <command>]\n"
 		    "Version %s\n"
 		    "Options:\n"
 		    "\t-v\tVerbose mode (use multiple to increase verbosity)\n"
@@ -876,34 +3203,54 @@ help_msg(char *progname)
 		    "\t-s\tSimulate a run (dry run, implies \"-v -v -d\")\n"
 		    "\t-m\tMaximum allowed gap between high and low watermarks in GB\n"
 		    "\t-a\tAggressiveness level (1=high, 2=normal (default), 3=low)\n"
+		    "\t--record <file>\n\t\tAppend what is sampled every cycle to trace <file>\n"
+		    "\t--replay <file>\n\t\tMake decisions from trace <file> and print them, without\n\t\tchanging any settings of the system\n"
+		    "\t--control <command>\n\t\tSend <command> to the running daemon on CONTROL_SOCKET and\n\t\tprint its reply\n"
 		    "\nNOTE: config options read from configuration file can be overridden\n      with command line options. Configuration file can be\n      %s or %s\n",
 		    progname, VERSION, CONFIG_FILE1, CONFIG_FILE2);
 }
 
+enum {
+	LONGOPT_RECORD = 256,
+	LONGOPT_REPLAY,
+	LONGOPT_CONTROL
+};
+
+static const struct option long_options[] = {
+	{ "record", required_argument, NULL, LONGOPT_RECORD },
+	{ "replay", required_argument, NULL, LONGOPT_REPLAY },
+	{ "control", required_argument, NULL, LONGOPT_CONTROL },
+	{ NULL, 0, NULL, 0 }
+};
+
 int
 main(int argc, char **argv)
 {
-	int c, i;
+	int c, replay;
+	char *record_file = NULL, *replay_file = NULL, *control_cmd = NULL;
+	struct node_state *node;
 	int errflag = 0;
-	int compaction_requested[MAX_NUMANODES];
-	char *ipath;
-	FILE *ifile;
-	unsigned long last_bigpages[MAX_NUMANODES], last_reclaimed = 0;
-	unsigned long time_elapsed, reclaimed_pages;
+	int quiet_cycles = 0, timeout = 0;
+	int restored_wsf = -1, start_wsf;
+	long long last_checkpoint;
+	struct timespec start;
 
 	openlog("memoptimizer", LOG_PID, LOG_DAEMON);
-	if (parse_config() == 0)
+	if (parse_config(0) == 0)
 		bailout(1);
 
-	while ((c = getopt(argc, argv, "a:m:hsvd")) != -1) {
+	while ((c = getopt_long(argc, argv, "a:m:hsvd", long_options,
+			NULL)) != -1) {
 		switch (c) {
 		case 'a':
 			aggressiveness = atoi(optarg);
 			if ((aggressiveness < 1) || (aggressiveness > 3))
 				aggressiveness = 2;
+			cmdline_aggr = 1;
 			break;
 		case 'm':
 			maxgap = atoi(optarg);
+			cmdline_gap = 1;
 			break;
 		case 'd':
 			debug_mode = 1;
@@ -912,21 +3259,66 @@ main(int argc, char **argv)
 			/* Ignore in case of dry run */
 			if (dry_run == 0)
 				verbose++;
+			cmdline_verbose = 1;
 			break;
 		case 's':
 			dry_run = 1;
 			verbose = 2;
 			debug_mode = 1;
+			cmdline_verbose = 1;
 			break;
 		case 'h':
 			help_msg(argv[0]);
 			bailout(0);
+		case LONGOPT_RECORD:
+			record_file = optarg;
+			break;
+		case LONGOPT_REPLAY:
+			replay_file = optarg;
+			break;
+		case LONGOPT_CONTROL:
+			control_cmd = optarg;
+			break;
 		default:
 			errflag++;
 			break;
 		}
 	}
 
+	/*
+	 * Talk to the running daemon and be done
+	 */
+	if (control_cmd) {
+		char reply[CONTROL_REPLY_SIZE];
+		int ok;
+
+		ok = control_request(control_socket[0] ? control_socket : NULL,
+					control_cmd, reply, sizeof(reply));
+		fputs(reply, ok ? stdout : stderr);
+		exit(ok ? 0 : 1);
+	}
+
+	if (record_file && replay_file) {
+		log_err("--record and --replay can not be used together");
+		errflag++;
+	}
+
+	/*
+	 * A trace is replayed in the foreground, as fast as it can be
+	 * read, and nothing on the system is changed. A trace to record
+	 * is opened before becoming a daemon so a relative path works.
+	 */
+	if (replay_file) {
+		if (!trace_open(replay_file, TRACE_REPLAY))
+			bailout(1);
+		dry_run = 1;
+		debug_mode = 1;
+	}
+	else if (record_file && !trace_open(record_file, TRACE_RECORD)) {
+		bailout(1);
+	}
+	replay = (trace_mode == TRACE_REPLAY);
+
 	/* Become a daemon unless -d was specified */
 	if (!debug_mode)
 		if (daemon(0, 0) != 0) {
@@ -939,175 +3331,260 @@ main(int argc, char **argv)
 		bailout(1);
 	}
 
-	if (!check_permissions())
+	if (!replay && !check_permissions())
 		bailout(1);
 
-	/*
-	 * Set up values for parameters based upon aggressiveness
-	 * level desired
-	 */
-	switch (aggressiveness) {
-		case 1:
-			maxwsf = 400;
-			max_compaction_order = MAX_ORDER - 6;
-			periodicity = LOW_PERIODICITY;
-			break;
-		case 2:
-			maxwsf = 700;
-			max_compaction_order = MAX_ORDER - 4;
-			periodicity = NORM_PERIODICITY;
-			break;
-		case 3:
-			maxwsf = 1000;
-			max_compaction_order = MAX_ORDER - 2;
-			periodicity = HIGH_PERIODICITY;
-			break;
+	if (!replay) {
+		set_scheduling();
+		if (lock_mem)
+			lock_in_memory();
+	}
+
+	if (!procfs_open(&buddyinfo, BUDDYINFO)) {
+		log_err("Failed to open "BUDDYINFO" (%s)", strerror(errno));
+		bailout(1);
+	}
+	if (!procfs_open(&zoneinfo, ZONEINFO)) {
+		log_err("Failed to open "ZONEINFO" (%s)", strerror(errno));
+		bailout(1);
+	}
+	if (!procfs_open(&vmstat, VMSTAT)) {
+		log_err("Failed to open "VMSTAT" (%s)", strerror(errno));
+		bailout(1);
+	}
+	if (pagetype_mode && !procfs_open(&pagetypeinfo, PAGETYPEINFO)) {
+		log_warn("Failed to open "PAGETYPEINFO" (%s), modeling fragmentation per node", strerror(errno));
+		pagetype_mode = 0;
 	}
+	if (!open_nodes())
+		bailout(1);
 
 	update_zone_watermarks();
+	apply_aggressiveness();
+
+	get_thp_order();
+
+	if (!replay && !open_sample_timer())
+		bailout(1);
+	if (!replay && !start_workers(nr_nodes, lock_mem ? LOCKED_STACK_SIZE : 0))
+		bailout(1);
 
 	/*
-	 * If user specifies a maximum gap value for gap between low
-	 * and high watermarks, recompute maxwsf to account for that.
-	 * Update zone page information first.
-         */
-	if (maxgap != 0) {
-		unsigned long total_managed = 0;
-		for (i=0; i<MAX_NUMANODES; i++)
-			total_managed += managed_pages[i];
-		maxwsf = (maxgap * 10000UL * 1024UL * 1024UL * 1024UL)/(total_managed * getpagesize());
-	}
-	mywsf = maxwsf;
+	 * Metrics are an aid to monitoring, the daemon goes on without
+	 * them if they can not be served
+	 */
+	if (!replay && metrics_listen[0] &&
+	    !start_metrics(metrics_listen, lock_mem ? LOCKED_STACK_SIZE : 0))
+		log_err("Not exporting metrics");
 
 	/*
-	 * Initialize number of higher order pages seen in last scan
-	 * and compaction requested per node 
+	 * Commands are served by the main loop in between samples.
+	 * Without the control socket the daemon can still be
+	 * reconfigured with SIGHUP.
 	 */
-	for (i=0; i<MAX_NUMANODES; i++) {
-		last_bigpages[i] = 0;
-		compaction_requested[i] = 0;
+	poll_fds[POLL_CONTROL].fd = -1;
+	poll_fds[POLL_CONTROL].events = POLLIN;
+	init_control(&poll_fds[POLL_CLIENT]);
+	if (!replay && control_socket[0]) {
+		if ((poll_fds[POLL_CONTROL].fd = open_control(control_socket, control_mode, control_group)) == -1)
+			log_err("Not taking commands");
+		else
+			log_info(1, "Taking commands on %s", control_socket);
 	}
 
 	/*
-	 * get base page size for the system and convert it to kB
+	 * Without tracing, stalls are only counted from /proc/vmstat,
+	 * which does not tell how long they were or which node they
+	 * were on
 	 */
-	base_psize = getpagesize()/1024;
+	if (!replay && stall_tracing && open_stalls())
+		log_info(1, "Tracing direct reclaim and compaction stalls");
 
-	ipath = BUDDYINFO;
-	if ((ifile = fopen(ipath, "r")) == NULL) {
-		log_err("fopen(input file)");
-		bailout(1);
+	/*
+	 * Proactive compaction needs compaction_proactiveness, which was
+	 * added in kernel 5.9. Fall back to compacting whole nodes on
+	 * older kernels.
+	 */
+	if (compaction_mode == COMPACT_PROACTIVE) {
+		if ((orig_proactiveness = get_proactiveness()) < 0) {
+			log_warn("Proactive compaction not supported by kernel, compacting whole nodes");
+			compaction_mode = COMPACT_FULL;
+		}
+		else {
+			proactiveness = orig_proactiveness;
+		}
+	}
+	if (compaction_mode == COMPACT_FULL) {
+		log_info(1, "Compacting whole nodes, budget %d msec per minute", compact_budget);
 	}
+	else {
+		log_info(1, "Compacting proactively, compaction_proactiveness is %d", orig_proactiveness);
+	}
+
+	/*
+	 * memory.reclaim was added in kernel 5.19. Fall back to raising
+	 * watermarks if the kernel or the cgroup does not support it.
+	 */
+	if ((reclaim_mode == RECLAIM_CGROUP) && !replay &&
+	    !open_reclaim(reclaim_cgroup, nodes[0].nid, reclaim_swappiness)) {
+		log_warn("Reclaim through cgroup not available, raising watermarks instead");
+		reclaim_mode = RECLAIM_WATERMARK;
+	}
+	if (reclaim_mode == RECLAIM_CGROUP) {
+		log_info(1, "Reclaiming through memory.reclaim of cgroup \"/%s\"", reclaim_cgroup);
+	}
+
+	signal(SIGTERM, handle_terminate);
+	signal(SIGINT, handle_terminate);
+	signal(SIGUSR1, handle_dump_stats);
+	signal(SIGHUP, handle_reload);
+
+	if (nr_psi_triggers && !replay && !open_psi_triggers())
+		log_warn("Memory pressure triggers not available, sampling every %d seconds", periodicity);
 
 	pr_info("Memoptimizer "VERSION" started (verbose=%d, aggressiveness=%d, maxgap=%d)", verbose, aggressiveness, maxgap);
+	log_info(1, "Fitting trend lines with %s model over %d samples", trend_model_name(trend_model), lookback);
+	if (confidence)
+		log_info(1, "Acting on trends only at %d%% confidence", confidence);
+	init_tunables();
+	if (wsf_control == WSF_CONTROL_PI)
+		log_info(1, "Controlling watermarks towards %d%% of high watermark, kp %d, ki %d/min, deadband %d%%, dwell %d sec", wsf_setpoint, wsf_kp, wsf_ki, wsf_deadband, wsf_dwell);
+
+	/*
+	 * Pick up where a previous run in this boot left off, so there
+	 * is no need to wait for a full window of samples before making
+	 * predictions
+	 */
+	start_wsf = get_wsf();
+	if (!replay && load_checkpoint(&restored_wsf) && (restored_wsf >= 0)) {
+		if (restored_wsf == start_wsf) {
+			wsf_set = restored_wsf;
+			log_info(2, "Watermark scale factor %d was set by previous run", wsf_set);
+		}
+		else {
+			log_info(2, "Watermark scale factor was changed since previous run");
+		}
+	}
+	sample_clock(&start);
+	last_checkpoint = get_msecs(&start);
+
+	/*
+	 * Sample reclaim counters once up front so the first cycle,
+	 * which can already make predictions after a restore, knows
+	 * how much can be reclaimed
+	 */
+	update_reclaim_rates(no_pages_reclaimed(&start), &start);
 
 	while (1) {
 		unsigned long nr_free[MAX_ORDER];
 		struct frag_info free[MAX_ORDER];
-		int order, nid, retval;
+		int nid, retval;
 		unsigned long result = 0;
-		struct timespec spec, spec_after, spec_before;
+		struct timespec spec, spec_after, cycle_start, phase_start;
+		struct scan bscan;
+		struct horizon horizon, nearest;
+		struct demand demand;
+		struct stall_rates rates;
+
+		if (!trace_cycle()) {
+			report_replay();
+			bailout(0);
+		}
+		stat_start(&cycle_start);
+		stat_inc(STAT_CYCLES);
 
 		/*
-		 * Start with updated zone watermarks and number of hugepages
-		 * allocated since these can be adjusted by user any time.
-		 * Update maxwsf to account for hugepages just in case
-		 * number of hugepages changed unless user already gave
-		 * a maxgap value.
+		 * Start with updated list of online nodes, zone watermarks
+		 * and number of hugepages allocated since these can be
+		 * adjusted by user any time.
+		 * Update maxwsf to account for hugepages if number of
+		 * hugepages changed unless user already gave a maxgap
+		 * value.
 		 */
+		update_nodes();
+		collect_work();
+		sample_clock(&spec);
+		expire_hints(get_msecs(&spec));
+		stat_start(&phase_start);
 		update_zone_watermarks();
-		update_hugepages();
-		if (maxgap == 0)
+		stat_stop(STAT_ZONEINFO_TIME, &phase_start);
+		if (update_hugepages() && (maxgap == 0))
 			rescale_maxwsf();
 
-		/*
-		 * Keep track of time to calculate the compaction and
-		 * reclaim rates
-		 */
 		total_free_pages = 0;
-		/*
-		 * Get time from CLOCK_MONOTONIC_RAW which is not subject
-		 * to perturbations caused by sysadmin or ntp adjustments.
-		 * This ensures reliable calculations for the least square
-		 * fit algorithm.
-		 */
-		clock_gettime(CLOCK_MONOTONIC_RAW, &spec_before);
+		nearest.ready = 1;
+		nearest.reclaim = nearest.compact = HORIZON_NONE;
+		for_each_node(node) {
+			node->verdict = 0;
+			node->reclaimed_locally = 0;
+		}
 
-		while ((retval = get_next_node(ifile, &nid, nr_free)) != 0) {
-			unsigned long total_free;
+		stat_start(&phase_start);
+		if (!procfs_read(&buddyinfo))
+			bailout(1);
+		stat_stop(STAT_BUDDYINFO_TIME, &phase_start);
+		scan_init(&bscan, &buddyinfo);
+		while ((retval = get_next_node(&bscan, &nid, nr_free)) != 0) {
+			unsigned long node_result;
 
 			/*
-			 * Assemble the fragmented free memory vector:
-			 * the fragmented free memory at a given order is
-			 * the sum of the occupancies at all lower orders.
-			 * Memory is never fragmented at the lowest order
-			 * and so free[0] is overloaded with the total free
-			 * memory.
+			 * A node that came online since the node table
+			 * was last built is picked up on the next cycle.
 			 */
-			total_free = free[0].free_pages = 0;
-			clock_gettime(CLOCK_MONOTONIC_RAW, &spec);
-			for (order = 0; order < MAX_ORDER; order++) {
-				unsigned long free_pages;
-
-				free_pages = nr_free[order] << order;
-				total_free += free_pages;
-				if (order < MAX_ORDER - 1) {
-					free[order + 1].free_pages =
-						free[order].free_pages +
-						free_pages;
-					free[order + 1].msecs = (long long)get_msecs(&spec);
-				}
+			if ((node = find_node(nid)) == NULL) {
+				log_info(2, "Node %d is not in node table yet", nid);
+				if (retval == EOF_RET)
+					break;
+				continue;
 			}
-			free[0].free_pages = total_free;
-			free[0].msecs = (long long)get_msecs(&spec);
 
 			/*
-			 * Offer the predictor the fragmented free memory
-			 * vector but do nothing else unless it issues a
-			 * prediction. Accumulate recommendation from
-			 * prediction algorithm across all nodes so we
-			 * adjust watermarks only once per wake up.
+			 * Get time from CLOCK_MONOTONIC_RAW which is not
+			 * subject to perturbations caused by sysadmin or ntp
+			 * adjustments. This ensures reliable calculations
+			 * for the least square fit algorithm and for the
+			 * compaction rate estimate.
 			 */
-			result |= predict(free, page_lsq[nid],
-					high_wmark[nid], low_wmark[nid], nid);
-
-			if (last_bigpages[nid] != 0) {
-				clock_gettime(CLOCK_MONOTONIC_RAW, &spec_after);
-				time_elapsed = get_msecs(&spec_after) -
-						get_msecs(&spec_before);
-				if (free[MAX_ORDER-1].free_pages >
-						last_bigpages[nid]) {
-					compaction_rate =
-						(free[MAX_ORDER-1].free_pages -
-						last_bigpages[nid]) /
-						time_elapsed;
-					if (compaction_rate)
-						log_info(5, "** compaction rate on node %d is %ld pages/msec",
-						nid, compaction_rate);
-				}
-			}
-			last_bigpages[nid] = free[MAX_ORDER-1].free_pages;
+			sample_clock(&spec);
+			build_frag_vec(nr_free, free, (long long)get_msecs(&spec));
+			estimate_compaction_rate(node, free);
+			hint_demand(nid, nr_nodes, get_msecs(&spec),
+					periodicity * 1000LL, &demand);
+			node_stall_rates(node, &rates);
 
 			/*
-			 * Start compaction if requested. There is a cost
-			 * to compaction in the kernel. Avoid issuing
-			 * compaction request twice in a row.
-			 */
-			if (result & MEMPREDICT_COMPACT) {
-				if (!compaction_requested[nid]) {
-					log_info(2, "Triggering compaction on node %d", nid);
-					if (!dry_run) {
-						compact(nid);
-						compaction_requested[nid] = 1;
-						result &= ~MEMPREDICT_COMPACT;
-					}
-				}
-			}
-			/*
-			 * Clear compaction requested flag for the next
-			 * sampling interval
+			 * Offer the predictor the fragmented free memory
+			 * vector but do nothing else unless it issues a
+			 * prediction. Keep the verdict of each node so
+			 * watermarks are adjusted only once per wake up,
+			 * from the verdicts of all nodes.
 			 */
-			compaction_requested[nid] = 0;
+			stat_start(&phase_start);
+			node_result = predict(free, &node->trends, node->high_wmark,
+					node->low_wmark, node_reclaim_rate(node),
+					node->compaction_rate, &rates,
+					&demand, nid, &horizon);
+			stat_stop(STAT_PREDICT_TIME, &phase_start);
+			result |= node_result;
+			node->verdict = node_result;
+			node->free_pages = free[0].free_pages;
+			node->reclaim_horizon = horizon.reclaim;
+			node->compact_horizon = horizon.compact;
+			node->ready = horizon.ready;
+			if (!horizon.ready)
+				nearest.ready = 0;
+			if (horizon.reclaim < nearest.reclaim)
+				nearest.reclaim = horizon.reclaim;
+			if (horizon.compact < nearest.compact)
+				nearest.compact = horizon.compact;
+
+			if ((node_result & MEMPREDICT_COMPACT) &&
+			    request_compaction(node))
+				quiet_cycles = 0;
+			if ((node_result & MEMPREDICT_RECLAIM) &&
+			    (reclaim_mode == RECLAIM_CGROUP))
+				node->reclaimed_locally = request_reclaim(node,
+							horizon.shortfall);
 			total_free_pages += free[0].free_pages;
 
 			/*
@@ -1123,36 +3600,102 @@ main(int argc, char **argv)
 			bailout(1);
 		}
 
+		/*
+		 * With fragmentation modeled per zone and migratetype,
+		 * compaction decisions come from movable free lists of
+		 * each zone instead of free pages of the whole node.
+		 */
+		stat_start(&phase_start);
+		if (pagetype_mode && update_pagetypes()) {
+			stat_stop(STAT_PAGETYPE_TIME, &phase_start);
+			sample_clock(&spec);
+			for_each_node(node) {
+				if (predict_pagetypes(node,
+					(long long)get_msecs(&spec),
+					&horizon) & MEMPREDICT_COMPACT) {
+					result |= MEMPREDICT_COMPACT;
+					node->verdict |= MEMPREDICT_COMPACT;
+					if (request_compaction(node))
+						quiet_cycles = 0;
+				}
+				if (!horizon.ready)
+					nearest.ready = 0;
+				if (horizon.compact < nearest.compact)
+					nearest.compact = horizon.compact;
+				if (horizon.compact < node->compact_horizon)
+					node->compact_horizon = horizon.compact;
+			}
+		}
+
+		if ((compaction_mode == COMPACT_PROACTIVE) && !paused)
+			update_proactiveness(&nearest,
+					result & MEMPREDICT_COMPACT);
 
 		/*
 		 * Adjust watermarks if needed. Both MEMPREDICT_RECLAIM
 		 * and MEMPREDICT_LOWER_WMARKS can be set even though it
-		 * seems contradictory. That is because result accumulates
-		 * all prediction results across all nodes. One node may
-		 * have enough free pages or has increasing number of
-		 * free pages while another node may be running low. In
-		 * such cases, MEMPREDICT_RECLAIM takes precedence
+		 * seems contradictory. One node may have enough free
+		 * pages or has increasing number of free pages while
+		 * another node may be running low. Nodes short of free
+		 * pages in cgroup mode have been taken care of already.
+		 * While actions are paused, watermarks are left as they
+		 * are.
 		 */
-		if (result & (MEMPREDICT_RECLAIM | MEMPREDICT_LOWER_WMARKS)) {
-			if (result & MEMPREDICT_RECLAIM)
-				rescale_watermarks(1);
-			else
-				rescale_watermarks(0);
+		if (paused) {
+			log_info(3, "Actions are paused");
+		}
+		else if (wsf_control == WSF_CONTROL_PI) {
+			control_watermarks();
 		}
+		else if (result & (MEMPREDICT_RECLAIM | MEMPREDICT_LOWER_WMARKS)) {
+			decide_watermarks();
+		}
+
+		sample_clock(&spec_after);
+		stat_start(&phase_start);
+		update_reclaim_rates(no_pages_reclaimed(&spec_after), &spec_after);
+		stat_stop(STAT_VMSTAT_TIME, &phase_start);
+		stat_stop(STAT_CYCLE_TIME, &cycle_start);
+		publish_metrics();
 
-		reclaimed_pages = no_pages_reclaimed();
-		if (last_reclaimed) {
-			clock_gettime(CLOCK_MONOTONIC_RAW, &spec_after);
-			time_elapsed = get_msecs(&spec_after) - get_msecs(&spec_before);
+		/*
+		 * A replay goes on to the next cycle in the trace right
+		 * away
+		 */
+		if (replay) {
+			report_cycle(get_msecs(&spec_after));
+			continue;
+		}
 
-			reclaim_rate = (reclaimed_pages - last_reclaimed) / time_elapsed;
-			if (reclaim_rate)
-				log_info(5, "** reclamation rate is %ld pages/msec", reclaim_rate);
+		if (!dry_run && (get_msecs(&spec_after) - last_checkpoint >=
+				CHECKPOINT_INTERVAL * 1000)) {
+			save_checkpoint(wsf_set);
+			last_checkpoint = get_msecs(&spec_after);
 		}
-		last_reclaimed = reclaimed_pages;
+
+		/*
+		 * When sampling is driven by memory pressure events,
+		 * there is no need to keep sampling at full rate on a
+		 * system that is not under pressure. Stretch the
+		 * interval once nothing has happened for a full lookback
+		 * window and go back to normal rate as soon as a pressure
+		 * event is seen or an action is recommended.
+		 */
+		if (result & (MEMPREDICT_RECLAIM | MEMPREDICT_COMPACT))
+			quiet_cycles = 0;
+		else if (quiet_cycles < lookback)
+			quiet_cycles++;
+		if (adaptive_sampling)
+			timeout = adapt_interval(&nearest, timeout);
+		else if (nr_psi_triggers && (quiet_cycles >= lookback))
+			timeout = periodicity * 1000 * PSI_IDLE_FACTOR;
+		else
+			timeout = periodicity * 1000;
 
 		result = 0;
-		sleep(periodicity);
+		schedule_sample(timeout);
+		if (wait_for_sample())
+			quiet_cycles = 0;
 	}
 
 	closelog();
@@ -0,0 +1,507 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#define	_GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "metrics.h"
+
+/*
+ * The exporter serves the latest snapshot in OpenMetrics text format
+ * over HTTP, on a unix socket or a TCP port. It runs in a thread of its
+ * own and never holds anything the main loop waits for. The main loop
+ * fills one of two snapshot buffers while the exporter reads the other
+ * one. A sequence count in each buffer is odd while the buffer is
+ * being written, so a read that overlapped a write, which can only
+ * happen when a scrape takes longer than a whole cycle, is retried
+ * instead of serving a torn snapshot.
+ */
+#define METRICS_TIMEOUT		2	/* sec, for a scraper to send or take data */
+#define METRICS_REQ_SIZE	1024
+#define METRICS_RETRIES		8
+#define METRICS_DEFAULT_ADDR	"127.0.0.1"
+
+struct metrics_buf {
+	unsigned long seq;
+	struct metrics_snapshot snap;
+};
+
+static struct metrics_buf *metrics_bufs;	/* Two of them */
+static int metrics_current;		/* Buffer published last */
+static int metrics_fd = -1;
+
+/* Exporter thread copy of the snapshot and the response built from it */
+static struct metrics_snapshot scrape;
+
+struct outbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static struct outbuf out;
+
+/*
+ * Return the buffer the main loop is to fill for the next snapshot, or
+ * NULL if metrics are not being exported. metrics_publish() makes it
+ * the one served.
+ */
+struct metrics_snapshot *
+metrics_begin(void)
+{
+	struct metrics_buf *b;
+
+	if (metrics_bufs == NULL)
+		return NULL;
+	b = &metrics_bufs[!metrics_current];
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return &b->snap;
+}
+
+void
+metrics_publish(void)
+{
+	int next = !metrics_current;
+	struct metrics_buf *b = &metrics_bufs[next];
+
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&metrics_current, next, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the latest snapshot for the exporter. Returns 1 on success, 0
+ * if no consistent snapshot could be had.
+ */
+static int
+read_snapshot(struct metrics_snapshot *snap)
+{
+	struct metrics_buf *b;
+	unsigned long seq;
+	int i;
+
+	for (i = 0; i < METRICS_RETRIES; i++) {
+		b = &metrics_bufs[__atomic_load_n(&metrics_current,
+						__ATOMIC_ACQUIRE)];
+		seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+		if ((seq == 0) || (seq & 1))
+			continue;
+		memcpy(snap, &b->snap, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+out_printf(const char *fmt, ...)
+{
+	va_list args;
+	char *buf;
+	int n;
+
+	while (1) {
+		va_start(args, fmt);
+		n = vsnprintf(out.buf + out.len, out.size - out.len, fmt, args);
+		va_end(args);
+		if ((n >= 0) && (out.len + n < out.size)) {
+			out.len += n;
+			return;
+		}
+		/* Leave the response truncated if it can not grow */
+		if ((n < 0) || !(buf = realloc(out.buf, out.size * 2))) {
+			log_err("Failed to format metrics");
+			return;
+		}
+		out.buf = buf;
+		out.size *= 2;
+	}
+}
+
+static void
+out_header(const char *name, const char *type, const char *help)
+{
+	out_printf("# TYPE memoptimizer_%s %s\n# HELP memoptimizer_%s %s\n",
+			name, type, name, help);
+}
+
+/* Time left in msec as seconds, or +Inf if nothing is running out */
+static void
+out_horizon(const char *name, int nid, long long msecs)
+{
+	if (msecs == HORIZON_NONE)
+		out_printf("memoptimizer_%s{node=\"%d\"} +Inf\n", name, nid);
+	else
+		out_printf("memoptimizer_%s{node=\"%d\"} %.3f\n", name, nid,
+				msecs / 1000.0);
+}
+
+#define for_each_snap_node(n, s)	\
+	for ((n) = (s)->nodes; (n) < (s)->nodes + (s)->nr_nodes; (n)++)
+
+#define OUT_NODE_GAUGE(s, name, help, fmt, field) do {			\
+	struct metrics_node *n;						\
+									\
+	out_header(name, "gauge", help);				\
+	for_each_snap_node(n, s)					\
+		out_printf("memoptimizer_" name "{node=\"%d\"} " fmt "\n", \
+				n->nid, n->field);			\
+} while (0)
+
+static void
+format_metrics(struct metrics_snapshot *s)
+{
+	struct metrics_node *n;
+	int i, order;
+
+	out.len = 0;
+	out_header("watermark_scale_factor", "gauge",
+			"Current vm.watermark_scale_factor");
+	out_printf("memoptimizer_watermark_scale_factor %d\n", s->wsf);
+	out_header("watermark_scale_factor_max", "gauge",
+			"Highest watermark_scale_factor the daemon will set");
+	out_printf("memoptimizer_watermark_scale_factor_max %d\n", s->max_wsf);
+	if (s->proactiveness >= 0) {
+		out_header("compaction_proactiveness", "gauge",
+				"Current vm.compaction_proactiveness");
+		out_printf("memoptimizer_compaction_proactiveness %d\n",
+				s->proactiveness);
+	}
+
+	out_header("reclaim_lead", "gauge",
+			"Multiple of the time to reclaim to high watermark reclaim starts at");
+	out_printf("memoptimizer_reclaim_lead %g\n", s->tunables.reclaim_lead);
+	out_header("compaction_window", "gauge",
+			"Lookback windows compaction looks ahead");
+	out_printf("memoptimizer_compaction_window %g\n",
+			s->tunables.compact_window);
+	out_header("wsf_step_percent", "gauge",
+			"Percent watermark_scale_factor is raised by");
+	out_printf("memoptimizer_wsf_step_percent %g\n", s->tunables.wsf_step);
+
+	OUT_NODE_GAUGE(s, "free_pages", "Free pages of the node", "%lu",
+			free_pages);
+	OUT_NODE_GAUGE(s, "managed_pages", "Pages managed by the buddy allocator",
+			"%lu", managed_pages);
+	OUT_NODE_GAUGE(s, "min_watermark_pages", "Min watermark of the node",
+			"%lu", min_wmark);
+	OUT_NODE_GAUGE(s, "low_watermark_pages", "Low watermark of the node",
+			"%lu", low_wmark);
+	OUT_NODE_GAUGE(s, "high_watermark_pages", "High watermark of the node",
+			"%lu", high_wmark);
+	OUT_NODE_GAUGE(s, "reclaim_rate_pages_per_second",
+			"Rate at which reclaim recovers pages on the node", "%ld",
+			reclaim_rate);
+	OUT_NODE_GAUGE(s, "compaction_rate_pages_per_second",
+			"Rate at which compaction recovers higher order pages on the node",
+			"%ld", compaction_rate);
+	OUT_NODE_GAUGE(s, "prediction_ready",
+			"Trend lines of the node have a full window of samples",
+			"%d", ready);
+
+	out_header("free_pages_slope", "gauge",
+			"Slope of the trend line of free pages of each order, pages/sec");
+	for_each_snap_node(n, s) {
+		if (!n->ready)
+			continue;
+		for (order = 0; order < MAX_ORDER; order++)
+			out_printf("memoptimizer_free_pages_slope{node=\"%d\",order=\"%d\"} %g\n",
+					n->nid, order, n->slope[order]);
+	}
+
+	out_header("reclaim_horizon_seconds", "gauge",
+			"Predicted time before free pages reach high watermark");
+	for_each_snap_node(n, s)
+		out_horizon("reclaim_horizon_seconds", n->nid,
+				n->reclaim_horizon);
+	out_header("compaction_horizon_seconds", "gauge",
+			"Predicted time before higher order pages run out");
+	for_each_snap_node(n, s)
+		out_horizon("compaction_horizon_seconds", n->nid,
+				n->compact_horizon);
+
+	out_header("verdict", "gauge",
+			"Action recommended by the latest prediction for the node");
+	for_each_snap_node(n, s) {
+		out_printf("memoptimizer_verdict{node=\"%d\",action=\"reclaim\"} %d\n",
+				n->nid, !!(n->verdict & MEMPREDICT_RECLAIM));
+		out_printf("memoptimizer_verdict{node=\"%d\",action=\"compact\"} %d\n",
+				n->nid, !!(n->verdict & MEMPREDICT_COMPACT));
+		out_printf("memoptimizer_verdict{node=\"%d\",action=\"lower_watermarks\"} %d\n",
+				n->nid, !!(n->verdict & MEMPREDICT_LOWER_WMARKS));
+	}
+
+	for (i = 0; i < NR_STAT_COUNTERS; i++) {
+		out_printf("# TYPE memoptimizer_%s counter\n",
+				stat_counter_names[i]);
+		out_printf("memoptimizer_%s_total %llu\n",
+				stat_counter_names[i], s->counters[i]);
+	}
+
+	for (i = 0; i < NR_STAT_TIMERS; i++) {
+		struct stat_hist *h = &s->timers[i];
+		const char *name = stat_timer_names[i];
+		unsigned long long cum = 0;
+		int b;
+
+		out_printf("# TYPE memoptimizer_%s_duration_seconds histogram\n",
+				name);
+		for (b = 0; b < NR_STAT_BUCKETS - 1; b++) {
+			cum += h->buckets[b];
+			out_printf("memoptimizer_%s_duration_seconds_bucket{le=\"%g\"} %llu\n",
+					name, (1ULL << b) / 1e6, cum);
+		}
+		out_printf("memoptimizer_%s_duration_seconds_bucket{le=\"+Inf\"} %llu\n",
+				name, h->count);
+		out_printf("memoptimizer_%s_duration_seconds_sum %g\n", name,
+				h->sum / 1e6);
+		out_printf("memoptimizer_%s_duration_seconds_count %llu\n",
+				name, h->count);
+	}
+	out_printf("# EOF\n");
+}
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd, buf, len, MSG_NOSIGNAL)) <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static void
+send_response(int fd, const char *status, const char *type)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+			status, type, out.len);
+	if (send_all(fd, hdr, n))
+		send_all(fd, out.buf, out.len);
+}
+
+/*
+ * Answer one scrape. Any GET is answered with the metrics, whatever
+ * the path. A scraper that is slow to send its request or take the
+ * response is dropped after METRICS_TIMEOUT seconds.
+ */
+static void
+serve(int fd)
+{
+	struct timeval tv = { .tv_sec = METRICS_TIMEOUT };
+	char req[METRICS_REQ_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(req) - 1) {
+		if ((n = read(fd, req + len, sizeof(req) - 1 - len)) <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			break;
+		}
+		len += n;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if ((len < 4) || (memcmp(req, "GET ", 4) != 0)) {
+		out.len = 0;
+		out_printf("Only GET is supported\n");
+		send_response(fd, "405 Method Not Allowed", "text/plain");
+		return;
+	}
+	if (!read_snapshot(&scrape)) {
+		out.len = 0;
+		out_printf("No metrics available yet\n");
+		send_response(fd, "503 Service Unavailable", "text/plain");
+		return;
+	}
+	format_metrics(&scrape);
+	send_response(fd, "200 OK",
+		"application/openmetrics-text; version=1.0.0; charset=utf-8");
+}
+
+static void *
+metrics_thread(void *arg)
+{
+	int fd;
+
+	while (1) {
+		if ((fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+			if ((errno != EINTR) && (errno != ECONNABORTED))
+				log_err("Failed to accept metrics connection (%s)", strerror(errno));
+			continue;
+		}
+		serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Listen on a unix socket if listen is a path, else on a TCP port
+ * given as "port" or "address:port". A port alone listens on
+ * METRICS_DEFAULT_ADDR only. Returns the socket or -1 on error.
+ */
+static int
+open_listener(const char *listen_on)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t salen;
+	char addr[INET_ADDRSTRLEN];
+	const char *port;
+	int fd, one = 1;
+
+	if (listen_on[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(listen_on) >= sizeof(sun.sun_path)) {
+			log_err("Metrics socket path %s is too long", listen_on);
+			return -1;
+		}
+		strcpy(sun.sun_path, listen_on);
+		unlink(listen_on);
+		sa = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	}
+	else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		if ((port = strrchr(listen_on, ':')) != NULL) {
+			if (port - listen_on >= sizeof(addr))
+				goto bad_addr;
+			memcpy(addr, listen_on, port - listen_on);
+			addr[port - listen_on] = 0;
+			port++;
+		}
+		else {
+			strcpy(addr, METRICS_DEFAULT_ADDR);
+			port = listen_on;
+		}
+		if ((inet_pton(AF_INET, addr, &sin.sin_addr) != 1) ||
+		    (atoi(port) <= 0) || (atoi(port) > 65535))
+			goto bad_addr;
+		sin.sin_port = htons(atoi(port));
+		sa = (struct sockaddr *)&sin;
+		salen = sizeof(sin);
+	}
+
+	if ((fd = socket(sa->sa_family, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) {
+		log_err("Failed to create metrics socket (%s)", strerror(errno));
+		return -1;
+	}
+	if (sa->sa_family == AF_INET)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if ((bind(fd, sa, salen) == -1) || (listen(fd, 8) == -1)) {
+		log_err("Failed to listen on %s for metrics (%s)", listen_on, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+
+bad_addr:
+	log_err("Metrics listen address \"%s\" is not a path, port or IPv4 address:port", listen_on);
+	return -1;
+}
+
+/*
+ * Start serving metrics on listen_on. The exporter thread gets a stack
+ * of stack_size, or the default size if 0, and signals are left to the
+ * main thread.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+start_metrics(const char *listen_on, size_t stack_size)
+{
+	pthread_attr_t attr;
+	sigset_t set, oldset;
+	pthread_t tid;
+	int err;
+
+	out.size = 65536;
+	if (((metrics_bufs = calloc(2, sizeof(struct metrics_buf))) == NULL) ||
+	    ((out.buf = malloc(out.size)) == NULL)) {
+		log_err("Failed to allocate metrics buffers");
+		goto err;
+	}
+	if ((metrics_fd = open_listener(listen_on)) == -1)
+		goto err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (stack_size)
+		pthread_attr_setstacksize(&attr, stack_size);
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	err = pthread_create(&tid, &attr, metrics_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		log_err("Failed to start metrics thread (%s)", strerror(err));
+		close(metrics_fd);
+		metrics_fd = -1;
+		goto err;
+	}
+	log_info(1, "Serving metrics on %s", listen_on);
+	return 1;
+
+err:
+	free(metrics_bufs);
+	free(out.buf);
+	metrics_bufs = NULL;
+	out.buf = NULL;
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef METRICS_H
+#define	METRICS_H
+
+#include "predict.h"
+#include "stats.h"
+#include "tune.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Most nodes a snapshot has room for. Nodes past this are left out of
+ * the metrics.
+ */
+#define METRICS_MAX_NODES	256
+
+struct metrics_node {
+	int nid;
+	int ready;			/* Trend lines have a full window */
+	unsigned long verdict;		/* MEMPREDICT_* bits */
+	unsigned long free_pages;
+	unsigned long managed_pages;
+	unsigned long min_wmark;
+	unsigned long low_wmark;
+	unsigned long high_wmark;
+	long long reclaim_horizon;	/* msec, HORIZON_NONE if none */
+	long long compact_horizon;
+	long reclaim_rate;		/* Pages/sec */
+	long compaction_rate;		/* Pages/sec */
+	double slope[MAX_ORDER];	/* Free pages of each order, pages/sec */
+};
+
+/*
+ * State of the daemon as of the end of a cycle, published by the main
+ * loop for the exporter thread to serve
+ */
+struct metrics_snapshot {
+	int wsf;
+	int max_wsf;
+	int proactiveness;		/* -1 if not managed */
+	struct tunables tunables;
+	int nr_nodes;
+	struct metrics_node nodes[METRICS_MAX_NODES];
+	unsigned long long counters[NR_STAT_COUNTERS];
+	struct stat_hist timers[NR_STAT_TIMERS];
+};
+
+extern int start_metrics(const char *, size_t);
+extern struct metrics_snapshot *metrics_begin(void);
+extern void metrics_publish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
@@ -0,0 +1,352 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+#include "node.h"
+
+#define NODE_ONLINE	"/sys/devices/system/node/online"
+#define NODE_VMSTAT	"/sys/devices/system/node/node%d/vmstat"
+#define NODE_HUGEPAGES	"/sys/devices/system/node/node%d/hugepages"
+
+struct node_state *nodes;
+int nr_nodes;
+
+/*
+ * Map from node id to index in nodes[]. Node ids can be sparse, so
+ * this is sized to the highest online node id and unused entries
+ * are -1.
+ */
+static int *node_map;
+static int nr_node_ids;
+
+static struct procfs_file node_online;
+
+/*
+ * Find the hugepage sizes the node has a pool for and open the
+ * nr_hugepages file for each one. Sizes can only change with the set
+ * of online nodes, so this is done once per node.
+ */
+static void
+open_node_hugepages(struct node_state *n)
+{
+	char dir[64], path[PATH_MAX];
+	DIR *dp;
+	struct dirent *ep;
+
+	snprintf(dir, sizeof(dir), NODE_HUGEPAGES, n->nid);
+	if ((dp = opendir(dir)) == NULL)
+		return;
+
+	while ((ep = readdir(dp)) != NULL) {
+		struct hugepage_size *hs;
+		unsigned long psize;
+
+		if (ep->d_type != DT_DIR)
+			continue;
+		/* Check if it is one of the hugepages dir */
+		if (sscanf(ep->d_name, "hugepages-%lukB", &psize) != 1)
+			continue;
+		if (n->nr_hsizes == MAX_HUGEPAGE_SIZES) {
+			log_warn("Ignoring hugepage size %lukB on node %d", psize, n->nid);
+			continue;
+		}
+
+		hs = &n->hsizes[n->nr_hsizes];
+		snprintf(path, sizeof(path), "%s/%s/nr_hugepages", dir,
+				ep->d_name);
+		if ((hs->path = strdup(path)) == NULL)
+			continue;
+		if (!procfs_open(&hs->file, hs->path)) {
+			free(hs->path);
+			continue;
+		}
+		hs->psize = psize;
+		n->nr_hsizes++;
+	}
+	closedir(dp);
+}
+
+/*
+ * Set up state for a node that has just come online
+ */
+static void
+init_node(struct node_state *n, int nid)
+{
+	int i;
+
+	n->nid = nid;
+	trend_alloc(&n->trends, 1);
+	if (pagetype_mode &&
+	    (n->zones = calloc(MAX_NR_ZONES, sizeof(struct zone_frag))))
+		for (i = 0; i < MAX_NR_ZONES; i++)
+			trend_alloc(n->zones[i].trends, NR_MIGRATETYPES);
+
+	snprintf(n->vmstat_path, sizeof(n->vmstat_path), NODE_VMSTAT, nid);
+	if (!procfs_open(&n->vmstat, n->vmstat_path)) {
+		log_warn("Failed to open %s (%s)", n->vmstat_path, strerror(errno));
+		n->vmstat.fd = -1;
+	}
+	open_node_hugepages(n);
+}
+
+/*
+ * Release state kept for a node that is no longer online
+ */
+static void
+release_node(struct node_state *n)
+{
+	int i;
+
+	trend_free(&n->trends);
+	if (n->zones)
+		for (i = 0; i < MAX_NR_ZONES; i++)
+			trend_free(n->zones[i].trends);
+	free(n->zones);
+	if (n->vmstat.fd >= 0)
+		procfs_close(&n->vmstat);
+	for (i = 0; i < n->nr_hsizes; i++) {
+		procfs_close(&n->hsizes[i].file);
+		free(n->hsizes[i].path);
+	}
+}
+
+/*
+ * Compare list of online nodes with the node table. Returns 1 if they
+ * match, 0 otherwise.
+ */
+static int
+nodes_match(void)
+{
+	struct scan s;
+	unsigned long first, last;
+	int i = 0;
+
+	scan_init(&s, &node_online);
+	while (scan_range(&s, &first, &last)) {
+		for (; first <= last; first++, i++)
+			if ((i >= nr_nodes) || (nodes[i].nid != first))
+				return 0;
+	}
+
+	return (i == nr_nodes);
+}
+
+/*
+ * Rebuild the node table from the list of online nodes. State for
+ * nodes that were online before is carried over so their trend lines
+ * are not lost.
+ */
+static int
+rebuild_nodes(void)
+{
+	struct node_state *new_nodes, *n;
+	struct scan s;
+	unsigned long first, last;
+	int *new_map, count = 0, max_nid = -1, i;
+
+	scan_init(&s, &node_online);
+	while (scan_range(&s, &first, &last)) {
+		count += last - first + 1;
+		max_nid = last;
+	}
+	if (count == 0) {
+		log_err("No online nodes found in "NODE_ONLINE);
+		return 0;
+	}
+
+	new_nodes = calloc(count, sizeof(struct node_state));
+	new_map = malloc((max_nid + 1) * sizeof(int));
+	if ((new_nodes == NULL) || (new_map == NULL)) {
+		log_err("Failed to allocate node table (%s)", strerror(errno));
+		free(new_nodes);
+		free(new_map);
+		return 0;
+	}
+	for (i = 0; i <= max_nid; i++)
+		new_map[i] = -1;
+
+	i = 0;
+	scan_init(&s, &node_online);
+	while (scan_range(&s, &first, &last)) {
+		for (; first <= last; first++, i++) {
+			if ((n = find_node(first)) != NULL) {
+				new_nodes[i] = *n;
+				new_nodes[i].vmstat.path = new_nodes[i].vmstat_path;
+			}
+			else {
+				init_node(&new_nodes[i], first);
+			}
+			new_map[first] = i;
+		}
+	}
+
+	/*
+	 * Release state kept for nodes that are no longer online
+	 */
+	for_each_node(n)
+		if ((n->nid > max_nid) || (new_map[n->nid] < 0))
+			release_node(n);
+
+	free(nodes);
+	free(node_map);
+	nodes = new_nodes;
+	node_map = new_map;
+	nr_nodes = count;
+	nr_node_ids = max_nid + 1;
+
+	return 1;
+}
+
+/*
+ * Discover online nodes and build the node table
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+open_nodes(void)
+{
+	if (!procfs_open(&node_online, NODE_ONLINE)) {
+		log_err("Failed to open "NODE_ONLINE" (%s)", strerror(errno));
+		return 0;
+	}
+
+	return rebuild_nodes();
+}
+
+/*
+ * Check if the set of online nodes has changed and rebuild the node
+ * table if it has.
+ *
+ * Returns:
+ *	1	Node table changed
+ *	0	No change
+ */
+int
+update_nodes(void)
+{
+	if (!procfs_read(&node_online) || nodes_match())
+		return 0;
+
+	if (!rebuild_nodes())
+		return 0;
+	log_info(1, "Online nodes changed, now tracking %d node(s)", nr_nodes);
+
+	return 1;
+}
+
+struct node_state *
+find_node(int nid)
+{
+	if ((nid < 0) || (nid >= nr_node_ids) || (node_map[nid] < 0))
+		return NULL;
+
+	return &nodes[node_map[nid]];
+}
+
+/*
+ * Read counters of interest from the node's vmstat file. Kernels that
+ * keep reclaim counters per node report pgsteal_kswapd here. On other
+ * kernels, only the size of LRU lists and dirty pages is available.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+update_node_vmstat(struct node_state *n)
+{
+	struct scan s;
+
+	if ((n->vmstat.fd < 0) || !procfs_read(&n->vmstat))
+		return 0;
+
+	n->has_pgsteal = 0;
+	n->pgsteal_kswapd = 0;
+	n->inactive_file = n->inactive_anon = 0;
+	n->file_dirty = n->file_writeback = 0;
+	scan_init(&s, &n->vmstat);
+	while (!scan_eof(&s)) {
+		const char *w;
+		size_t len;
+		unsigned long val;
+
+		if (scan_word(&s, &w, &len) && scan_ulong(&s, &val)) {
+			if (scan_is(w, len, "pgsteal_kswapd")) {
+				n->pgsteal_kswapd += val;
+				n->has_pgsteal = 1;
+			}
+			else if (scan_is(w, len, "nr_inactive_file"))
+				n->inactive_file = val;
+			else if (scan_is(w, len, "nr_inactive_anon"))
+				n->inactive_anon = val;
+			else if (scan_is(w, len, "nr_dirty"))
+				n->file_dirty = val;
+			else if (scan_is(w, len, "nr_writeback"))
+				n->file_writeback = val;
+		}
+		scan_next_line(&s);
+	}
+	n->inactive_pages = n->inactive_file + n->inactive_anon;
+
+	return 1;
+}
+
+/*
+ * Update the number of base pages tied up in hugepages on the node.
+ * A size whose file can not be read is left out of the count.
+ *
+ * Returns:
+ *	1	Number of hugepages changed
+ *	0	No change
+ */
+int
+update_node_hugepages(struct node_state *n)
+{
+	unsigned long hugepages = 0, pages;
+	unsigned long base_kb = getpagesize() / 1024;
+	int i;
+
+	for (i = 0; i < n->nr_hsizes; i++) {
+		struct hugepage_size *hs = &n->hsizes[i];
+		struct scan s;
+
+		if (!procfs_read(&hs->file))
+			continue;
+		scan_init(&s, &hs->file);
+		if (scan_ulong(&s, &pages))
+			hugepages += pages * hs->psize / base_kb;
+	}
+	if (hugepages == n->hugepages)
+		return 0;
+
+	n->hugepages = hugepages;
+	return 1;
+}
@@ -0,0 +1,144 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef NODE_H
+#define	NODE_H
+
+#include "predict.h"
+#include "procfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Zones and migratetypes tracked separately when fragmentation is
+ * modeled from /proc/pagetypeinfo. Only free lists of movable
+ * pageblocks can be recovered by compaction, the others are tracked
+ * to tell when compaction would not help.
+ */
+#define MAX_NR_ZONES	5
+#define ZONE_NAME_LEN	16
+
+enum migratetype {
+	MT_UNMOVABLE,
+	MT_MOVABLE,
+	MT_RECLAIMABLE,
+	NR_MIGRATETYPES
+};
+
+struct zone_frag {
+	char name[ZONE_NAME_LEN];
+	int seen;			/* Present in latest sample */
+	unsigned long nr_free[NR_MIGRATETYPES][MAX_ORDER];
+	struct trend_set trends[NR_MIGRATETYPES];
+};
+
+/*
+ * nr_hugepages file of a node for one hugepage size, kept open so it
+ * can be sampled every cycle
+ */
+#define MAX_HUGEPAGE_SIZES	8
+
+struct hugepage_size {
+	char *path;
+	struct procfs_file file;
+	unsigned long psize;		/* Size of hugepage in kB */
+};
+
+/*
+ * Per node state. One entry is kept for each online node, in a dense
+ * array ordered by node id.
+ */
+struct node_state {
+	int nid;
+	unsigned long min_wmark;
+	unsigned long low_wmark;
+	unsigned long high_wmark;
+	unsigned long managed_pages;
+	unsigned long hugepages;	/* Base pages tied up in hugepages */
+	struct hugepage_size hsizes[MAX_HUGEPAGE_SIZES];
+	int nr_hsizes;
+	int compaction_requested;	/* Compaction queued or in progress */
+	struct trend_set trends;
+	struct zone_frag *zones;	/* MAX_NR_ZONES entries, pagetype mode only */
+
+	/* Verdict of the latest prediction for the node */
+	unsigned long verdict;		/* MEMPREDICT_* bits */
+	unsigned long free_pages;
+	long long reclaim_horizon;	/* msec left before high watermark */
+	long long compact_horizon;	/* msec left before compaction is due */
+	int ready;			/* Trend lines have a full window */
+	int reclaimed_locally;		/* Reclaim requested for this node only */
+
+	/* Per node vmstat and the reclaim rate derived from it */
+	char vmstat_path[48];
+	struct procfs_file vmstat;
+	int has_pgsteal;
+	unsigned long pgsteal_kswapd;
+	unsigned long inactive_pages;	/* Sum of the inactive LRU lists */
+	unsigned long inactive_file;
+	unsigned long inactive_anon;
+	unsigned long file_dirty;
+	unsigned long file_writeback;
+	unsigned long last_stolen;	/* Pages reclaimed as of last sample */
+	long long last_reclaim_msecs;
+	long reclaim_avg;		/* Smoothed reclaim rate, pages/sec */
+
+	/* Rate of reclaim through memory.reclaim, measured when we reclaim */
+	int cgroup_reclaim_measured;
+	long cgroup_reclaim_avg;	/* Pages/sec */
+
+	/*
+	 * Compaction rate, measured when we compact the node and estimated
+	 * from growth of higher order pages until then
+	 */
+	int compaction_measured;
+	long compaction_rate;		/* Pages/sec */
+	unsigned long last_bigpages;	/* Higher order pages seen in last scan */
+	long long last_bigpages_msecs;
+
+	/* Compaction budget, msec of compaction the node can still use */
+	double compact_tokens;
+	long long budget_msecs;		/* When budget was last updated */
+
+	/* Msec per sec threads spent stalled on the node, traced with eBPF */
+	double reclaim_stall_time;
+	double compact_stall_time;
+};
+
+extern struct node_state *nodes;
+extern int nr_nodes;
+
+#define for_each_node(n)	for ((n) = nodes; (n) < nodes + nr_nodes; (n)++)
+
+extern int open_nodes(void);
+extern int update_nodes(void);
+extern struct node_state *find_node(int);
+extern int update_node_vmstat(struct node_state *);
+extern int update_node_hugepages(struct node_state *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NODE_H */
@@ -20,94 +20,731 @@
  *  * or visit www.oracle.com if you need additional information or have any
  *  * questions.
  *  */
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <time.h>
 #include "predict.h"
+#include "trace.h"
+#include "tune.h"
 
 /*
- * This function inserts the given value into the list of most recently seen
- * data and returns the parameters, m and c, of a straight line of the form
- * y = mx + c that, according to the the method of least squares, fits them
- * best.  The formulation is for the special case in which x_i = i + 1 - N;
- * this reduces the need for storage and permits constant time updates.
+ * Model used to fit trend lines and the smoothing factors (percent)
+ * used by the exponentially weighted models
+ */
+int trend_model = TREND_LSQ;
+int trend_alpha = 40;
+int trend_beta = 30;
+
+/*
+ * Confidence level (percent) the trend must hold at before action is
+ * recommended. 0 acts on the fitted trend line alone.
+ */
+int confidence;
+
+/*
+ * Vector the running sums of least squares are updated in, one order
+ * per element. Without vector extensions it is a single double and the
+ * same code updates one order at a time. On x86-64 the kernels are also
+ * built for AVX2 and the version the CPU supports is picked when the
+ * program is loaded, elsewhere the compiler uses the vector unit the
+ * target always has (e.g. NEON on aarch64) or plain scalar code.
+ */
+#ifdef __GNUC__
+typedef double lsq_vec __attribute__((vector_size(32)));
+#else
+typedef double lsq_vec;
+#endif
+#define LSQ_VEC_WIDTH	(sizeof(lsq_vec) / sizeof(double))
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LSQ_KERNEL	__attribute__((target_clones("avx2", "default")))
+#else
+#define LSQ_KERNEL
+#endif
+
+/* Sum arrays are not aligned to the vector size, access them unaligned */
+#define vec_load(v, p)		memcpy(&(v), (p), sizeof(lsq_vec))
+#define vec_store(p, v)		memcpy((p), &(v), sizeof(lsq_vec))
+
+/*
+ * Allocate sample windows of lookback samples for count sets of trend
+ * lines in one block. Returns 1 on success, 0 on failure.
+ */
+int
+trend_alloc(struct trend_set *ts, int count)
+{
+	size_t size = (size_t)lookback * (LSQ_LINES + 1);
+	double *samples;
+	int i, order;
+
+	samples = calloc(count * size, sizeof(double));
+	if (samples == NULL) {
+		log_err("Failed to allocate trend line samples");
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		memset(&ts[i], 0, sizeof(ts[i]));
+		ts[i].lookback = lookback;
+		ts[i].x = samples + i * size;
+		ts[i].y = ts[i].x + lookback;
+		for (order = 0; order < MAX_ORDER; order++)
+			ts[i].lines[order].lookback = lookback;
+	}
+	return 1;
+}
+
+/*
+ * Free sample windows allocated by trend_alloc()
+ */
+void
+trend_free(struct trend_set *ts)
+{
+	free(ts->x);
+	ts->x = ts->y = NULL;
+}
+
+/*
+ * Add the row of samples y taken at time x to the running means and
+ * sums of squared deviations of a set of trend lines (Welford's
+ * method), or remove it if sign is -1. count must already include the
+ * row when adding and exclude it when removing.
+ */
+static LSQ_KERNEL void
+lsq_update(struct trend_set *ts, double x, const double *y, double sign)
+{
+	double dx = x - ts->mean_x, inv = sign / ts->count, sdx;
+	int i;
+
+	ts->mean_x += dx * inv;
+	ts->sxx += sign * dx * (x - ts->mean_x);
+	sdx = sign * dx;
+	for (i = 0; i < LSQ_LINES; i += LSQ_VEC_WIDTH) {
+		lsq_vec vy, mean, dy, sxy, syy;
+
+		vec_load(vy, &y[i]);
+		vec_load(mean, &ts->mean_y[i]);
+		vec_load(sxy, &ts->sxy[i]);
+		vec_load(syy, &ts->syy[i]);
+		dy = vy - mean;
+		mean += dy * inv;
+		sxy += sdx * (vy - mean);
+		syy += sign * dy * (vy - mean);
+		vec_store(&ts->mean_y[i], mean);
+		vec_store(&ts->sxy[i], sxy);
+		vec_store(&ts->syy[i], syy);
+	}
+}
+
+/*
+ * Recompute means and sums of squared deviations from the samples in
+ * the window. Removing samples from the running sums leaves a little
+ * rounding error behind every time, so they are recomputed each time
+ * the window wraps around. That is once every lookback samples and
+ * keeps the cost per sample constant.
+ */
+static LSQ_KERNEL void
+lsq_resum(struct trend_set *ts)
+{
+	double sum_x = 0, dx;
+	int i, j;
+
+	for (j = 0; j < ts->count; j++)
+		sum_x += ts->x[j];
+	ts->mean_x = sum_x / ts->count;
+	ts->sxx = 0;
+	for (j = 0; j < ts->count; j++) {
+		dx = ts->x[j] - ts->mean_x;
+		ts->sxx += dx * dx;
+	}
+
+	for (i = 0; i < LSQ_LINES; i += LSQ_VEC_WIDTH) {
+		lsq_vec sum = {0}, sxy = {0}, syy = {0}, mean, y, dy;
+
+		for (j = 0; j < ts->count; j++) {
+			vec_load(y, &ts->y[j * LSQ_LINES + i]);
+			sum += y;
+		}
+		mean = sum / ts->count;
+		for (j = 0; j < ts->count; j++) {
+			vec_load(y, &ts->y[j * LSQ_LINES + i]);
+			dy = y - mean;
+			sxy += (ts->x[j] - ts->mean_x) * dy;
+			syy += dy * dy;
+		}
+		vec_store(&ts->mean_y[i], mean);
+		vec_store(&ts->sxy[i], sxy);
+		vec_store(&ts->syy[i], syy);
+	}
+}
+
+/*
+ * Compute variance of residuals around a least squares line of slope m
+ * and standard error of the slope from the sums of squared deviations
+ * over n samples. Fewer than 3 samples leave no degrees of freedom to
+ * estimate the error with.
+ */
+static void
+fit_errors(struct lsq_struct *lsq, double n, double m, double sxx,
+	double sxy, double syy)
+{
+	double rss;
+
+	lsq->dof = n - 2;
+	if (lsq->dof <= 0) {
+		lsq->resid_var = lsq->slope_err = INFINITY;
+		return;
+	}
+
+	rss = syy - m * sxy;
+	if (rss < 0)
+		rss = 0;
+	lsq->resid_var = rss / lsq->dof;
+	lsq->slope_err = sqrt(lsq->resid_var / sxx);
+}
+
+/*
+ * This function inserts the given free memory vector into the window
+ * of most recently seen data and returns the parameters, m and c, of
+ * straight lines of the form y = mx + c that, according to the the
+ * method of least squares, fit the samples of each order best. Slope is
+ * in pages/msec and c is the value of the line at the time of the
+ * newest sample, so x is measured in msec from the newest sample.
+ *
+ * Running means of x and y and sums of squared deviations from these
+ * means are updated as samples enter and leave the window (Welford's
+ * method), so the cost of a fit does not depend on size of the window.
+ * Since only deviations from the means are ever squared, the sums stay
+ * small and accurate even though x is time since boot in msec. All
+ * orders share x, so its mean and sum are computed once per sample.
+ *
+ * Variance of residuals around each line and standard error of its
+ * slope are left in ts->lines. Returns 1 once the window is full, 0
+ * until then.
  */
 static int
-lsq_fit(struct lsq_struct *lsq, long long new_y, long long new_x,
-	long long *m, long long *c)
+lsq_fit(struct trend_set *ts, struct frag_info *frag_vec, double *m,
+	double *c)
 {
-	long long sigma_x, sigma_y;
-	long sigma_xy, sigma_xx;
-	long long slope_divisor;
-	int i, next;
-	long x_offset;
-
-	next = lsq->next++;
-	lsq->x[next] = new_x;
-	lsq->y[next] = new_y;
-
-	if (lsq->next == LSQ_LOOKBACK) {
-		lsq->next = 0;
-		/*
-		 * Lookback window is fill which means a reasonable
-		 * best fit line can be computed. Flag enough data
-		 * is available in lookback window now.
-		 */
-		lsq->ready = 1;
+	double *row;
+	int order;
+
+	if (ts->x == NULL)
+		return 0;
+
+	/*
+	 * Oldest samples leave the window once it is full
+	 */
+	row = &ts->y[ts->next * LSQ_LINES];
+	if (ts->count == ts->lookback) {
+		ts->count--;
+		lsq_update(ts, ts->x[ts->next], row, -1.0);
+	}
+
+	ts->x[ts->next] = frag_vec[0].msecs;
+	for (order = 0; order < MAX_ORDER; order++)
+		row[order] = frag_vec[order].free_pages;
+	ts->last_x = frag_vec[0].msecs;
+	ts->count++;
+	lsq_update(ts, ts->last_x, row, 1.0);
+
+	if (++ts->next == ts->lookback) {
+		ts->next = 0;
+		lsq_resum(ts);
 	}
 
 	/*
 	 * If lookback window is not full, do not continue with
-	 * computing slope and intercept of best fit line.
+	 * computing slope and intercept of best fit lines. Also
+	 * guard against divide-by-zero.
 	 */
-	if (!lsq->ready)
+	if ((ts->count < ts->lookback) || (ts->sxx <= 0))
+		return 0;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		m[order] = ts->sxy[order] / ts->sxx;
+		c[order] = ts->mean_y[order] +
+				m[order] * (ts->last_x - ts->mean_x);
+		fit_errors(&ts->lines[order], ts->count, m[order], ts->sxx,
+				ts->sxy[order], ts->syy[order]);
+	}
+
+	return 1;
+}
+
+/*
+ * Least squares fit in which the weight of a sample decays by a factor
+ * of (1 - alpha) with every newer sample, so recent samples count more
+ * than older ones and a change in trend shows up quickly. Weighted
+ * means and sums of squared deviations are updated in place and no
+ * window of samples is needed. The fit is considered ready once a
+ * window worth of samples has been seen.
+ *
+ * Errors are estimated as for an unweighted fit over the effective
+ * number of samples, (sum of weights)^2 / sum of squared weights, with
+ * the weighted sums scaled to that many samples.
+ */
+static int
+ewlsq_fit(struct lsq_struct *lsq, long long new_y, long long new_x,
+	double *m, double *c)
+{
+	double x = new_x, y = new_y, dx, dy, n_eff, scale;
+	double decay = 1.0 - trend_alpha / 100.0;
+
+	lsq->weight = lsq->weight * decay + 1.0;
+	lsq->weight2 = lsq->weight2 * decay * decay + 1.0;
+	dx = x - lsq->mean_x;
+	dy = y - lsq->mean_y;
+	lsq->mean_x += dx / lsq->weight;
+	lsq->mean_y += dy / lsq->weight;
+	lsq->sxx = lsq->sxx * decay + dx * (x - lsq->mean_x);
+	lsq->sxy = lsq->sxy * decay + dx * (y - lsq->mean_y);
+	lsq->syy = lsq->syy * decay + dy * (y - lsq->mean_y);
+	lsq->last_x = x;
+
+	if (lsq->count < lsq->lookback)
+		lsq->count++;
+	if ((lsq->count < lsq->lookback) || (lsq->sxx <= 0))
 		return -1;
 
-	/*
-	 * If lookback window is full, compute slope and intercept
-	 * for the best fit line. In the process of computing those, we need
-	 * to compute squares of values along x-axis. Sqaure values can be
-	 * large enough to overflow 64-bits if they are large enough to
-	 * begin with. To solve this problem, transform the line on
-	 * x-axis so the first point falls at x=0. Since lsq->x is a
-	 * circular buffer, lsq->next points to the oldest entry in this
-	 * buffer.
-	 */
+	*m = lsq->sxy / lsq->sxx;
+	*c = lsq->mean_y + *m * (lsq->last_x - lsq->mean_x);
 
-	x_offset = lsq->x[lsq->next];
-	for (i = 0; i < LSQ_LOOKBACK; i++)
-		lsq->x[i] -= x_offset;
+	n_eff = lsq->weight * lsq->weight / lsq->weight2;
+	scale = n_eff / lsq->weight;
+	fit_errors(lsq, n_eff, *m, lsq->sxx * scale, lsq->sxy * scale,
+			lsq->syy * scale);
 
-	/*
-	 * Lookback window is full. Compute slope and intercept
-	 * for the best fit line
-	 */
-	sigma_x = sigma_y = sigma_xy = sigma_xx = 0;
-	for (i = 0; i < LSQ_LOOKBACK; i++) {
-		sigma_x += lsq->x[i];
-		sigma_y += lsq->y[i];
-		sigma_xy += (lsq->x[i] * lsq->y[i]);
-		sigma_xx += (lsq->x[i] * lsq->x[i]);
+	return 0;
+}
+
+/*
+ * Holt's linear trend method. A level and slope are smoothed
+ * separately, level with factor alpha and slope with factor beta.
+ * Samples are not evenly spaced in time when sampling interval
+ * adapts, so slope is kept per msec and the level is projected
+ * forward by the time elapsed since last sample. The line is
+ * level + slope * x with x measured from the newest sample.
+ *
+ * Residual variance is the exponentially smoothed square of the error
+ * in forecasting each sample from the previous one. Error of the slope
+ * comes from the smoothed variance of the change in level between
+ * samples, reduced by smoothing with beta.
+ */
+static int
+holt_fit(struct lsq_struct *lsq, long long new_y, long long new_x,
+	double *m, double *c)
+{
+	double x = new_x, y = new_y, dt, prev_level, err, d;
+	double alpha = trend_alpha / 100.0, beta = trend_beta / 100.0;
+
+	if (lsq->count == 0) {
+		lsq->level = y;
+		lsq->trend = 0;
+		lsq->last_x = x;
+		lsq->count++;
+		return -1;
+	}
+
+	dt = x - lsq->last_x;
+	if (dt <= 0)
+		return -1;
+
+	prev_level = lsq->level;
+	err = y - (lsq->level + lsq->trend * dt);
+	lsq->level = alpha * y + (1.0 - alpha) *
+			(lsq->level + lsq->trend * dt);
+	d = (lsq->level - prev_level) / dt;
+	if (lsq->count == 1) {
+		lsq->trend = (y - prev_level) / dt;
+	}
+	else {
+		lsq->resid_var = (1.0 - alpha) *
+				(lsq->resid_var + alpha * err * err);
+		lsq->trend_var = (1.0 - beta) * (lsq->trend_var + beta *
+				(d - lsq->trend) * (d - lsq->trend));
+		lsq->trend = beta * d + (1.0 - beta) * lsq->trend;
+	}
+	lsq->last_x = x;
+
+	if (lsq->count < lsq->lookback)
+		lsq->count++;
+	if (lsq->count < lsq->lookback)
+		return -1;
+
+	*m = lsq->trend;
+	*c = lsq->level;
+	lsq->dof = lsq->lookback - 2;
+	lsq->slope_err = sqrt(lsq->trend_var * beta / (2.0 - beta));
+
+	return 0;
+}
+
+/*
+ * Trend models available. Every model returns the slope of the trend
+ * line in pages/msec and its value at the time of the newest sample,
+ * so exhaustion can be computed the same way for all of them. Models
+ * either fit one line at a time (fit) or all orders of a free memory
+ * vector at once (fit_set).
+ */
+static const struct trend_model_ops {
+	const char *name;
+	int (*fit)(struct lsq_struct *, long long, long long, double *,
+			double *);
+	int (*fit_set)(struct trend_set *, struct frag_info *, double *,
+			double *);
+} trend_models[NR_TREND_MODELS] = {
+	[TREND_LSQ] =	{ "lsq", NULL, lsq_fit },
+	[TREND_EWLSQ] =	{ "ewlsq", ewlsq_fit, NULL },
+	[TREND_HOLT] =	{ "holt", holt_fit, NULL },
+};
+
+/*
+ * Look up a trend model by name. Returns the model or -1 if no model
+ * by that name exists.
+ */
+int
+find_trend_model(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_TREND_MODELS; i++)
+		if (strcasecmp(name, trend_models[i].name) == 0)
+			return i;
+	return -1;
+}
+
+const char *
+trend_model_name(int model)
+{
+	return trend_models[model].name;
+}
+
+/*
+ * One sided quantile of Student's t distribution with dof degrees of
+ * freedom at probability p (0.5 <= p < 1). The normal quantile comes
+ * from the rational approximation in Abramowitz and Stegun 26.2.23 and
+ * is corrected for degrees of freedom with the first terms of the
+ * Cornish-Fisher expansion, which is close enough for deciding when a
+ * trend can be trusted.
+ */
+static double
+t_quantile(double p, double dof)
+{
+	double t, z, z2;
+
+	t = sqrt(-2.0 * log(1.0 - p));
+	z = t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+		(1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+	z2 = z * z;
+
+	return z + z * (z2 + 1.0) / (4.0 * dof) +
+		z * (5.0 * z2 * z2 + 16.0 * z2 + 3.0) / (96.0 * dof * dof);
+}
+
+/*
+ * Half width of the one sided confidence interval at the configured
+ * confidence level for the slope of trend line a or, if b is given,
+ * for the difference between slopes of a and b. Returns 0 if no
+ * confidence level is set.
+ */
+static double
+slope_band(struct lsq_struct *a, struct lsq_struct *b)
+{
+	double err2, dof;
+
+	if (confidence == 0)
+		return 0;
+
+	err2 = a->slope_err * a->slope_err;
+	dof = a->dof;
+	if (b) {
+		err2 += b->slope_err * b->slope_err;
+		if (b->dof < dof)
+			dof = b->dof;
 	}
+	if (dof <= 0)
+		return INFINITY;
+
+	return t_quantile(confidence / 100.0, dof) * sqrt(err2);
+}
+
+/*
+ * Compute the trend line for each order page from the fragmented free
+ * memory vector. Returns 1 if trend lines are available for all
+ * orders, 0 if lookback window is not full yet.
+ */
+static int
+fit_trends(struct frag_info *frag_vec, struct trend_set *ts,
+	double *m, double *c)
+{
+	const struct trend_model_ops *model = &trend_models[trend_model];
+	int order, is_ready = 1;
 
 	/*
-	 * guard against divide-by-zero
+	 * Compute the trend line for fragmentation on each order page.
+	 * For order 0 pages, it will be a trend line showing rate
+	 * of consumption of pages. For higher order pages, trend line
+	 * shows loss/gain of pages of that order. When the trend line
+	 * for example for order n pages intersects with trend line for
+	 * total free pages, it means all available pages are of order
+	 * (n-1) or lower and there is 100% fragmentation of order n
+	 * pages. Kernel must compact pages at this point to gain
+	 * new order n pages.
 	 */
-	slope_divisor = LSQ_LOOKBACK * sigma_xx - sigma_x * sigma_x;
-	if (slope_divisor == 0)
-		return -1;
+	if (model->fit_set) {
+		is_ready = model->fit_set(ts, frag_vec, m, c);
+	}
+	else {
+		for (order = 0; order < MAX_ORDER; order++) {
+			if (model->fit(&ts->lines[order],
+					frag_vec[order].free_pages,
+					frag_vec[order].msecs, &m[order],
+					&c[order]) == -1)
+				is_ready = 0;
+		}
+		ts->last_x = frag_vec[0].msecs;
+	}
+
+	if (is_ready) {
+		for (order = 0; order < MAX_ORDER; order++)
+			ts->lines[order].slope = m[order];
+	}
+	return is_ready;
+}
 
-	*m = ((LSQ_LOOKBACK * sigma_xy - sigma_x * sigma_y) * 100) / slope_divisor;
-	*c = (sigma_y - *m * sigma_x) / LSQ_LOOKBACK;
+/*
+ * Fold demand hinted at into the trend line of free pages m[0], c[0].
+ * Free pages are expected to go down at least as fast as the demand
+ * comes. Once the trend line falls faster than that, the burst hinted
+ * at is already under way and is not counted twice. The line is turned
+ * around the newest sample, which is x=0. Returns 1 if the line was
+ * steepened.
+ */
+static int
+fold_demand(double *m, const struct demand *demand)
+{
+	if ((demand == NULL) || (demand->rate <= 0) ||
+	    (m[0] <= -demand->rate))
+		return 0;
+
+	m[0] = -demand->rate;
+	return 1;
+}
+
+/*
+ * Check if free memory described by desc is running low on higher order
+ * pages and needs compaction, given the trend lines for the fragmented
+ * free memory vector and the rate (pages/sec) at which compaction can
+ * recover free pages. The nearest exhaustion of any order is recorded
+ * in horizon.
+ *
+ * Orders are checked from max_compaction_order down. When THP faults
+ * are falling back to base pages, the THP order is checked first even
+ * if it is above max_compaction_order, and compaction is recommended
+ * as soon as it is running out within the window looked forward in,
+ * since applications are already paying for it. While applications
+ * stall in direct compaction, the time it takes compaction to catch up
+ * is held against exhaustion at half its value.
+ *
+ * The highest order hinted at is checked next, also even if it is
+ * above max_compaction_order. If the trend of free pages has been
+ * steepened to the demand hinted at (folded is set), that order is
+ * checked even while it is not getting more fragmented, compaction is
+ * recommended as soon as it has run out, and only the trend of its
+ * fragmented pages is held to the confidence level.
+ */
+static unsigned long
+check_compaction(struct frag_info *frag_vec, struct trend_set *ts,
+	double *m, double *c, long compaction_rate,
+	const struct stall_rates *stalls, const struct demand *demand,
+	int folded, const char *desc, struct horizon *horizon)
+{
+	int order, orders[MAX_ORDER], nr_orders = 0, i;
+	int thp_first, catchup_factor, hint_order = -1;
+	unsigned long retval = 0;
+	unsigned long time_taken, time_to_catchup;
+	double x_cross, current_time, converge, band;
+	struct timespec tspec;
 
+	thp_first = (thp_order > 0) &&
+		(stalls->thp_fallback >= STALL_RATE_MIN);
+	if (thp_first)
+		orders[nr_orders++] = thp_order;
 	/*
-	 * Restore original values for x-axis
+	 * Pages of an order are counted from free pages of the orders
+	 * above it, so the highest order can not be checked
 	 */
-	for (i = 0; i < LSQ_LOOKBACK; i++)
-		lsq->x[i] += x_offset;
+	if (demand && (demand->order > 0) &&
+	    (demand->order < MAX_ORDER - 1)) {
+		hint_order = demand->order;
+		if (!thp_first || (hint_order != thp_order))
+			orders[nr_orders++] = hint_order;
+	}
+	for (order = max_compaction_order; order > 0; order--)
+		if ((!thp_first || (order != thp_order)) &&
+		    (order != hint_order))
+			orders[nr_orders++] = order;
+	catchup_factor = ((stalls->compact_stall >= STALL_RATE_MIN) ||
+			(stalls->compact_time >= STALL_TIME_MIN)) ? 2 : 1;
 
-	return 0;
+	for (i = 0; i < nr_orders; i++) {
+		int thp = thp_first && (i == 0);
+		int hinted = folded && (orders[i] == hint_order);
+
+		order = orders[i];
+		/*
+		 * If lines are parallel, then they never intersect.
+		 */
+		if (m[0] == m[order])
+			continue;
+
+		/*
+		 * If number of high order pages is increasing, no
+		 * need to take any action
+		 */
+		if ((m[order] < 0) && !hinted)
+			continue;
+
+		/*
+		 * Find the point of intersection of the two lines.
+		 * The point of intersection represents 100%
+		 * fragmentation for this order.
+		 */
+		x_cross = (c[0] - c[order]) / (m[order] - m[0]);
+#if 0
+		y_cross = ((m[order] * c[0]) - (m[0] * c[order])) /
+				(m[order] - m[0]);
+#endif
+
+		/*
+		 * Get the current time relative to x=0 on our graph,
+		 * which is the newest sample, and record how far out
+		 * the intersection is.
+		 */
+		sample_clock(&tspec);
+		current_time = tspec.tv_sec*1000 + tspec.tv_nsec/1000000 -
+				ts->last_x;
+		if (current_time < 0)
+			current_time = 0;
+		if (x_cross <= current_time)
+			horizon->compact = 0;
+		else if ((x_cross - current_time) < horizon->compact)
+			horizon->compact = x_cross - current_time;
+
+		/*
+		 * If system is unable to comapct pages, no point
+		 * in forcing compaction. Keep going through remaining
+		 * orders only to find out how far out exhaustion is.
+		 */
+		if (compaction_rate == 0)
+			continue;
+
+		/*
+		 * With a confidence level set, decide on the bound of the
+		 * confidence interval for the rate the two lines converge
+		 * at that is closest to 0, i.e. the latest the lines can
+		 * be expected to intersect. If the interval includes 0,
+		 * the window is too noisy to tell whether they intersect
+		 * at all.
+		 */
+		if (hinted)
+			band = slope_band(&ts->lines[order], NULL);
+		else
+			band = slope_band(&ts->lines[0], &ts->lines[order]);
+		if (band > 0) {
+			converge = m[order] - m[0];
+			if (fabs(converge) <= band) {
+				log_info(4, "Trend of order %d pages on %s is not significant at %d%% confidence", order, desc, confidence);
+				continue;
+			}
+			converge -= copysign(band, converge);
+			x_cross = (c[0] - c[order]) / converge;
+		}
+
+		/*
+		 * If they intersect anytime soon in the future
+		 * or intersected recently in the past, then it
+		 * is time for compaction and there is no need
+		 * to continue evaluating remaining order pages.
+		 * If intersection was in the past, it can be
+		 * outside of current lookback window which means
+		 * x_cross can be negative.
+		 */
+		if ((x_cross < 0) ||
+			(x_cross < current_time)) {
+			unsigned long higher_order_pages =
+				frag_vec[MAX_ORDER - 1].free_pages -
+				frag_vec[order].free_pages;
+
+			/*
+			 * Check if there are enough higher order pages
+			 * that could be broken into pages of current order
+			 * given current rate of consumption and time
+			 * remaining. If not, comapct now.
+			 */
+			if (thp || hinted ||
+			    (higher_order_pages < (m[order] * x_cross))) {
+				log_info(2, "Compaction recommended on %s. Running out of order %d pages", desc, order);
+				if (thp)
+					log_info(2, "THP allocations are falling back at %.1f/sec", stalls->thp_fallback);
+				if (hinted) {
+					log_info(2, "Hinted demand is %.2f pages/msec", demand->rate);
+				}
+				if (order < (MAX_ORDER -1))
+					log_info(3, "No. of free order %d pages = %ld base pages, consumption rate=%.2f pages/msec", order, (frag_vec[order+1].free_pages - frag_vec[order].free_pages), m[order]);
+				 log_info(3, "Current compaction rate=%ld pages/sec", compaction_rate);
+				retval |= MEMPREDICT_COMPACT;
+				break;
+			}
+		}
+		else {
+			/*
+			 * How long before we run out of current order
+			 * pages.  We will constrain the size of window
+			 * we look forward in since large window means
+			 * the consumption trend can change in that time.
+			 * It will be prudent to defer the decision to
+			 * initiate compaction until the exhaustion period
+			 * falls within this window.
+			 */
+			unsigned long largest_window;
+
+			largest_window = tunables.compact_window * lookback *
+						periodicity * 1000;
+			if ((x_cross - current_time) > largest_window)
+				continue;
+			time_taken = x_cross - current_time;
+
+			/*
+			 * How long will it take to compact as many pages as
+			 * available current order pages
+			 */
+			time_to_catchup = ((frag_vec[order+1].free_pages - frag_vec[order].free_pages) * 1000) / compaction_rate;
+			if (thp || (time_taken >= time_to_catchup / catchup_factor)) {
+				log_info(3, "Compaction recommended on %s. Order %d pages consumption rate is high", desc, order);
+				if (thp) {
+					log_info(3, "THP allocations are falling back at %.1f/sec", stalls->thp_fallback);
+				}
+				else if (hinted) {
+					log_info(3, "Hinted demand is %.2f pages/msec", demand->rate);
+				}
+				else if (catchup_factor > 1) {
+					log_info(3, "Direct compaction stalls at %.1f/sec, %.1f msec/sec stalled, compacting early", stalls->compact_stall, stalls->compact_time);
+				}
+				if (order < (MAX_ORDER -1))
+					log_info(3, "No. of free order %d pages = %ld base pages, consumption rate=%.2f pages/msec", order, (frag_vec[order+1].free_pages - frag_vec[order].free_pages), m[order]);
+				 log_info(3, "Current compaction rate=%ld pages/sec, Exhaustion in %ld msec", compaction_rate, time_taken);
+				retval |= MEMPREDICT_COMPACT;
+				break;
+			}
+		}
+	}
+
+	return retval;
 }
 
 /*
@@ -141,44 +778,40 @@ lsq_fit(struct lsq_struct *lsq, long long new_y, long long new_x,
  * On each invocation, this function obtains estimates for the
  * parameters f_T(0), R_T, f_f(o, 0) and R_f(o). Using the best fit
  * line, it then determines if reclamation or compaction should be started
- * now to avert free pages exhaustion or severe fragmentation. Return value
+ * now to avert free pages exhaustion or severe fragmentation. Allocations
+ * announced ahead through hints, given in demand, count towards R_T as
+ * a rate at least, so reclamation starts once the time left before the
+ * deadline comes within the lead needed to reclaim what is asked for.
+ * Return value
  * is a set of bits which represent which condition has been observed -
  * potential free memory exhaustion, and potential severe fragmentation.
+ * Time left before each of these conditions is reached is returned in
+ * horizon so the caller can decide when to sample next.
  */
 unsigned long
-predict(struct frag_info *frag_vec, struct lsq_struct *lsq,
-	unsigned long high_wmark, unsigned long low_wmark, int nid)
+predict(struct frag_info *frag_vec, struct trend_set *ts,
+	unsigned long high_wmark, unsigned long low_wmark, long reclaim_rate,
+	long compaction_rate, const struct stall_rates *stalls,
+	const struct demand *demand, int nid, struct horizon *horizon)
 {
-	int order;
-	long long m[MAX_ORDER];
-	long long c[MAX_ORDER];
-	int is_ready = 1;
+	double m[MAX_ORDER];
+	double c[MAX_ORDER];
 	unsigned long retval = 0;
 	unsigned long time_taken, time_to_catchup;
-	long long x_cross, current_time;
-	struct timespec tspec;
-
+	char desc[16];
+	int folded;
 
-	/*
-	 * Compute the trend line for fragmentation on each order page.
-	 * For order 0 pages, it will be a trend line showing rate
-	 * of consumption of pages. For higher order pages, trend line
-	 * shows loss/gain of pages of that order. When the trend line
-	 * for example for order n pages intersects with trend line for
-	 * total free pages, it means all available pages are of order
-	 * (n-1) or lower and there is 100% fragmentation of order n
-	 * pages. Kernel must compact pages at this point to gain
-	 * new order n pages.
-	 */
-	for (order = 0; order < MAX_ORDER; order++) {
-		if (lsq_fit(&lsq[order], frag_vec[order].free_pages,
-				frag_vec[order].msecs, &m[order],
-				&c[order]) == -1)
-			is_ready = 0;
-	}
+	horizon->ready = 0;
+	horizon->reclaim = horizon->compact = HORIZON_NONE;
+	horizon->shortfall = 0;
 
-	if (!is_ready)
+	if (!fit_trends(frag_vec, ts, m, c))
 		return retval;
+	horizon->ready = 1;
+
+	if ((folded = fold_demand(m, demand))) {
+		log_info(4, "Free pages on node %d are hinted to go down at %.2f pages/msec", nid, demand->rate);
+	}
 
 #if 0
 	if (frag_vec[0].free_pages < high_wmark) {
@@ -206,6 +839,19 @@ predict(struct frag_info *frag_vec, struct lsq_struct *lsq,
 		 * Trend line for overall free pages is showing a
 		 * negative trend. Check if we are approaching high
 		 * watermark faster than pages are being reclaimed.
+		 */
+		if (frag_vec[0].free_pages <= high_wmark) {
+			horizon->reclaim = 0;
+		}
+		else {
+			double t = (frag_vec[0].free_pages - high_wmark) /
+					fabs(m[0]);
+
+			if (t < HORIZON_NONE)
+				horizon->reclaim = t;
+		}
+
+		/*
 		 * If a reclaim rate has not been computed yet, do not
 		 * compute if it is time to start reclamation
 		 */
@@ -214,38 +860,83 @@ predict(struct frag_info *frag_vec, struct lsq_struct *lsq,
 
 		/*
 		 * If number of free pages is already below high watermark,
-		 * it is time to kick off reclamation. If not, compute
-		 * time it will take to go below high_wmark.
+		 * it is time to kick off reclamation. If not, compare
+		 * the time it will take to go below high_wmark with the
+		 * time it will take to reclaim enough pages.
 		 */
 		if (frag_vec[0].free_pages <= high_wmark) {
+			/*
+			 * Pages missing to get back to high watermark and
+			 * pages consumed until the next sample
+			 */
+			horizon->shortfall = high_wmark -
+					frag_vec[0].free_pages +
+					fabs(m[0]) * periodicity * 1000;
 			retval |= MEMPREDICT_RECLAIM;
 			log_info(2, "Reclamation recommended due to free pages being below high watermark");
-			log_info(2, "Consumption rate on node %d=%ld pages/msec, reclaim rate is %ld pages/msec, Free pages=%ld, low wmark=%ld, high wmark=%ld", nid, abs(m[0]), reclaim_rate, frag_vec[0].free_pages, low_wmark, high_wmark);
+			log_info(2, "Consumption rate on node %d=%.2f pages/msec, reclaim rate is %ld pages/sec, Free pages=%ld, low wmark=%ld, high wmark=%ld", nid, fabs(m[0]), reclaim_rate, frag_vec[0].free_pages, low_wmark, high_wmark);
 		}
 		else {
-			time_taken = (frag_vec[0].free_pages - high_wmark)
-					/ abs(m[0]);
+			/*
+			 * With a confidence level set, use the slowest
+			 * consumption rate within the confidence interval.
+			 * If free pages may not be going down at all,
+			 * decline seen so far is within noise. Demand
+			 * hinted at is taken as given.
+			 */
+			double slope = folded ? m[0] :
+					m[0] + slope_band(&ts->lines[0], NULL);
+			double until_high = INFINITY;
+			double consumed, lead = tunables.reclaim_lead;
+
+			if (slope < 0)
+				until_high = (frag_vec[0].free_pages -
+						high_wmark) / -slope;
+			else
+				log_info(4, "Consumption of free pages on node %d is not significant at %d%% confidence", nid, confidence);
 
 			/*
 			 * Time to reclaim frag_vec[0].free_pages - high_wmark
 			 */
-			time_to_catchup = (frag_vec[0].free_pages -
-						high_wmark) / reclaim_rate;
+			time_to_catchup = ((frag_vec[0].free_pages -
+						high_wmark) * 1000) / reclaim_rate;
 
 			/*
 			 * If time taken to go below high_wmark is fairly
 			 * close to time it will take to reclaim enough
 			 * then we need to start kswapd now. We will use
-			 * 3 times of the time to catch up as threshold
-			 * just to ensure reclamationprocess has enough time.
+			 * reclaim_lead (3 unless auto-tuned) times the
+			 * time to catch up as threshold just to ensure
+			 * reclamationprocess has enough time.
 			 * This helps eliminate the possibility of forcing
 			 * reclamation when time to go below high watermark
-			 * is too far in the future.
+			 * is too far in the future. While applications
+			 * stall in direct reclaim, they are short of free
+			 * pages already and twice the threshold is used.
 			 */
-			if (time_taken <= (3*time_to_catchup)) {
-				log_info(3, "Reclamation recommended due to high memory consumption rate");
-				log_info(3, "Consumption rate on node %d=%ld pages/msec, reclaim rate is %ld pages/msec, Free pages=%ld, low wmark=%ld, high wmark=%ld", nid, abs(m[0]), reclaim_rate, frag_vec[0].free_pages, low_wmark, high_wmark);
+			if ((stalls->alloc_stall >= STALL_RATE_MIN) ||
+			    (stalls->reclaim_time >= STALL_TIME_MIN))
+				lead *= 2;
+			if (until_high <= (lead * time_to_catchup)) {
+				time_taken = until_high;
+				if (folded) {
+					log_info(3, "Reclamation recommended ahead of hinted demand");
+				}
+				else {
+					log_info(3, "Reclamation recommended due to high memory consumption rate");
+				}
+				log_info(3, "Consumption rate on node %d=%.2f pages/msec, reclaim rate is %ld pages/sec, Free pages=%ld, low wmark=%ld, high wmark=%ld", nid, fabs(m[0]), reclaim_rate, frag_vec[0].free_pages, low_wmark, high_wmark);
 				log_info(3, "Time to below high watermark= %ld msec, time to catch up=%ld msec", time_taken, time_to_catchup);
+
+				/*
+				 * Pages that will be consumed beyond high
+				 * watermark over the same window
+				 */
+				consumed = fabs(m[0]) * lead * time_to_catchup;
+				if (consumed > frag_vec[0].free_pages - high_wmark)
+					horizon->shortfall = consumed -
+						(frag_vec[0].free_pages -
+						 high_wmark);
 				retval |= MEMPREDICT_RECLAIM;
 			}
 		}
@@ -253,111 +944,43 @@ predict(struct frag_info *frag_vec, struct lsq_struct *lsq,
 
 	/*
 	 * Check if system is running low on higher order pages and needs
-	 * compaction.
+	 * compaction. When fragmentation is modeled per zone and
+	 * migratetype, this is done by predict_fragmentation() instead.
 	 */
-	for (order = max_compaction_order; order > 0; order--) {
-		/*
-		 * If lines are parallel, then they never intersect.
-		 */
-		if (m[0] == m[order])
-			continue;
-
-		/*
-		 * If number of high order pages is increasing, no
-		 * need to take any action
-		 */
-		if (m[order] < 0)
-			continue;
-
-		/*
-		 * If system is unable to comapct pages, no point
-		 * in forcing compaction
-		 */
-		if (compaction_rate == 0)
-			return 0;
-
-		/*
-		 * Find the point of intersection of the two lines.
-		 * The point of intersection represents 100%
-		 * fragmentation for this order.
-		 */
-		x_cross = ((c[0] - c[order]) * 100) /
-					(m[order] - m[0]);
-#if 0
-		y_cross = ((m[order] * c[0]) - (m[0] * c[order])) /
-				(m[order] - m[0]);
-#endif
+	if (!pagetype_mode) {
+		snprintf(desc, sizeof(desc), "node %d", nid);
+		retval |= check_compaction(frag_vec, ts, m, c,
+					compaction_rate, stalls, demand, folded,
+					desc, horizon);
+	}
 
-		/*
-		 * If they intersect anytime soon in the future
-		 * or intersected recently in the past, then it
-		 * is time for compaction and there is no need
-		 * to continue evaluating remaining order pages.
-		 * If intersection was in the past, it can be
-		 * outside of current lookback window which means
-		 * x_cross can be negative.
-		 *
-		 * To check if intersection is in near future,
-		 * get the current time relative to x=0 on our
-		 * graph.
-		 */
-		clock_gettime(CLOCK_MONOTONIC_RAW, &tspec);
-		current_time = tspec.tv_sec*1000 + tspec.tv_nsec/1000 - lsq->x[lsq->next];;
-		if (current_time < 0)
-			current_time = 0;
-		if ((x_cross < 0) ||
-			(x_cross < current_time)) {
-			unsigned long higher_order_pages =
-				frag_vec[MAX_ORDER - 1].free_pages -
-				frag_vec[order].free_pages;
+	return retval;
+}
 
-			/*
-			 * Check if there are enough higher order pages
-			 * that could be broken into pages of current order
-			 * given current rate of consumption and time
-			 * remaining. If not, comapct now.
-			 */
-			if (higher_order_pages < (m[order] * x_cross)) {
-				log_info(2, "Compaction recommended on node %d. Running out of order %d pages", nid, order);
-				if (order < (MAX_ORDER -1))
-					log_info(3, "No. of free order %d pages = %ld base pages, consumption rate=%ld pages/msec", order, (frag_vec[order+1].free_pages - frag_vec[order].free_pages), m[order]);
-				 log_info(3, "Current compaction rate=%ld pages/msec", compaction_rate);
-				retval |= MEMPREDICT_COMPACT;
-				break;
-			}
-		}
-		else {
-			/*
-			 * How long before we run out of current order
-			 * pages.  We will constrain the size of window
-			 * we look forward in since large window means
-			 * the consumption trend can change in that time.
-			 * It will be prudent to defer the decision to
-			 * initiate compaction until the exhaustion period
-			 * falls within this window.
-			 */
-			unsigned long largest_window;
+/*
+ * Same as the compaction half of predict() but for the free lists of a
+ * single zone and migratetype, as described by desc. This allows
+ * compaction decisions to be based only on free memory compaction can
+ * do something about.
+ */
+unsigned long
+predict_fragmentation(struct frag_info *frag_vec, struct trend_set *ts,
+	long compaction_rate, const struct stall_rates *stalls,
+	const struct demand *demand, const char *desc, struct horizon *horizon)
+{
+	double m[MAX_ORDER];
+	double c[MAX_ORDER];
+	int folded;
 
-			largest_window = 5 * LSQ_LOOKBACK * periodicity * 1000;
-			time_taken = x_cross - current_time;
-			if (time_taken > largest_window)
-				continue;
+	horizon->ready = 0;
+	horizon->reclaim = horizon->compact = HORIZON_NONE;
+	horizon->shortfall = 0;
 
-			/*
-			 * How long will it take to compact as many pages as
-			 * available current order pages
-			 */
-			time_to_catchup = (frag_vec[order+1].free_pages - frag_vec[order].free_pages) / compaction_rate;
-			if (time_taken >= time_to_catchup) {
-				log_info(3, "Compaction recommended on node %d. Order %d pages consumption rate is high", nid, order);
-				if (order < (MAX_ORDER -1))
-					log_info(3, "No. of free order %d pages = %ld base pages, consumption rate=%ld pages/msec", order, (frag_vec[order+1].free_pages - frag_vec[order].free_pages), m[order]);
-				 log_info(3, "Current compaction rate=%ld pages/msec, Exhaustion in %ld msec", compaction_rate, time_taken);
-				retval |= MEMPREDICT_COMPACT;
-				break;
-			}
-		}
-	}
+	if (!fit_trends(frag_vec, ts, m, c))
+		return 0;
+	horizon->ready = 1;
 
-	return retval;
+	folded = fold_demand(m, demand);
+	return check_compaction(frag_vec, ts, m, c, compaction_rate, stalls,
+				demand, folded, desc, horizon);
 }
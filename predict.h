@@ -29,32 +29,112 @@
 #include <stdarg.h>
 #include <string.h>
 #include <syslog.h>
+#include <limits.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* Size of sliding window for computing trend line */
+/*
+ * Default size of sliding window for computing trend line and the
+ * range it can be set to
+ */
 #define	LSQ_LOOKBACK		8
+#define MIN_LOOKBACK		3
+#define MAX_LOOKBACK		256
 
 /* How often should data be sampled and trend analyzed*/
 #define LOW_PERIODICITY		60
 #define NORM_PERIODICITY	30
 #define HIGH_PERIODICITY	15
+#define MAX_PERIODICITY		3600	/* Longest interval that can be set */
+
+/*
+ * Bounds on the sampling interval (msec) when sampling rate adapts to
+ * predicted time to exhaustion. Shortest interval is fixed, longest
+ * is a multiple of the periodicity for the aggressiveness level.
+ */
+#define MIN_SAMPLE_INTERVAL	500
+#define MAX_SAMPLE_FACTOR	4
 
 #define	MAX_ORDER		11
 #define MEMPREDICT_RECLAIM	0x01
 #define MEMPREDICT_COMPACT	0x02
 #define MEMPREDICT_LOWER_WMARKS	0x04
 
-extern long compaction_rate, reclaim_rate;
 extern int debug_mode, verbose, max_compaction_order, periodicity;
+extern int thp_order;
+extern int lookback;
+extern int pagetype_mode;
+
+/*
+ * Models trend lines of free pages can be fitted with: least squares
+ * over the lookback window, exponentially weighted least squares and
+ * Holt's linear trend (double exponential smoothing).
+ */
+enum trend_model_type {
+	TREND_LSQ,
+	TREND_EWLSQ,
+	TREND_HOLT,
+	NR_TREND_MODELS
+};
 
+extern int trend_model, trend_alpha, trend_beta, confidence;
+
+/*
+ * State of a trend line. The exponentially weighted model keeps
+ * weighted means and sums of squared deviations from the means. Holt's
+ * method keeps only a level and a slope. Least squares keeps its window
+ * and sums in the trend_set the line belongs to.
+ */
 struct lsq_struct {
-	int next;
-	int ready;
-	long long y[LSQ_LOOKBACK];
-	long long x[LSQ_LOOKBACK];
+	int lookback;		/* Size of the window */
+	int count;		/* Samples seen, up to lookback */
+	double last_x;		/* Time of the newest sample */
+	double mean_x;
+	double mean_y;
+	double sxx;		/* Sum of (x - mean_x)^2 */
+	double sxy;		/* Sum of (x - mean_x) * (y - mean_y) */
+	double syy;		/* Sum of (y - mean_y)^2 */
+	double weight;		/* Sum of sample weights, weighted LSQ */
+	double weight2;		/* Sum of squared sample weights */
+	double level;		/* Holt level and slope */
+	double trend;
+	double trend_var;	/* Smoothed variance of change in level */
+	double slope;		/* Slope of the last full fit, pages/msec */
+
+	/* Quality of the last fit */
+	double dof;		/* Degrees of freedom */
+	double resid_var;	/* Variance of residuals */
+	double slope_err;	/* Standard error of slope */
+};
+
+/*
+ * Trend lines of free pages of all orders of one free memory vector.
+ * Samples of all orders are taken at the same time, so least squares
+ * keeps one circular buffer of timestamps and one running mean and sum
+ * of squared deviations of x for all of them. Samples of all orders
+ * taken at the same time are next to each other in y, a row of
+ * LSQ_LINES entries per slot, and running sums of y are kept in
+ * arrays of LSQ_LINES so they can be updated for all orders at once
+ * with vector instructions. LSQ_LINES is MAX_ORDER rounded up to a
+ * multiple of the vector width, entries past MAX_ORDER stay 0.
+ */
+#define LSQ_LINES	12
+
+struct trend_set {
+	int lookback;		/* Size of the window */
+	int next;		/* Slot for the next sample */
+	int count;		/* Samples in the window */
+	double *x;		/* lookback timestamps */
+	double *y;		/* lookback rows of LSQ_LINES samples */
+	double last_x;		/* Time of the newest sample */
+	double mean_x;
+	double sxx;
+	double mean_y[LSQ_LINES];
+	double sxy[LSQ_LINES];
+	double syy[LSQ_LINES];
+	struct lsq_struct lines[MAX_ORDER];
 };
 
 enum output_type {
@@ -68,8 +148,65 @@ struct frag_info {
 	long long msecs;
 };
 
-unsigned long predict(struct frag_info *, struct lsq_struct *,
-			unsigned long, unsigned long, int);
+/*
+ * Rates (events/sec) at which allocations stalled or fell back, from
+ * /proc/vmstat. These tell how much applications already feel
+ * fragmentation and shortage of free pages: THP faults and collapses
+ * falling back to base pages, direct compactions and direct reclaims.
+ * A rate of STALL_RATE_MIN or more makes predict() act earlier.
+ * Where stalls are traced, the msec per second threads on the node
+ * spent in direct reclaim and direct compaction tell how much they
+ * hurt, and STALL_TIME_MIN or more of either makes predict() act
+ * earlier too.
+ */
+#define STALL_RATE_MIN	1.0
+#define STALL_TIME_MIN	10.0
+struct stall_rates {
+	double thp_fallback;
+	double compact_stall;
+	double alloc_stall;
+	double reclaim_time;		/* msec/sec, 0 if not traced */
+	double compact_time;		/* msec/sec, 0 if not traced */
+};
+
+/*
+ * Demand for free pages announced ahead of time through hints, as the
+ * rate (pages/msec) free pages are expected to be taken at least and
+ * the highest order asked for, -1 if none
+ */
+struct demand {
+	double rate;
+	int order;
+};
+
+/*
+ * Time left (msec) as computed by predict() before free pages go
+ * below high watermark (reclaim) and before free pages of an order
+ * are exhausted (compact). HORIZON_NONE means the current trend does
+ * not lead there. ready is 0 until trend lines are available. When
+ * predict() recommends reclamation, shortfall is the number of pages
+ * that need to be reclaimed to keep free pages above high watermark.
+ */
+#define HORIZON_NONE	LLONG_MAX
+struct horizon {
+	int ready;
+	long long reclaim;
+	long long compact;
+	unsigned long shortfall;
+};
+
+int trend_alloc(struct trend_set *, int);
+int find_trend_model(const char *);
+const char *trend_model_name(int);
+void trend_free(struct trend_set *);
+unsigned long predict(struct frag_info *, struct trend_set *,
+			unsigned long, unsigned long, long, long,
+			const struct stall_rates *, const struct demand *,
+			int, struct horizon *);
+unsigned long predict_fragmentation(struct frag_info *, struct trend_set *,
+			long, const struct stall_rates *,
+			const struct demand *, const char *,
+			struct horizon *);
 
 #define log_err(...)	log_msg(LOG_ERR, __VA_ARGS__)
 #define log_warn(...)	log_msg(LOG_WARNING, __VA_ARGS__)
@@ -0,0 +1,391 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+#include "trace.h"
+
+/*
+ * Smallest buffer to allocate for a file. Files are sized at open time
+ * to twice their current length so small changes in the width of the
+ * numbers in the file do not force the buffer to grow later.
+ */
+#define PROCFS_MINBUF	4096
+
+/*
+ * Read the whole file into f->buf starting at offset 0. Returns 1 if
+ * the buffer had room for the whole file, 0 if the file did not fit
+ * and -1 on error.
+ */
+static int
+procfs_fill(struct procfs_file *f)
+{
+	ssize_t n;
+
+	f->len = 0;
+	while (f->len < f->size - 1) {
+		n = pread(f->fd, f->buf + f->len, f->size - 1 - f->len,
+				f->len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		f->len += n;
+	}
+	f->buf[f->len] = 0;
+
+	return (f->len < f->size - 1);
+}
+
+static int
+procfs_grow(struct procfs_file *f, size_t size)
+{
+	char *buf;
+
+	if ((buf = realloc(f->buf, size)) == NULL) {
+		log_err("Failed to allocate buffer for %s (%s)", f->path,
+				strerror(errno));
+		return 0;
+	}
+	f->buf = buf;
+	f->size = size;
+	return 1;
+}
+
+/*
+ * Fill the buffer with the contents of the file in the trace being
+ * replayed. Returns 1 on success, 0 if the trace has no contents for
+ * the file.
+ */
+static int
+procfs_replay(struct procfs_file *f)
+{
+	const char *data;
+	size_t len;
+
+	if (!trace_replay_file(f, &data, &len)) {
+		errno = ENODATA;
+		return 0;
+	}
+	if ((len >= f->size) && !procfs_grow(f, len * 2))
+		return 0;
+	memcpy(f->buf, data, len);
+	f->buf[len] = 0;
+	f->len = len;
+
+	return 1;
+}
+
+/*
+ * Open a file for repeated sampling and allocate a buffer large
+ * enough to hold its contents. When a trace is being replayed, the
+ * file is not opened and its contents come from the trace.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+procfs_open(struct procfs_file *f, const char *path)
+{
+	int ret;
+
+	f->path = path;
+	f->buf = NULL;
+	f->size = f->len = 0;
+	f->trace_id = -1;
+	if (trace_mode == TRACE_REPLAY) {
+		f->fd = -1;
+		trace_open_file(f);
+		if (procfs_grow(f, PROCFS_MINBUF) && procfs_replay(f))
+			return 1;
+		procfs_close(f);
+		return 0;
+	}
+	if ((f->fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+
+	if (!procfs_grow(f, PROCFS_MINBUF))
+		goto err;
+	while ((ret = procfs_fill(f)) == 0)
+		if (!procfs_grow(f, f->size * 2))
+			goto err;
+	if (ret < 0)
+		goto err;
+
+	if ((f->len * 2 >= f->size) && !procfs_grow(f, f->len * 2))
+		goto err;
+
+	trace_open_file(f);
+	trace_record_file(f);
+	return 1;
+
+err:
+	procfs_close(f);
+	return 0;
+}
+
+/*
+ * Re-read the file from the beginning. The buffer grows only if the
+ * file no longer fits in it, which should be rare once it has been
+ * sized at open time. What is read goes into the trace being
+ * recorded, if any.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+procfs_read(struct procfs_file *f)
+{
+	int ret;
+
+	if (trace_mode == TRACE_REPLAY) {
+		if (procfs_replay(f))
+			return 1;
+		log_err("No contents for %s in trace", f->path);
+		return 0;
+	}
+
+	while ((ret = procfs_fill(f)) == 0) {
+		log_info(3, "%s has grown beyond %zu bytes", f->path, f->size);
+		if (!procfs_grow(f, f->size * 2))
+			return 0;
+	}
+	if (ret < 0) {
+		log_err("Failed to read %s (%s)", f->path, strerror(errno));
+		return 0;
+	}
+	trace_record_file(f);
+
+	return 1;
+}
+
+void
+procfs_close(struct procfs_file *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+	free(f->buf);
+	f->fd = -1;
+	f->buf = NULL;
+	f->size = f->len = 0;
+}
+
+/*
+ * Return the next word in the buffer. A word is terminated by
+ * whitespace or ','. Returns 0 if there is no word left on the
+ * current line.
+ */
+int
+scan_word(struct scan *s, const char **word, size_t *len)
+{
+	const char *p;
+
+	scan_skip_blank(s);
+	p = s->pos;
+	while ((p < s->end) && (*p != ' ') && (*p != '\t') && (*p != '\n') &&
+			(*p != ','))
+		p++;
+	if (p == s->pos)
+		return 0;
+
+	*word = s->pos;
+	*len = p - s->pos;
+	s->pos = p;
+	return 1;
+}
+
+/*
+ * Parse an unsigned decimal number. Returns 0 if the next word on the
+ * current line is not a number.
+ */
+int
+scan_ulong(struct scan *s, unsigned long *val)
+{
+	unsigned long v = 0;
+	const char *p;
+
+	scan_skip_blank(s);
+	p = s->pos;
+	while ((p < s->end) && (*p >= '0') && (*p <= '9'))
+		v = v * 10 + (*p++ - '0');
+	if (p == s->pos)
+		return 0;
+
+	*val = v;
+	s->pos = p;
+	return 1;
+}
+
+/*
+ * Parse the next element of a list in the format used by the kernel
+ * for cpu and node lists, e.g. "0-3,8,10-11". A single number n is
+ * returned as the range n-n. Returns 0 at the end of the list or if
+ * the list is malformed.
+ */
+int
+scan_range(struct scan *s, unsigned long *first, unsigned long *last)
+{
+	if (!scan_ulong(s, first))
+		return 0;
+	*last = *first;
+	if (scan_char(s, '-') && (!scan_ulong(s, last) || (*last < *first)))
+		return 0;
+	scan_char(s, ',');
+
+	return 1;
+}
+
+/*
+ * Names of counters in /proc/vmstat and where in struct vmstat_counters
+ * each one is added to. Kernels before 4.8 count pages stolen per zone
+ * and have no total, kernels before 4.10 have a total of allocation
+ * stalls only, so the per zone counters of every zone are added up. A
+ * kernel has either the total or the per zone counters, never both.
+ */
+#define VMSTAT_FIELD(name, field)	\
+	{ name, sizeof(name) - 1, offsetof(struct vmstat_counters, field) }
+
+static const struct vmstat_field {
+	const char *name;
+	size_t len;
+	size_t offset;
+} vmstat_fields[] = {
+	VMSTAT_FIELD("pgsteal_kswapd", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_kswapd_dma", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_kswapd_dma32", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_kswapd_normal", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_kswapd_high", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_kswapd_movable", pgsteal_kswapd),
+	VMSTAT_FIELD("pgsteal_direct", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_direct_dma", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_direct_dma32", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_direct_normal", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_direct_high", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_direct_movable", pgsteal_direct),
+	VMSTAT_FIELD("pgsteal_proactive", pgsteal_direct),
+	VMSTAT_FIELD("nr_inactive_file", inactive_file),
+	VMSTAT_FIELD("nr_inactive_anon", inactive_anon),
+	VMSTAT_FIELD("nr_dirty", file_dirty),
+	VMSTAT_FIELD("nr_writeback", file_writeback),
+	VMSTAT_FIELD("pswpout", pswpout),
+	VMSTAT_FIELD("zswpout", zswpout),
+	VMSTAT_FIELD("workingset_refault_anon", refault_anon),
+	VMSTAT_FIELD("workingset_refault_file", refault_file),
+	VMSTAT_FIELD("workingset_refault", refault_file),
+	VMSTAT_FIELD("compact_migrate_scanned", compact_migrate_scanned),
+	VMSTAT_FIELD("compact_free_scanned", compact_free_scanned),
+	VMSTAT_FIELD("compact_isolated", compact_isolated),
+	VMSTAT_FIELD("compact_success", compact_success),
+	VMSTAT_FIELD("compact_stall", compact_stall),
+	VMSTAT_FIELD("thp_fault_fallback", thp_fallback),
+	VMSTAT_FIELD("thp_collapse_alloc_failed", thp_fallback),
+	VMSTAT_FIELD("allocstall", allocstall),
+	VMSTAT_FIELD("allocstall_dma", allocstall),
+	VMSTAT_FIELD("allocstall_dma32", allocstall),
+	VMSTAT_FIELD("allocstall_normal", allocstall),
+	VMSTAT_FIELD("allocstall_high", allocstall),
+	VMSTAT_FIELD("allocstall_movable", allocstall),
+	VMSTAT_FIELD("allocstall_device", allocstall),
+};
+
+/*
+ * Read the counters of interest from /proc/vmstat opened as f.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+read_vmstat(struct procfs_file *f, struct vmstat_counters *vc)
+{
+	struct scan s;
+	unsigned long val;
+	int i;
+
+	if (!procfs_read(f))
+		return 0;
+
+	memset(vc, 0, sizeof(*vc));
+	scan_init(&s, f);
+	while (!scan_eof(&s)) {
+		const char *w;
+		size_t len;
+
+		if (scan_word(&s, &w, &len) && scan_ulong(&s, &val)) {
+			for (i = 0; i < sizeof(vmstat_fields) /
+					sizeof(vmstat_fields[0]); i++) {
+				const struct vmstat_field *vf = &vmstat_fields[i];
+
+				if ((len == vf->len) &&
+				    (memcmp(w, vf->name, len) == 0)) {
+					*(unsigned long *)((char *)vc +
+							vf->offset) += val;
+					break;
+				}
+			}
+		}
+		scan_next_line(&s);
+	}
+
+	return 1;
+}
+
+/*
+ * Parse a single line of /proc/buddyinfo at the current position of the
+ * scanner. Return 1 if successful or 0 otherwise. The scanner is left at
+ * the beginning of the next line.
+ */
+int
+scan_buddyinfo(struct scan *s, int *nid, const char **zone, size_t *zonelen,
+		unsigned long *nr_free)
+{
+	const char *w;
+	size_t len;
+	unsigned long val;
+	unsigned int order;
+
+	if (!scan_word(s, &w, &len) || !scan_is(w, len, "Node") ||
+	    !scan_ulong(s, &val) || !scan_char(s, ',') ||
+	    !scan_word(s, &w, &len) || !scan_is(w, len, "zone") ||
+	    !scan_word(s, zone, zonelen))
+		return 0;
+	*nid = val;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		if (!scan_ulong(s, &nr_free[order]))
+			return 0;
+	}
+
+	scan_next_line(s);
+	return 1;
+}
@@ -0,0 +1,152 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef PROCFS_H
+#define	PROCFS_H
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A file under /proc or /sys that is sampled repeatedly. The file is
+ * opened once and re-read from offset 0 with pread() into a buffer that
+ * is allocated when the file is opened, so sampling does not allocate
+ * memory or go through stdio.
+ */
+struct procfs_file {
+	const char *path;
+	int fd;
+	char *buf;
+	size_t size;		/* Allocated size of buf */
+	size_t len;		/* Bytes read by last procfs_read() */
+	int trace_id;		/* Path of the file in trace, -1 if none */
+};
+
+extern int procfs_open(struct procfs_file *, const char *);
+extern int procfs_read(struct procfs_file *);
+extern void procfs_close(struct procfs_file *);
+
+/*
+ * Scanner over the contents of a procfs buffer. It walks the buffer in
+ * place and never copies or allocates. Words are returned as a pointer
+ * into the buffer and a length.
+ */
+struct scan {
+	const char *pos;
+	const char *end;
+};
+
+static inline void
+scan_init(struct scan *s, struct procfs_file *f)
+{
+	s->pos = f->buf;
+	s->end = f->buf + f->len;
+}
+
+static inline void
+scan_init_str(struct scan *s, const char *str)
+{
+	s->pos = str;
+	s->end = str + strlen(str);
+}
+
+static inline int
+scan_eof(struct scan *s)
+{
+	return s->pos >= s->end;
+}
+
+/* Skip blanks and tabs, but not end of line */
+static inline void
+scan_skip_blank(struct scan *s)
+{
+	while ((s->pos < s->end) && ((*s->pos == ' ') || (*s->pos == '\t')))
+		s->pos++;
+}
+
+/* Move to the beginning of the next line */
+static inline void
+scan_next_line(struct scan *s)
+{
+	const char *nl;
+
+	nl = memchr(s->pos, '\n', s->end - s->pos);
+	s->pos = nl ? nl + 1 : s->end;
+}
+
+/* Consume character c if it is the next non-blank character */
+static inline int
+scan_char(struct scan *s, char c)
+{
+	scan_skip_blank(s);
+	if ((s->pos < s->end) && (*s->pos == c)) {
+		s->pos++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Does word w of length len match the string literal lit */
+#define scan_is(w, len, lit)	(((len) == sizeof(lit) - 1) && \
+				 (memcmp((w), (lit), sizeof(lit) - 1) == 0))
+
+extern int scan_word(struct scan *, const char **, size_t *);
+extern int scan_ulong(struct scan *, unsigned long *);
+extern int scan_range(struct scan *, unsigned long *, unsigned long *);
+
+/*
+ * Counters read from /proc/vmstat. Some kernels report a counter per
+ * zone under different names, the values of all of them are added up.
+ */
+struct vmstat_counters {
+	unsigned long pgsteal_kswapd;
+	unsigned long pgsteal_direct;	/* Includes memory.reclaim writes */
+	unsigned long inactive_file;
+	unsigned long inactive_anon;
+	unsigned long file_dirty;
+	unsigned long file_writeback;
+	unsigned long pswpout;
+	unsigned long zswpout;
+	unsigned long refault_anon;
+	unsigned long refault_file;
+	unsigned long compact_migrate_scanned;
+	unsigned long compact_free_scanned;
+	unsigned long compact_isolated;
+	unsigned long compact_success;
+	unsigned long compact_stall;
+	unsigned long thp_fallback;	/* THP faults and collapses */
+	unsigned long allocstall;
+};
+
+extern int read_vmstat(struct procfs_file *, struct vmstat_counters *);
+extern int scan_buddyinfo(struct scan *, int *, const char **, size_t *,
+			unsigned long *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROCFS_H */
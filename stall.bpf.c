@@ -0,0 +1,161 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include "stall.h"
+
+#define PF_KTHREAD	0x00200000
+
+/*
+ * Set by the daemon before loading, so compaction it starts itself
+ * through compact_memory is not taken for a stall of an application
+ */
+const volatile __u32 self_tgid;
+
+/*
+ * When each thread in direct reclaim or compaction went in and on
+ * which node. Direct reclaim and compaction are entered one after the
+ * other from the allocator's slow path, never one inside the other,
+ * but both are keyed by kind in case a tracepoint end is missed.
+ */
+struct stall_start {
+	__u64 ts;
+	__u32 nid;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 16384);
+	__type(key, __u64);
+	__type(value, struct stall_start);
+} starts SEC(".maps");
+
+/*
+ * NR_STALL_KINDS * MAX_STALL_NODES histograms, indexed by
+ * kind * MAX_STALL_NODES + nid. Kept per cpu so no atomics are needed,
+ * the daemon adds up the cpus when it reads them.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_STALL_KINDS * MAX_STALL_NODES);
+	__type(key, __u32);
+	__type(value, struct stall_hist);
+} hists SEC(".maps");
+
+static __always_inline __u64
+start_key(__u64 pid_tgid, enum stall_kind kind)
+{
+	return ((pid_tgid & 0xffffffff) << 1) | kind;
+}
+
+/*
+ * Note the start of a stall. Kernel threads are left out, they are
+ * kcompactd and kswapd doing work in the background. The tracepoints
+ * do not tell which node the allocation is for, the node of the cpu
+ * the thread runs on is taken instead, which is where the allocator
+ * looks first.
+ */
+static __always_inline int
+stall_begin(enum stall_kind kind)
+{
+	struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u64 key = start_key(pid_tgid, kind);
+	struct stall_start s;
+
+	if ((pid_tgid >> 32) == self_tgid)
+		return 0;
+	if (BPF_CORE_READ(task, flags) & PF_KTHREAD)
+		return 0;
+
+	s.ts = bpf_ktime_get_ns();
+	s.nid = bpf_get_numa_node_id();
+	bpf_map_update_elem(&starts, &key, &s, BPF_ANY);
+	return 0;
+}
+
+/*
+ * Add the time since the start of the stall to the histogram of the
+ * node it started on
+ */
+static __always_inline int
+stall_end(enum stall_kind kind)
+{
+	__u64 key = start_key(bpf_get_current_pid_tgid(), kind);
+	struct stall_start *s;
+	struct stall_hist *h;
+	__u64 delta, usecs;
+	__u32 idx, nid;
+	int i;
+
+	if ((s = bpf_map_lookup_elem(&starts, &key)) == NULL)
+		return 0;
+	delta = bpf_ktime_get_ns() - s->ts;
+	nid = s->nid;
+	bpf_map_delete_elem(&starts, &key);
+	if (nid >= MAX_STALL_NODES)
+		return 0;
+
+	idx = kind * MAX_STALL_NODES + nid;
+	if ((h = bpf_map_lookup_elem(&hists, &idx)) == NULL)
+		return 0;
+	usecs = delta / 1000;
+	for (i = 0; i < NR_STALL_BUCKETS - 1; i++)
+		if (usecs < (1ULL << i))
+			break;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += delta;
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_direct_reclaim_begin")
+int
+direct_reclaim_begin(void *ctx)
+{
+	return stall_begin(STALL_RECLAIM);
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_direct_reclaim_end")
+int
+direct_reclaim_end(void *ctx)
+{
+	return stall_end(STALL_RECLAIM);
+}
+
+SEC("tracepoint/compaction/mm_compaction_begin")
+int
+compaction_begin(void *ctx)
+{
+	return stall_begin(STALL_COMPACT);
+}
+
+SEC("tracepoint/compaction/mm_compaction_end")
+int
+compaction_end(void *ctx)
+{
+	return stall_end(STALL_COMPACT);
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,225 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "predict.h"
+#include "node.h"
+#include "stall.h"
+#ifdef HAVE_BPF
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include "stall.skel.h"
+#endif
+
+/*
+ * Collector of the time application threads stall in direct reclaim
+ * and direct compaction, from the eBPF program in stall.bpf.c. It is
+ * built only with "make BPF=1", without it the daemon goes by the
+ * number of stalls in /proc/vmstat alone.
+ *
+ * Every cycle the histograms are read and what was added to them
+ * since the last cycle becomes the msec per second threads on each
+ * node spent stalled, smoothed over STALL_SMOOTHING samples like the
+ * rates taken from /proc/vmstat.
+ */
+#define STALL_SMOOTHING		4
+
+int stall_tracing = 1;		/* Trace stalls if built with eBPF support */
+int stalls_traced;		/* Collector is running */
+struct stall_totals stall_totals;
+
+#ifdef HAVE_BPF
+static struct stall_bpf *skel;
+static struct stall_hist *percpu;
+static int nr_cpus;
+static struct stall_hist last[NR_STALL_KINDS][MAX_STALL_NODES];
+static long long last_msecs;
+
+static const char *stall_names[NR_STALL_KINDS] = {
+	[STALL_RECLAIM] = "direct reclaims",
+	[STALL_COMPACT] = "direct compactions",
+};
+
+/*
+ * Load the eBPF program and attach it to the tracepoints.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+open_stalls(void)
+{
+	int err;
+
+	if ((nr_cpus = libbpf_num_possible_cpus()) <= 0) {
+		log_err("Failed to get number of cpus (%s)", strerror(-nr_cpus));
+		return 0;
+	}
+	if ((percpu = calloc(nr_cpus, sizeof(*percpu))) == NULL) {
+		log_err("Failed to allocate stall histograms (%s)",
+				strerror(errno));
+		return 0;
+	}
+	if ((skel = stall_bpf__open()) == NULL) {
+		log_err("Failed to open eBPF stall tracing (%s)", strerror(errno));
+		goto err;
+	}
+	skel->rodata->self_tgid = getpid();
+	if ((err = stall_bpf__load(skel)) != 0) {
+		log_err("Failed to load eBPF stall tracing (%s)", strerror(-err));
+		goto err;
+	}
+	if ((err = stall_bpf__attach(skel)) != 0) {
+		log_err("Failed to attach to reclaim and compaction tracepoints (%s)",
+				strerror(-err));
+		goto err;
+	}
+	stalls_traced = 1;
+	return 1;
+
+err:
+	close_stalls();
+	return 0;
+}
+
+/*
+ * Sum of the per cpu copies of a histogram
+ */
+static int
+read_hist(int fd, enum stall_kind kind, int nid, struct stall_hist *h)
+{
+	__u32 idx = kind * MAX_STALL_NODES + nid;
+	int cpu, i;
+
+	if (bpf_map_lookup_elem(fd, &idx, percpu) != 0)
+		return 0;
+	memset(h, 0, sizeof(*h));
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		h->count += percpu[cpu].count;
+		h->sum += percpu[cpu].sum;
+		for (i = 0; i < NR_STALL_BUCKETS; i++)
+			h->buckets[i] += percpu[cpu].buckets[i];
+	}
+	return 1;
+}
+
+/*
+ * Upper bound in usec of the bucket the 99th percentile of stalls
+ * counted in delta falls in
+ */
+static unsigned long long
+stall_p99(struct stall_hist *delta)
+{
+	unsigned long long seen = 0, target = delta->count * 99 / 100;
+	int i;
+
+	for (i = 0; i < NR_STALL_BUCKETS - 1; i++) {
+		seen += delta->buckets[i];
+		if (seen > target)
+			break;
+	}
+	return 1ULL << i;
+}
+
+/*
+ * Read what was added to the histograms since the last cycle and
+ * update the stall time of each node and the totals
+ */
+void
+read_stalls(long long now)
+{
+	struct node_state *node;
+	int fd, kind, i;
+	double secs;
+
+	if (!stalls_traced)
+		return;
+	fd = bpf_map__fd(skel->maps.hists);
+	secs = (last_msecs && (now > last_msecs)) ?
+		(now - last_msecs) / 1000.0 : 0;
+
+	for_each_node(node) {
+		if (node->nid >= MAX_STALL_NODES)
+			continue;
+		for (kind = 0; kind < NR_STALL_KINDS; kind++) {
+			struct stall_hist h, delta, *prev = &last[kind][node->nid];
+			double *stall_time = (kind == STALL_RECLAIM) ?
+				&node->reclaim_stall_time :
+				&node->compact_stall_time;
+
+			if (!read_hist(fd, kind, node->nid, &h))
+				continue;
+			delta.count = h.count - prev->count;
+			delta.sum = h.sum - prev->sum;
+			for (i = 0; i < NR_STALL_BUCKETS; i++)
+				delta.buckets[i] = h.buckets[i] -
+					prev->buckets[i];
+			*prev = h;
+			stall_totals.count[kind] += delta.count;
+			stall_totals.nsecs[kind] += delta.sum;
+
+			if (secs == 0)
+				continue;
+			*stall_time = (*stall_time * (STALL_SMOOTHING - 1) +
+				delta.sum / 1000000.0 / secs) / STALL_SMOOTHING;
+			if (delta.count) {
+				log_info(4, "Node %d: %llu %s, p99<=%lluus, %.1f msec/sec stalled",
+					node->nid, delta.count,
+					stall_names[kind], stall_p99(&delta),
+					*stall_time);
+			}
+		}
+	}
+	last_msecs = now;
+}
+
+void
+close_stalls(void)
+{
+	stall_bpf__destroy(skel);
+	skel = NULL;
+	free(percpu);
+	percpu = NULL;
+	stalls_traced = 0;
+}
+#else
+int
+open_stalls(void)
+{
+	log_info(2, "Built without eBPF support, stalls are counted from /proc/vmstat only");
+	return 0;
+}
+
+void
+read_stalls(long long now)
+{
+}
+
+void
+close_stalls(void)
+{
+}
+#endif /* HAVE_BPF */
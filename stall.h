@@ -0,0 +1,85 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef STALL_H
+#define	STALL_H
+
+/*
+ * Shared by the eBPF program in stall.bpf.c and the collector in
+ * stall.c that reads what it gathers. The eBPF program gets its types
+ * from vmlinux.h.
+ */
+#ifndef __bpf__
+#include <linux/types.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Time application threads spend stalled in direct reclaim and direct
+ * compaction is timed in the kernel between the begin and end
+ * tracepoints of each, and added to a histogram per kind and node.
+ * Stalls are counted in power of 2 buckets of usec like the daemon's
+ * own timings: bucket i holds stalls of less than 2^i usec, the last
+ * one everything longer. Stalls on nodes with an id of MAX_STALL_NODES
+ * or more are not counted.
+ */
+#define MAX_STALL_NODES		64
+#define NR_STALL_BUCKETS	26
+
+enum stall_kind {
+	STALL_RECLAIM,
+	STALL_COMPACT,
+	NR_STALL_KINDS
+};
+
+struct stall_hist {
+	__u64 count;
+	__u64 sum;			/* nsec */
+	__u64 buckets[NR_STALL_BUCKETS];
+};
+
+#ifndef __bpf__
+/*
+ * Total time stalled on all nodes since the collector was started
+ */
+struct stall_totals {
+	unsigned long long count[NR_STALL_KINDS];
+	unsigned long long nsecs[NR_STALL_KINDS];
+};
+
+extern int stall_tracing;
+extern int stalls_traced;
+extern struct stall_totals stall_totals;
+
+extern int open_stalls(void);
+extern void read_stalls(long long);
+extern void close_stalls(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STALL_H */
@@ -0,0 +1,132 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include "predict.h"
+#include "stats.h"
+
+unsigned long long stat_counters[NR_STAT_COUNTERS];
+struct stat_hist stat_timers[NR_STAT_TIMERS];
+
+const char *stat_counter_names[NR_STAT_COUNTERS] = {
+	[STAT_CYCLES] = "cycles",
+	[STAT_COMPACT_REQUESTS] = "compact_requests",
+	[STAT_COMPACT_BUSY] = "compact_busy",
+	[STAT_COMPACT_OVER_BUDGET] = "compact_over_budget",
+	[STAT_RECLAIM_REQUESTS] = "reclaim_requests",
+	[STAT_WSF_UP] = "wsf_up",
+	[STAT_WSF_DOWN] = "wsf_down",
+	[STAT_WSF_CLAMPED] = "wsf_clamped",
+	[STAT_WSF_AT_MAX] = "wsf_at_max",
+	[STAT_WSF_NO_HEADROOM] = "wsf_no_headroom",
+};
+
+const char *stat_timer_names[NR_STAT_TIMERS] = {
+	[STAT_CYCLE_TIME] = "cycle",
+	[STAT_BUDDYINFO_TIME] = "buddyinfo",
+	[STAT_ZONEINFO_TIME] = "zoneinfo",
+	[STAT_VMSTAT_TIME] = "vmstat",
+	[STAT_PAGETYPE_TIME] = "pagetypeinfo",
+	[STAT_PREDICT_TIME] = "predict",
+	[STAT_COMPACT_TIME] = "compact",
+	[STAT_RECLAIM_TIME] = "reclaim",
+};
+
+/*
+ * Add a timing of usecs to a histogram
+ */
+void
+stat_record(enum stat_timer t, unsigned long long usecs)
+{
+	struct stat_hist *h = &stat_timers[t];
+	int i = 0;
+
+	while ((i < NR_STAT_BUCKETS - 1) && (usecs >= (1ULL << i)))
+		i++;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += usecs;
+	if (usecs > h->max)
+		h->max = usecs;
+}
+
+/*
+ * Record the time since start, taken with stat_start()
+ */
+void
+stat_stop(enum stat_timer t, struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stat_record(t, (end.tv_sec - start->tv_sec) * 1000000LL +
+			(end.tv_nsec - start->tv_nsec) / 1000);
+}
+
+/*
+ * Upper bound in usec of the bucket the pct percentile falls in
+ */
+unsigned long long
+stat_percentile(enum stat_timer t, double pct)
+{
+	struct stat_hist *h = &stat_timers[t];
+	unsigned long long seen = 0, target;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	target = h->count * pct / 100;
+	for (i = 0; i < NR_STAT_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			break;
+	}
+	if ((i == NR_STAT_BUCKETS - 1) || ((1ULL << i) > h->max))
+		return h->max;
+	return 1ULL << i;
+}
+
+/*
+ * Log all counters and a summary of each timer that has been hit
+ */
+void
+stats_dump(void)
+{
+	char line[512];
+	int i, len = 0;
+
+	for (i = 0; i < NR_STAT_COUNTERS; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%s%s=%llu",
+				i ? " " : "", stat_counter_names[i],
+				stat_counters[i]);
+	pr_info("Stats: %s", line);
+
+	for (i = 0; i < NR_STAT_TIMERS; i++) {
+		struct stat_hist *h = &stat_timers[i];
+
+		if (h->count == 0)
+			continue;
+		pr_info("Stats: %s count=%llu avg=%lluus p50<=%lluus p99<=%lluus max=%lluus",
+			stat_timer_names[i], h->count, h->sum / h->count,
+			stat_percentile(i, 50), stat_percentile(i, 99),
+			h->max);
+	}
+}
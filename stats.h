@@ -0,0 +1,102 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef STATS_H
+#define	STATS_H
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters and timings the daemon keeps of its own work, so the cost
+ * of a cycle and the reasons it did or did not act can be looked at on
+ * a running system. They are only updated from the main loop.
+ */
+enum stat_counter {
+	STAT_CYCLES,
+	STAT_COMPACT_REQUESTS,		/* Compaction started on a node */
+	STAT_COMPACT_BUSY,		/* Skipped, previous one not done */
+	STAT_COMPACT_OVER_BUDGET,	/* Skipped, budget used up */
+	STAT_RECLAIM_REQUESTS,		/* Reclaim through memory.reclaim */
+	STAT_WSF_UP,
+	STAT_WSF_DOWN,
+	STAT_WSF_CLAMPED,		/* New WSF capped at max WSF */
+	STAT_WSF_AT_MAX,		/* Not raised, at max WSF already */
+	STAT_WSF_NO_HEADROOM,		/* Not raised, too few free pages */
+	NR_STAT_COUNTERS
+};
+
+enum stat_timer {
+	STAT_CYCLE_TIME,		/* A whole cycle of the main loop */
+	STAT_BUDDYINFO_TIME,		/* Read of /proc/buddyinfo */
+	STAT_ZONEINFO_TIME,		/* Read and parse of /proc/zoneinfo */
+	STAT_VMSTAT_TIME,		/* Reclaim counters of system and nodes */
+	STAT_PAGETYPE_TIME,		/* Read and parse of /proc/pagetypeinfo */
+	STAT_PREDICT_TIME,		/* predict() of one node */
+	STAT_COMPACT_TIME,		/* Write to compact_memory by the worker */
+	STAT_RECLAIM_TIME,		/* Write to memory.reclaim by the worker */
+	NR_STAT_TIMERS
+};
+
+/*
+ * Timings are counted in power of 2 buckets of usec. Bucket i holds
+ * timings of less than 2^i usec, the last one everything longer.
+ */
+#define NR_STAT_BUCKETS		26
+
+struct stat_hist {
+	unsigned long long count;
+	unsigned long long sum;		/* usec */
+	unsigned long long max;		/* usec */
+	unsigned long long buckets[NR_STAT_BUCKETS];
+};
+
+extern unsigned long long stat_counters[NR_STAT_COUNTERS];
+extern struct stat_hist stat_timers[NR_STAT_TIMERS];
+extern const char *stat_counter_names[NR_STAT_COUNTERS];
+extern const char *stat_timer_names[NR_STAT_TIMERS];
+
+static inline void
+stat_inc(enum stat_counter c)
+{
+	stat_counters[c]++;
+}
+
+static inline void
+stat_start(struct timespec *start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+extern void stat_record(enum stat_timer, unsigned long long);
+extern void stat_stop(enum stat_timer, struct timespec *);
+extern unsigned long long stat_percentile(enum stat_timer, double);
+extern void stats_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
@@ -0,0 +1,589 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+#include "trace.h"
+
+#define	TRACE_MAGIC	0x43524d4d	/* "MMRC" */
+#define	TRACE_VERSION	1
+#define	TRACE_MAX_PATHS	1024
+
+/*
+ * Layout of a trace. A header is followed by records, each a struct
+ * trace_rec followed by len bytes of payload padded to 8 bytes. Every
+ * run of the daemon appends a START record and what it read while
+ * starting up, then a CYCLE record at the start of each cycle of the
+ * main loop followed by what it read during the cycle. A PATH record
+ * names a file the first time the file is opened in a run, FILE
+ * records carry its contents and VALUE records carry an input that is
+ * not read from a file as a 64 bit integer. Contents of a file are
+ * recorded only when they have changed since they were last recorded.
+ *
+ * Of /proc/zoneinfo only the zone headers, watermarks and managed
+ * pages are recorded. The rest of it, per-cpu pagesets above all,
+ * changes every cycle and is not looked at. A cycle then takes some
+ * 4 KB for /proc/vmstat, 1.5 KB for the vmstat of each node and a few
+ * hundred bytes for buddyinfo and sample times on a 6.x kernel, plus
+ * pagetypeinfo if PAGETYPE_MODE is on. zoneinfo adds some 500 bytes
+ * per node in cycles where watermarks have changed.
+ */
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+enum trace_rec_type {
+	TRACE_REC_START,
+	TRACE_REC_CYCLE,
+	TRACE_REC_PATH,		/* id is path id, payload is the path */
+	TRACE_REC_FILE,		/* id is path id, payload is contents */
+	TRACE_REC_VALUE,	/* id is value type, payload is int64_t */
+};
+
+struct trace_rec {
+	uint16_t type;
+	uint16_t id;
+	uint32_t len;
+};
+
+#define TRACE_ALIGN(len)	(((len) + 7) & ~(size_t)7)
+
+int trace_mode = TRACE_OFF;
+
+/*
+ * State of recording. Only inputs of the main loop are recorded, reads
+ * made by worker threads are not.
+ */
+static FILE *trace_file;
+static pthread_t trace_thread;
+static char *rec_paths[TRACE_MAX_PATHS];
+static int rec_seen[TRACE_MAX_PATHS];
+static uint64_t rec_hash[TRACE_MAX_PATHS];
+static size_t rec_len[TRACE_MAX_PATHS];
+static int rec_zoneinfo[TRACE_MAX_PATHS];	/* Path is /proc/zoneinfo */
+static char *rec_buf;				/* Contents being recorded */
+static size_t rec_buf_size;
+static int nr_rec_paths;
+
+/*
+ * State of replay. The trace is mapped in whole and replayed a frame,
+ * the records of one cycle, at a time. Files are looked up by path
+ * across runs, and the latest contents recorded for a path are what
+ * reading the file returns. Values are returned in the order they
+ * were recorded within the frame, then the last one recorded is
+ * returned again.
+ */
+static const char *replay_map;
+static size_t replay_size, replay_pos;
+static const char *replay_names[TRACE_MAX_PATHS];
+static const char *replay_data[TRACE_MAX_PATHS];
+static size_t replay_len[TRACE_MAX_PATHS];
+static int nr_replay_names;
+static int replay_ids[TRACE_MAX_PATHS];		/* Path id to name */
+static size_t frame_start, frame_end;
+static size_t value_pos[NR_TRACE_VALUES];
+static long long frame_value[NR_TRACE_VALUES], last_value[NR_TRACE_VALUES];
+static int has_frame_value[NR_TRACE_VALUES], has_last_value[NR_TRACE_VALUES];
+
+static int
+recording(void)
+{
+	return (trace_mode == TRACE_RECORD) &&
+		pthread_equal(pthread_self(), trace_thread);
+}
+
+/* FNV-1a hash of contents of a file */
+static uint64_t
+hash_contents(const char *buf, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (len--)
+		hash = (hash ^ (unsigned char)*buf++) * 0x100000001b3ULL;
+	return hash;
+}
+
+static void
+write_rec(int type, int id, const void *payload, size_t len)
+{
+	static const char pad[8];
+	struct trace_rec rec;
+
+	rec.type = type;
+	rec.id = id;
+	rec.len = len;
+	if ((fwrite(&rec, sizeof(rec), 1, trace_file) != 1) ||
+	    (len && (fwrite(payload, len, 1, trace_file) != 1)) ||
+	    ((TRACE_ALIGN(len) > len) &&
+	     (fwrite(pad, TRACE_ALIGN(len) - len, 1, trace_file) != 1))) {
+		log_err("Failed to write trace, stopping recording (%s)", strerror(errno));
+		fclose(trace_file);
+		trace_file = NULL;
+		trace_mode = TRACE_OFF;
+	}
+}
+
+/*
+ * Read the record at offset pos of the trace being replayed. Returns
+ * offset of the next record or 0 if the record is cut short.
+ */
+static size_t
+read_rec(size_t pos, struct trace_rec *rec, const char **payload)
+{
+	if (replay_size - pos < sizeof(*rec))
+		return 0;
+	memcpy(rec, replay_map + pos, sizeof(*rec));
+	pos += sizeof(*rec);
+	if (replay_size - pos < TRACE_ALIGN((size_t)rec->len))
+		return 0;
+	*payload = replay_map + pos;
+
+	return pos + TRACE_ALIGN((size_t)rec->len);
+}
+
+static int
+replay_name(const char *path)
+{
+	int i;
+
+	for (i = 0; i < nr_replay_names; i++)
+		if (strcmp(replay_names[i], path) == 0)
+			return i;
+	if (nr_replay_names == TRACE_MAX_PATHS)
+		return -1;
+	replay_names[nr_replay_names] = path;
+	return nr_replay_names++;
+}
+
+/*
+ * Take in the records up to the next CYCLE record, or the end of the
+ * trace, as the current frame. Returns 0 if the trace is corrupt.
+ */
+static int
+load_frame(void)
+{
+	struct trace_rec rec;
+	const char *payload;
+	int64_t val;
+	size_t next;
+	int i;
+
+	for (i = 0; i < NR_TRACE_VALUES; i++) {
+		if (has_frame_value[i]) {
+			last_value[i] = frame_value[i];
+			has_last_value[i] = 1;
+		}
+		has_frame_value[i] = 0;
+	}
+
+	frame_start = replay_pos;
+	while (replay_pos < replay_size) {
+		if ((next = read_rec(replay_pos, &rec, &payload)) == 0)
+			return 0;
+		if (rec.type == TRACE_REC_CYCLE)
+			break;
+
+		switch (rec.type) {
+		case TRACE_REC_START:
+			for (i = 0; i < TRACE_MAX_PATHS; i++)
+				replay_ids[i] = -1;
+			break;
+		case TRACE_REC_PATH:
+			if ((rec.id >= TRACE_MAX_PATHS) || (rec.len == 0) ||
+			    (payload[rec.len - 1] != 0))
+				return 0;
+			replay_ids[rec.id] = replay_name(payload);
+			break;
+		case TRACE_REC_FILE:
+			if ((rec.id >= TRACE_MAX_PATHS) ||
+			    (replay_ids[rec.id] < 0))
+				break;
+			replay_data[replay_ids[rec.id]] = payload;
+			replay_len[replay_ids[rec.id]] = rec.len;
+			break;
+		case TRACE_REC_VALUE:
+			if ((rec.id >= NR_TRACE_VALUES) ||
+			    (rec.len != sizeof(val)))
+				return 0;
+			memcpy(&val, payload, sizeof(val));
+			frame_value[rec.id] = val;
+			has_frame_value[rec.id] = 1;
+			break;
+		default:
+			return 0;
+		}
+		replay_pos = next;
+	}
+	frame_end = replay_pos;
+	for (i = 0; i < NR_TRACE_VALUES; i++)
+		value_pos[i] = frame_start;
+
+	return 1;
+}
+
+static int
+open_record(const char *path)
+{
+	struct trace_header hdr;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600)) == -1) {
+		log_err("Failed to open trace %s (%s)", path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &st) == -1) {
+		log_err("Failed to stat trace %s (%s)", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	if (st.st_size &&
+	    ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+	     (hdr.magic != TRACE_MAGIC) || (hdr.version != TRACE_VERSION))) {
+		log_err("%s is not a trace of this version", path);
+		close(fd);
+		return 0;
+	}
+	if ((trace_file = fdopen(fd, "a")) == NULL) {
+		log_err("Failed to open trace %s (%s)", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	trace_mode = TRACE_RECORD;
+	trace_thread = pthread_self();
+	if (st.st_size == 0) {
+		hdr.magic = TRACE_MAGIC;
+		hdr.version = TRACE_VERSION;
+		if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1) {
+			log_err("Failed to write trace %s (%s)", path, strerror(errno));
+			return 0;
+		}
+	}
+	write_rec(TRACE_REC_START, 0, NULL, 0);
+	if ((trace_mode != TRACE_RECORD) || (fflush(trace_file) != 0)) {
+		log_err("Failed to write trace %s (%s)", path, strerror(errno));
+		return 0;
+	}
+	log_info(1, "Recording trace to %s", path);
+
+	return 1;
+}
+
+static int
+open_replay(const char *path)
+{
+	struct trace_header hdr;
+	struct stat st;
+	void *map;
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		log_err("Failed to open trace %s (%s)", path, strerror(errno));
+		return 0;
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size < sizeof(hdr))) {
+		log_err("%s is not a trace", path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_err("Failed to map trace %s (%s)", path, strerror(errno));
+		return 0;
+	}
+	memcpy(&hdr, map, sizeof(hdr));
+	if ((hdr.magic != TRACE_MAGIC) || (hdr.version != TRACE_VERSION)) {
+		log_err("%s is not a trace of this version", path);
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	replay_map = map;
+	replay_size = st.st_size;
+	replay_pos = sizeof(hdr);
+	for (i = 0; i < TRACE_MAX_PATHS; i++)
+		replay_ids[i] = -1;
+	trace_mode = TRACE_REPLAY;
+	if (!load_frame()) {
+		log_err("Trace %s is corrupt", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Start recording to the trace at path, appending to it if it exists,
+ * or start replaying it, as given by mode.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+trace_open(const char *path, int mode)
+{
+	if (mode == TRACE_RECORD)
+		return open_record(path);
+	return open_replay(path);
+}
+
+/*
+ * Mark the start of a cycle of the main loop. When recording, all of
+ * the previous cycle is flushed out to the trace first. When replaying,
+ * the next cycle is loaded from the trace.
+ *
+ * Returns:
+ *	1	Cycle can go ahead
+ *	0	End of trace being replayed
+ */
+int
+trace_cycle(void)
+{
+	struct trace_rec rec;
+	const char *payload = NULL;
+	size_t next;
+
+	if (trace_mode == TRACE_RECORD) {
+		fflush(trace_file);
+		write_rec(TRACE_REC_CYCLE, 0, NULL, 0);
+	}
+	else if (trace_mode == TRACE_REPLAY) {
+		if (replay_pos >= replay_size)
+			return 0;
+		if ((next = read_rec(replay_pos, &rec, &payload)) == 0) {
+			log_warn("Trace is cut short or corrupt, stopping replay");
+			return 0;
+		}
+		replay_pos = next;
+		if (!load_frame()) {
+			log_warn("Trace is cut short or corrupt, stopping replay");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Record the input val of type, or when replaying, replace it with the
+ * value recorded. val is left alone if the trace has no value of that
+ * type.
+ */
+void
+trace_value(int type, long long *val)
+{
+	struct trace_rec rec;
+	const char *payload = NULL;
+	int64_t v;
+	size_t pos;
+
+	if (recording()) {
+		v = *val;
+		write_rec(TRACE_REC_VALUE, type, &v, sizeof(v));
+		return;
+	}
+	if (trace_mode != TRACE_REPLAY)
+		return;
+
+	for (pos = value_pos[type]; pos < frame_end; ) {
+		if ((pos = read_rec(pos, &rec, &payload)) == 0)
+			break;
+		if ((rec.type == TRACE_REC_VALUE) && (rec.id == type)) {
+			memcpy(&v, payload, sizeof(v));
+			*val = v;
+			value_pos[type] = pos;
+			return;
+		}
+	}
+	value_pos[type] = frame_end;
+	if (has_frame_value[type])
+		*val = frame_value[type];
+	else if (has_last_value[type])
+		*val = last_value[type];
+}
+
+/*
+ * Read CLOCK_MONOTONIC_RAW, which all sample times are taken from
+ */
+void
+sample_clock(struct timespec *spec)
+{
+	long long nsecs = 0;
+
+	if (trace_mode == TRACE_REPLAY) {
+		trace_value(TRACE_CLOCK, &nsecs);
+		spec->tv_sec = nsecs / 1000000000;
+		spec->tv_nsec = nsecs % 1000000000;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, spec);
+	if (trace_mode == TRACE_RECORD) {
+		nsecs = spec->tv_sec * 1000000000LL + spec->tv_nsec;
+		trace_value(TRACE_CLOCK, &nsecs);
+	}
+}
+
+/*
+ * Copy the lines of /proc/zoneinfo update_zone_watermarks() looks at,
+ * the "Node" line of each zone and its watermarks and managed pages,
+ * to out. Per-node stats, counters of the zone and per-cpu pagesets
+ * are left out. Returns the length of what was copied, which is never
+ * more than len.
+ */
+static size_t
+strip_zoneinfo(const char *buf, size_t len, char *out)
+{
+	const char *end = buf + len;
+	size_t out_len = 0;
+	int in_pagesets = 0;
+
+	while (buf < end) {
+		const char *eol = memchr(buf, '\n', end - buf);
+		const char *w = buf;
+		size_t n;
+
+		eol = eol ? eol + 1 : end;
+		while ((w < eol) && ((*w == ' ') || (*w == '\t')))
+			w++;
+		n = eol - w;
+		if ((n >= 4) && (strncmp(w, "Node", 4) == 0))
+			in_pagesets = 0;
+		else if ((n >= 8) && (strncmp(w, "pagesets", 8) == 0))
+			in_pagesets = 1;
+		if (((n >= 4) && (strncmp(w, "Node", 4) == 0)) ||
+		    (!in_pagesets &&
+		     (((n >= 4) && (strncmp(w, "min ", 4) == 0)) ||
+		      ((n >= 4) && (strncmp(w, "low ", 4) == 0)) ||
+		      ((n >= 5) && (strncmp(w, "high ", 5) == 0)) ||
+		      ((n >= 8) && (strncmp(w, "managed ", 8) == 0))))) {
+			memcpy(out + out_len, buf, eol - buf);
+			out_len += eol - buf;
+		}
+		buf = eol;
+	}
+	return out_len;
+}
+
+/*
+ * Find the path of a file being opened in the trace. When recording, a
+ * path not seen before is added to the trace.
+ */
+void
+trace_open_file(struct procfs_file *f)
+{
+	int i;
+
+	f->trace_id = -1;
+	if (trace_mode == TRACE_REPLAY) {
+		for (i = 0; i < nr_replay_names; i++)
+			if (strcmp(replay_names[i], f->path) == 0)
+				f->trace_id = i;
+		return;
+	}
+	if (!recording())
+		return;
+
+	for (i = 0; i < nr_rec_paths; i++) {
+		if (strcmp(rec_paths[i], f->path) == 0) {
+			f->trace_id = i;
+			return;
+		}
+	}
+	if ((nr_rec_paths == TRACE_MAX_PATHS) ||
+	    ((rec_paths[nr_rec_paths] = strdup(f->path)) == NULL)) {
+		log_warn("Not recording %s, too many files in trace", f->path);
+		return;
+	}
+	rec_zoneinfo[nr_rec_paths] = (strcmp(f->path, "/proc/zoneinfo") == 0);
+	f->trace_id = nr_rec_paths++;
+	write_rec(TRACE_REC_PATH, f->trace_id, f->path, strlen(f->path) + 1);
+}
+
+/*
+ * Record contents of a file just read, unless they are the same as
+ * last recorded
+ */
+void
+trace_record_file(struct procfs_file *f)
+{
+	const char *buf = f->buf;
+	size_t len = f->len;
+	uint64_t hash;
+	int id = f->trace_id;
+
+	if (!recording() || (id < 0))
+		return;
+
+	if (rec_zoneinfo[id]) {
+		if (rec_buf_size < len) {
+			char *p = realloc(rec_buf, len);
+
+			if (p == NULL) {
+				log_warn("Recording all of %s (%s)", f->path, strerror(errno));
+				goto record;
+			}
+			rec_buf = p;
+			rec_buf_size = len;
+		}
+		len = strip_zoneinfo(buf, len, rec_buf);
+		buf = rec_buf;
+	}
+
+record:
+	hash = hash_contents(buf, len);
+	if (rec_seen[id] && (rec_hash[id] == hash) && (rec_len[id] == len))
+		return;
+	rec_seen[id] = 1;
+	rec_hash[id] = hash;
+	rec_len[id] = len;
+	write_rec(TRACE_REC_FILE, id, buf, len);
+}
+
+/*
+ * Latest contents recorded for a file in the trace being replayed.
+ * Returns 0 if the trace has none.
+ */
+int
+trace_replay_file(struct procfs_file *f, const char **data, size_t *len)
+{
+	if ((f->trace_id < 0) || (replay_data[f->trace_id] == NULL))
+		return 0;
+
+	*data = replay_data[f->trace_id];
+	*len = replay_len[f->trace_id];
+	return 1;
+}
@@ -0,0 +1,70 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef TRACE_H
+#define	TRACE_H
+
+#include <time.h>
+#include "procfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A trace holds, for every cycle of the main loop, the contents of the
+ * files under /proc and /sys the daemon sampled and the other inputs
+ * it read, so the same decisions can be made again offline from them.
+ */
+enum trace_mode {
+	TRACE_OFF,
+	TRACE_RECORD,
+	TRACE_REPLAY
+};
+
+/*
+ * Inputs read other than through a struct procfs_file
+ */
+enum trace_value_type {
+	TRACE_CLOCK,		/* CLOCK_MONOTONIC_RAW, nsec */
+	TRACE_WSF,		/* watermark_scale_factor */
+	TRACE_PROACTIVENESS,	/* compaction_proactiveness */
+	TRACE_FREESWAP,		/* Free swap from sysinfo() */
+	TRACE_PMD_SIZE,		/* Size of a THP in bytes */
+	NR_TRACE_VALUES
+};
+
+extern int trace_mode;
+
+extern int trace_open(const char *, int);
+extern int trace_cycle(void);
+extern void trace_value(int, long long *);
+extern void sample_clock(struct timespec *);
+extern void trace_open_file(struct procfs_file *);
+extern void trace_record_file(struct procfs_file *);
+extern int trace_replay_file(struct procfs_file *, const char **, size_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H */
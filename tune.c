@@ -0,0 +1,215 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <string.h>
+#include "predict.h"
+#include "tune.h"
+
+/*
+ * Margins are evaluated once every lookback cycles. A margin is widened
+ * by TUNE_WIDEN percent when stalls it guards against came at
+ * TUNE_STALL_RATE per second or more over the period, and narrowed by
+ * TUNE_NARROW percent when the daemon acted in the period and stalls
+ * stayed below that. Widening faster than narrowing keeps the daemon
+ * from going back and forth between too narrow and just right. Where
+ * stalls are traced, the time threads spent stalled is what counts
+ * instead, TUNE_STALL_TIME msec per second or more widens a margin, so
+ * a few short stalls do not.
+ */
+#define TUNE_WIDEN		25
+#define TUNE_NARROW		5
+#define TUNE_STALL_RATE		0.1
+#define TUNE_STALL_TIME		1.0
+
+int auto_tune;
+struct tunables tunables = {
+	.reclaim_lead = DEF_RECLAIM_LEAD,
+	.compact_window = DEF_COMPACT_WINDOW,
+	.wsf_step = DEF_WSF_STEP,
+};
+
+/*
+ * Ranges tunables are kept in. A range with min of 0 has not been
+ * configured.
+ */
+struct tune_range reclaim_lead_range, compact_window_range, wsf_step_range;
+
+static unsigned long actions[NR_TUNE_ACTIONS];
+static int tune_cycles;
+
+static double
+clamp(double val, struct tune_range *r)
+{
+	if (val < r->min)
+		return r->min;
+	if (val > r->max)
+		return r->max;
+	return val;
+}
+
+/*
+ * Fill in ranges that were not configured, the whole of the default
+ * range with auto-tuning and the default value alone without, and
+ * start each tunable out at its default, or at the nearest bound if
+ * the default is outside the range
+ */
+static void
+init_range(struct tune_range *r, double *val, double def, double min,
+	double max)
+{
+	if (r->min == 0) {
+		r->min = auto_tune ? min : def;
+		r->max = auto_tune ? max : def;
+	}
+	*val = clamp(def, r);
+}
+
+void
+init_tunables(void)
+{
+	init_range(&reclaim_lead_range, &tunables.reclaim_lead,
+			DEF_RECLAIM_LEAD, 1, 12);
+	init_range(&compact_window_range, &tunables.compact_window,
+			DEF_COMPACT_WINDOW, 1, 20);
+	init_range(&wsf_step_range, &tunables.wsf_step, DEF_WSF_STEP, 5, 50);
+	if (auto_tune)
+		log_info(1, "Auto-tuning reclaim lead %.0f-%.0f, compaction window %.0f-%.0f, WSF step %.0f-%.0f%%",
+			reclaim_lead_range.min, reclaim_lead_range.max,
+			compact_window_range.min, compact_window_range.max,
+			wsf_step_range.min, wsf_step_range.max);
+}
+
+/*
+ * Pick up tuned values saved by a previous run, within the ranges
+ * configured now
+ */
+void
+restore_tunables(struct tunables *t)
+{
+	if (!auto_tune)
+		return;
+	tunables.reclaim_lead = clamp(t->reclaim_lead, &reclaim_lead_range);
+	tunables.compact_window = clamp(t->compact_window,
+					&compact_window_range);
+	tunables.wsf_step = clamp(t->wsf_step, &wsf_step_range);
+	log_info(2, "Restored reclaim lead %.2f, compaction window %.2f, WSF step %.1f%%",
+		tunables.reclaim_lead, tunables.compact_window,
+		tunables.wsf_step);
+}
+
+/*
+ * Note that the daemon acted in the current period
+ */
+void
+tune_acted(enum tune_action a)
+{
+	actions[a]++;
+}
+
+/*
+ * Move the value of a tunable in response to whether applications
+ * stalled over a period in which the daemon acted nacted times.
+ * Returns 1 if the value changed.
+ */
+static int
+adjust(double *val, struct tune_range *r, int stalled, unsigned long nacted)
+{
+	double old = *val;
+
+	if (stalled)
+		*val = clamp(*val * (100 + TUNE_WIDEN) / 100, r);
+	else if (nacted)
+		*val = clamp(*val * (100 - TUNE_NARROW) / 100, r);
+	return (*val != old);
+}
+
+/*
+ * Called every cycle with the latest /proc/vmstat counters and, if
+ * stalls are traced, the time stalled so far. Allocation stalls drive
+ * the reclaim lead and the WSF step, direct compaction stalls drive
+ * the compaction window.
+ */
+void
+tune_update(struct vmstat_counters *vc, const struct stall_totals *st,
+	long long now)
+{
+	static struct vmstat_counters last;
+	static struct stall_totals last_st;
+	static long long last_msecs;
+	double secs, alloc_rate, compact_rate, alloc_time, compact_time;
+	double lead, step, window;
+	int alloc_stalled, compact_stalled;
+
+	if (!auto_tune)
+		return;
+	if (last_msecs == 0) {
+		last = *vc;
+		if (st)
+			last_st = *st;
+		last_msecs = now;
+		return;
+	}
+	if ((++tune_cycles < lookback) || (now <= last_msecs))
+		return;
+
+	secs = (now - last_msecs) / 1000.0;
+	alloc_rate = (vc->allocstall - last.allocstall) / secs;
+	compact_rate = (vc->compact_stall - last.compact_stall) / secs;
+	if (st) {
+		alloc_time = (st->nsecs[STALL_RECLAIM] -
+			last_st.nsecs[STALL_RECLAIM]) / 1000000.0 / secs;
+		compact_time = (st->nsecs[STALL_COMPACT] -
+			last_st.nsecs[STALL_COMPACT]) / 1000000.0 / secs;
+		alloc_stalled = (alloc_time >= TUNE_STALL_TIME);
+		compact_stalled = (compact_time >= TUNE_STALL_TIME);
+	}
+	else {
+		alloc_time = compact_time = 0;
+		alloc_stalled = (alloc_rate >= TUNE_STALL_RATE);
+		compact_stalled = (compact_rate >= TUNE_STALL_RATE);
+	}
+	lead = tunables.reclaim_lead;
+	step = tunables.wsf_step;
+	window = tunables.compact_window;
+
+	if (adjust(&tunables.reclaim_lead, &reclaim_lead_range, alloc_stalled,
+			actions[TUNE_RECLAIM]) |
+	    adjust(&tunables.wsf_step, &wsf_step_range, alloc_stalled,
+			actions[TUNE_RECLAIM])) {
+		log_info(2, "Allocation stalls %.2f/sec, %.2f msec/sec stalled after %lu reclaim actions, reclaim lead %.2f -> %.2f, WSF step %.1f%% -> %.1f%%",
+			alloc_rate, alloc_time, actions[TUNE_RECLAIM], lead,
+			tunables.reclaim_lead, step, tunables.wsf_step);
+	}
+	if (adjust(&tunables.compact_window, &compact_window_range,
+			compact_stalled, actions[TUNE_COMPACT])) {
+		log_info(2, "Compaction stalls %.2f/sec, %.2f msec/sec stalled after %lu compactions, compaction window %.2f -> %.2f",
+			compact_rate, compact_time, actions[TUNE_COMPACT],
+			window, tunables.compact_window);
+	}
+
+	memset(actions, 0, sizeof(actions));
+	tune_cycles = 0;
+	last = *vc;
+	if (st)
+		last_st = *st;
+	last_msecs = now;
+}
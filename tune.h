@@ -0,0 +1,79 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef TUNE_H
+#define	TUNE_H
+
+#include "procfs.h"
+#include "stall.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Margins predictions and watermark changes are made with. Without
+ * auto-tuning, they stay at the values configured. With it, each one
+ * moves within its configured range from what was seen after the
+ * daemon acted: a margin is widened when applications still stalled
+ * and narrowed a little when the daemon acted and nothing stalled, so
+ * it settles at the narrowest margin that keeps stalls away.
+ */
+struct tune_range {
+	double min;
+	double max;
+};
+
+struct tunables {
+	double reclaim_lead;	/* Reclaim once high watermark is this many */
+				/* times the time to reclaim to it away */
+	double compact_window;	/* Look ahead for compaction, in lookback */
+				/* windows of samples */
+	double wsf_step;	/* Percent watermark_scale_factor is raised by */
+};
+
+#define DEF_RECLAIM_LEAD	3.0
+#define DEF_COMPACT_WINDOW	5.0
+#define DEF_WSF_STEP		10.0
+
+enum tune_action {
+	TUNE_RECLAIM,
+	TUNE_COMPACT,
+	NR_TUNE_ACTIONS
+};
+
+extern int auto_tune;
+extern struct tunables tunables;
+extern struct tune_range reclaim_lead_range, compact_window_range,
+			wsf_step_range;
+
+extern void init_tunables(void);
+extern void restore_tunables(struct tunables *);
+extern void tune_acted(enum tune_action);
+extern void tune_update(struct vmstat_counters *, const struct stall_totals *,
+			long long);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TUNE_H */
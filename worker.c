@@ -0,0 +1,500 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "predict.h"
+#include "procfs.h"
+#include "worker.h"
+
+#define	COMPACT_PATH_FORMAT	"/sys/devices/system/node/node%d/compact"
+#define	BUDDYINFO		"/proc/buddyinfo"
+#define VMSTAT			"/proc/vmstat"
+#define	MOUNTS			"/proc/self/mounts"
+#define	RECLAIM_FILE		"memory.reclaim"
+
+/*
+ * Most requests waiting for the workers and most completed requests
+ * waiting for the main loop to pick them up
+ */
+#define MAX_WORK	64
+
+/*
+ * Requests are queued in the order they are made. A request for the
+ * same node and type as one that is queued or in progress is dropped
+ * since the work it asks for is already under way. There is a worker
+ * thread for each node, up to MAX_WORKERS, so a long compaction of one
+ * node does not hold up work on the others. Each worker takes the
+ * oldest request for a node no other worker is busy with, so requests
+ * for a node are carried out one at a time and in order. Each worker
+ * keeps its own copies of the files it samples, the ones in the main
+ * loop belong to the main thread.
+ */
+#define MAX_WORKERS	16
+
+struct worker {
+	int busy;
+	struct work w;			/* Request in progress */
+	struct procfs_file vmstat;
+	struct procfs_file buddyinfo;
+};
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct work pending[MAX_WORK];
+static int nr_pending;
+static struct worker workers[MAX_WORKERS];
+static int nr_workers;
+static struct work done[MAX_WORK];
+static int nr_done;
+
+/*
+ * memory.reclaim of the cgroup reclaim requests are written to, whether
+ * the kernel accepts the nodes= key and swappiness to pass along with
+ * each request (-1 to leave it to the kernel)
+ */
+static char reclaim_path[PATH_MAX];
+static int reclaim_nodes;
+static int reclaim_swappiness = -1;
+
+/*
+ * Initiate memory compaction in the kernel on a given node. The write
+ * returns once the kernel is done compacting the node.
+ *
+ * Returns:
+ *	0	Success
+ *	errno	Failure
+ */
+static int
+compact(int node_id)
+{
+	char compactpath[PATH_MAX];
+	int fd, err = 0;
+	char c = '1';
+
+	if (snprintf(compactpath, sizeof(compactpath), COMPACT_PATH_FORMAT,
+	    node_id) >= sizeof(compactpath))
+		return ENAMETOOLONG;
+
+	if ((fd = open(compactpath, O_WRONLY|O_NONBLOCK)) == -1)
+		return errno;
+
+	if (write(fd, &c, sizeof(c)) != sizeof(c))
+		err = errno;
+
+	close(fd);
+	return err;
+}
+
+/*
+ * Write a request to memory.reclaim. The write returns once the kernel
+ * has reclaimed the amount asked for, or fails with EAGAIN if it could
+ * not.
+ *
+ * Returns:
+ *	0	Success
+ *	errno	Failure
+ */
+static int
+write_reclaim(const char *req)
+{
+	size_t len = strlen(req);
+	int fd, err = 0;
+
+	if ((fd = open(reclaim_path, O_WRONLY)) == -1)
+		return errno;
+
+	if (write(fd, req, len) != len)
+		err = errno;
+
+	close(fd);
+	return err;
+}
+
+/*
+ * Reclaim pages from the cgroup on a given node, or from the cgroup
+ * as a whole if the kernel can not target a node
+ */
+static int
+reclaim(int node_id, unsigned long pages)
+{
+	char req[64];
+	int len;
+
+	len = snprintf(req, sizeof(req), "%lu",
+			pages * (unsigned long)getpagesize());
+	if (reclaim_nodes)
+		len += snprintf(req + len, sizeof(req) - len, " nodes=%d",
+				node_id);
+	if (reclaim_swappiness >= 0)
+		snprintf(req + len, sizeof(req) - len, " swappiness=%d",
+				reclaim_swappiness);
+
+	return write_reclaim(req);
+}
+
+/*
+ * Set up reclaim through memory.reclaim of cgroup, a path relative to
+ * where cgroup v2 is mounted. Writing 0 bytes to memory.reclaim returns
+ * without reclaiming anything, which is used to find out which keys the
+ * kernel accepts. nid is a node to try nodes= with. swappiness is
+ * dropped with a warning if the kernel does not support it.
+ *
+ * Returns:
+ *	1	Success
+ *	0	memory.reclaim not supported
+ */
+int
+open_reclaim(const char *cgroup, int nid, int swappiness)
+{
+	FILE *mounts;
+	struct mntent *mnt;
+	char req[32];
+	int err;
+
+	if ((mounts = setmntent(MOUNTS, "r")) == NULL)
+		return 0;
+	while ((mnt = getmntent(mounts)) != NULL)
+		if (strcmp(mnt->mnt_type, "cgroup2") == 0)
+			break;
+	if (mnt == NULL) {
+		endmntent(mounts);
+		log_warn("cgroup v2 is not mounted");
+		return 0;
+	}
+	err = (snprintf(reclaim_path, sizeof(reclaim_path), "%s/%s/"
+			RECLAIM_FILE, mnt->mnt_dir, cgroup) >=
+		sizeof(reclaim_path));
+	endmntent(mounts);
+	if (err)
+		return 0;
+
+	if ((err = write_reclaim("0")) != 0) {
+		log_warn("Can not reclaim through %s (%s)", reclaim_path,
+				strerror(err));
+		return 0;
+	}
+
+	snprintf(req, sizeof(req), "0 nodes=%d", nid);
+	reclaim_nodes = (write_reclaim(req) == 0);
+	if (!reclaim_nodes)
+		log_warn("Kernel does not support reclaim by node, reclaiming from whole cgroup");
+
+	reclaim_swappiness = -1;
+	if (swappiness >= 0) {
+		snprintf(req, sizeof(req), "0 swappiness=%d", swappiness);
+		if (write_reclaim(req) == 0)
+			reclaim_swappiness = swappiness;
+		else
+			log_warn("Kernel does not support swappiness for reclaim, ignoring it");
+	}
+
+	return 1;
+}
+
+/*
+ * Free pages of a node in blocks of order min_order and up. For
+ * compaction these are the pages it is expected to recover.
+ */
+static unsigned long
+free_pages(struct worker *wk, int nid, int min_order)
+{
+	struct scan s;
+	const char *zone;
+	size_t zonelen;
+	unsigned long nr_free[MAX_ORDER], total = 0;
+	int n, order;
+
+	if (!procfs_read(&wk->buddyinfo))
+		return 0;
+
+	scan_init(&s, &wk->buddyinfo);
+	while (scan_buddyinfo(&s, &n, &zone, &zonelen, nr_free)) {
+		if (n != nid)
+			continue;
+		for (order = min_order; order < MAX_ORDER; order++)
+			total += nr_free[order] << order;
+	}
+
+	return total;
+}
+
+static inline long long
+get_msecs(struct timespec *spec)
+{
+	return (spec->tv_sec * 1000LL) + (spec->tv_nsec / 1000000);
+}
+
+/*
+ * Carry out the request of worker wk and record what it took
+ */
+static void
+do_work(struct worker *wk)
+{
+	struct work *w = &wk->w;
+	struct timespec start, end;
+	int min_order = (w->type == WORK_COMPACT) ? max_compaction_order : 0;
+
+	memset(&w->before, 0, sizeof(w->before));
+	memset(&w->after, 0, sizeof(w->after));
+	read_vmstat(&wk->vmstat, &w->before);
+	w->free_before = free_pages(wk, w->nid, min_order);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	switch (w->type) {
+	case WORK_COMPACT:
+		w->error = compact(w->nid);
+		break;
+	case WORK_RECLAIM:
+		w->error = reclaim(w->nid, w->pages);
+		break;
+	default:
+		w->error = EINVAL;
+		break;
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+	read_vmstat(&wk->vmstat, &w->after);
+	w->free_after = free_pages(wk, w->nid, min_order);
+	w->msecs = get_msecs(&end) - get_msecs(&start);
+}
+
+/*
+ * Is a worker busy with a request for node nid. Called with work_lock
+ * held.
+ */
+static int
+node_busy(int nid)
+{
+	int i;
+
+	for (i = 0; i < nr_workers; i++)
+		if (workers[i].busy && (workers[i].w.nid == nid))
+			return 1;
+	return 0;
+}
+
+/*
+ * Take the oldest queued request for a node no worker is busy with.
+ * Counters in /proc/vmstat are system wide, so whatever else is in
+ * progress at the same time is counted in what a request took as well.
+ * Requests that overlap are marked as such so their cost is not taken
+ * for that of one request alone. Called with work_lock held, returns
+ * 0 if there is no request that can be started.
+ */
+static int
+take_work(struct worker *wk)
+{
+	int i, j;
+
+	for (i = 0; i < nr_pending; i++)
+		if (!node_busy(pending[i].nid))
+			break;
+	if (i == nr_pending)
+		return 0;
+
+	wk->w = pending[i];
+	memmove(&pending[i], &pending[i + 1],
+		(--nr_pending - i) * sizeof(struct work));
+	for (j = 0; j < nr_workers; j++) {
+		if (workers[j].busy) {
+			workers[j].w.overlapped = 1;
+			wk->w.overlapped = 1;
+		}
+	}
+	wk->busy = 1;
+	return 1;
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *wk = arg;
+
+	while (1) {
+		pthread_mutex_lock(&work_lock);
+		while (!take_work(wk))
+			pthread_cond_wait(&work_cond, &work_lock);
+		pthread_mutex_unlock(&work_lock);
+
+		do_work(wk);
+
+		pthread_mutex_lock(&work_lock);
+		wk->busy = 0;
+		if (nr_done == MAX_WORK)
+			memmove(&done[0], &done[1],
+				--nr_done * sizeof(struct work));
+		done[nr_done++] = wk->w;
+		/*
+		 * Requests for the node may have been held back while
+		 * this one was in progress
+		 */
+		pthread_cond_broadcast(&work_cond);
+		pthread_mutex_unlock(&work_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start a worker thread for each of count nodes, up to MAX_WORKERS.
+ * Workers run with normal scheduling policy even if the daemon runs
+ * with a real-time policy, so time the kernel spends compacting on
+ * their behalf does not compete with applications at real-time
+ * priority. Signals are left to the main thread. A stack_size of 0
+ * leaves the stack at the default size.
+ *
+ * Returns:
+ *	1	Success
+ *	0	Failure
+ */
+int
+start_workers(int count, size_t stack_size)
+{
+	pthread_attr_t attr;
+	struct sched_param param = { .sched_priority = 0 };
+	sigset_t set, oldset;
+	pthread_t tid;
+	int err = 0;
+
+	if (count < 1)
+		count = 1;
+	if (count > MAX_WORKERS)
+		count = MAX_WORKERS;
+	for (nr_workers = 0; nr_workers < count; nr_workers++) {
+		struct worker *wk = &workers[nr_workers];
+
+		if (!procfs_open(&wk->vmstat, VMSTAT) ||
+		    !procfs_open(&wk->buddyinfo, BUDDYINFO)) {
+			log_err("Failed to open files for worker thread (%s)", strerror(errno));
+			return 0;
+		}
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+	if (stack_size)
+		pthread_attr_setstacksize(&attr, stack_size);
+
+	/*
+	 * Workers are created with work_lock held so none of them
+	 * looks at the others before all are set up
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	pthread_mutex_lock(&work_lock);
+	for (count = 0; count < nr_workers; count++)
+		if ((err = pthread_create(&tid, &attr, worker_thread,
+				&workers[count])) != 0)
+			break;
+	nr_workers = count;
+	pthread_mutex_unlock(&work_lock);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (nr_workers == 0) {
+		log_err("Failed to start worker thread (%s)", strerror(err));
+		return 0;
+	}
+	if (err)
+		log_warn("Started only %d worker threads (%s)", nr_workers, strerror(err));
+	return 1;
+}
+
+/*
+ * Queue a request for the worker. For a reclaim request that is still
+ * queued, the number of pages to reclaim is raised to pages if that is
+ * more than was asked for before.
+ *
+ * Returns:
+ *	1	Request queued
+ *	0	Same request is already queued or in progress
+ *	-1	Too many requests queued
+ */
+int
+queue_work(int nid, enum work_type type, unsigned long pages)
+{
+	int i, ret = 1;
+
+	pthread_mutex_lock(&work_lock);
+	for (i = 0; i < nr_workers; i++) {
+		if (workers[i].busy && (workers[i].w.nid == nid) &&
+		    (workers[i].w.type == type)) {
+			ret = 0;
+			goto out;
+		}
+	}
+	for (i = 0; i < nr_pending; i++) {
+		if ((pending[i].nid == nid) && (pending[i].type == type)) {
+			if (pending[i].pages < pages)
+				pending[i].pages = pages;
+			ret = 0;
+			goto out;
+		}
+	}
+	if (nr_pending == MAX_WORK) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(&pending[nr_pending], 0, sizeof(struct work));
+	pending[nr_pending].nid = nid;
+	pending[nr_pending].type = type;
+	pending[nr_pending].pages = pages;
+	nr_pending++;
+	pthread_cond_broadcast(&work_cond);
+out:
+	pthread_mutex_unlock(&work_lock);
+	return ret;
+}
+
+/*
+ * Get the oldest request the worker has completed. Returns 1 if one was
+ * copied to w, 0 if there are none.
+ */
+int
+work_done(struct work *w)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&work_lock);
+	if (nr_done) {
+		*w = done[0];
+		memmove(&done[0], &done[1], --nr_done * sizeof(struct work));
+		ret = 1;
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	return ret;
+}
@@ -0,0 +1,71 @@
+/*
+ *  * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *  * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *  *
+ *  * This code is free software; you can redistribute it and/or modify it
+ *  * under the terms of the GNU General Public License version 2 only, as
+ *  * published by the Free Software Foundation.
+ *  *
+ *  * This code is distributed in the hope that it will be useful, but WITHOUT
+ *  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  * version 2 for more details (a copy is included in the LICENSE file that
+ *  * accompanied this code).
+ *  *
+ *  * You should have received a copy of the GNU General Public License version
+ *  * 2 along with this work; if not, write to the Free Software Foundation,
+ *  * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  *
+ *  * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ *  * or visit www.oracle.com if you need additional information or have any
+ *  * questions.
+ *  */
+#ifndef WORKER_H
+#define	WORKER_H
+
+#include "procfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Requests the main loop hands off to the worker threads, so a write to
+ * the kernel that takes a long time to complete does not hold up
+ * sampling, nor work on other nodes
+ */
+enum work_type {
+	WORK_COMPACT,
+	WORK_RECLAIM,
+	NR_WORK_TYPES
+};
+
+/*
+ * A request for a node and, once the worker is done with it, what it
+ * took to complete
+ */
+struct work {
+	int nid;
+	enum work_type type;
+	unsigned long pages;		/* Pages to reclaim */
+	int error;			/* errno if request failed, else 0 */
+	long long msecs;		/* Wall time taken */
+	struct vmstat_counters before;	/* /proc/vmstat before and after */
+	struct vmstat_counters after;
+	unsigned long free_before;	/* Free pages of the node, in blocks */
+	unsigned long free_after;	/* of max_compaction_order and up */
+					/* for compaction */
+	int overlapped;			/* Other requests were in progress, */
+					/* vmstat counts their work too */
+};
+
+extern int start_workers(int, size_t);
+extern int open_reclaim(const char *, int, int);
+extern int queue_work(int, enum work_type, unsigned long);
+extern int work_done(struct work *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORKER_H */